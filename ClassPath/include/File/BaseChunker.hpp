@@ -149,7 +149,7 @@ namespace File
             Since this is supposed to be used only when restoring, it does not
             have to be utterly fast.
             This performs a O(n) search in the chunk array if no offset provided,
-            else it check the chunk at the given offset and might work in O(log(N))
+            else it checks the chunk starting at the given offset in O(1), and might work in O(log(N))
             @param checksum     The chunk checksum to extract
             @param likelyOffset If provided, will check this offset first, and if the
                                 checksum is good will return the chunk at the given offset,
@@ -161,7 +161,13 @@ namespace File
     Chunk * MultiChunk::findChunk(const uint8 * checksum, const size_t likelyOffset) const
     {
         if (likelyOffset != (size_t)-1)
-        {   // This is O(log(N))
+        {   // The offset is usually exact, so check the chunk that's starting there first
+            if (likelyOffset + Chunk::HeaderSize <= chunkArray.getSize())
+            {
+                Chunk * chunk = (Chunk*)&chunkArray.getConstBuffer()[likelyOffset];
+                if (likelyOffset + Chunk::HeaderSize + chunk->size <= chunkArray.getSize() && memcmp(chunk->checksum, checksum, ArrSz(chunk->checksum)) == 0) return chunk;
+            }
+            // Else, this is O(log(N))
             size_t index = chunkPos.indexOfSorted(likelyOffset);
             Chunk * chunk = getChunk(index);
             if (chunk && memcmp(chunk->checksum, checksum, ArrSz(chunk->checksum)) == 0) return chunk;
@@ -20,6 +20,27 @@
 #include "ClassPath/include/Logger/Logger.hpp"
 // We need StringMap too
 #include "ClassPath/include/Hash/StringMap.hpp"
+// We need to wipe the keys from memory
+#include "ClassPath/include/Crypto/SafeMemclean.hpp"
+#ifdef _POSIX
+// We need low level file access for sparse files
+#include <fcntl.h>
+#include <sys/stat.h>
+// And file locking for the change journal
+#include <sys/file.h>
+// And the descriptor limit for restoring
+#include <sys/resource.h>
+// And vectored writes for restoring
+#include <sys/uio.h>
+#endif
+#ifdef _LINUX
+// The change journal watcher is using inotify
+#include <sys/inotify.h>
+#include <poll.h>
+// And file cloning for restoring identical files
+#include <sys/ioctl.h>
+#include <linux/fs.h>
+#endif
 
 // The global option map
 Strings::StringMap optionsMap;
@@ -64,8 +85,8 @@ namespace Frost
     __attribute__((format_arg(1)))
 #endif
     const char * __trans__(const char * format)
-    {   // Monothreaded conversion here, it's a shame
-        static String translated;
+    {   // Per thread conversion here, since restoring is using worker threads
+        static thread_local String translated;
         translated = format;
         return (const char*)translated;
     }
@@ -284,6 +305,8 @@ namespace Frost
         bool IndexFile::appendChunk(Chunk & chunk, const uint32 forceUID)
         {
             if (readOnly) return false;
+            // The chunk UIDs with the top bit set can't be stored in a chunk list, they are read as zero extents
+            if (ChunkList::isZeroExtent(forceUID ? forceUID : maxChunkID + 1)) return false;
             if (!forceUID) chunk.UID = maxChunkID++ + 1;
             AccScopeProfiler(1);
             // local.chunks.insertSorted(chunk);
@@ -318,6 +341,18 @@ namespace Frost
             return false;
         }
 
+        // Replace a reopened multichunk
+        bool IndexFile::replaceMultichunk(Multichunk * mchunk, ChunkList * list)
+        {
+            Utils::ScopePtr<Multichunk> record(mchunk);
+            if (readOnly || !mchunk || !list || !multichunksRO.getValue(mchunk->UID)) { delete list; return false; }
+            mchunk->listID = maxChunkListID + 1;
+            list->UID = maxChunkListID + 1;
+            if (!chunkList.storeValue(list->UID, list)) { delete list; return false; }
+            maxChunkListID++;
+            return replacedMultichunks.storeValue(mchunk->UID, record.Forget(), true);
+        }
+
         bool IndexFile::appendFileItem(FileTree::Item * item, ChunkList * list)
         {
             if (readOnly || !item || !list) return false;
@@ -487,10 +522,12 @@ namespace Frost
             // Fuse the chunks
             maxChunkID = 0;
             consolidated.Clear();
+            chunkLocations.Clear();
             chunkIndices = 0;
             maxChunkListID = 0;
             multichunksRO.clearTable();
             multichunks.clearTable();
+            replacedMultichunks.clearTable();
             maxMultichunkID = 0;
             arguments.arguments.Clear();
             metadata.info.Clear();
@@ -533,6 +570,7 @@ namespace Frost
                     Multichunk * mc = MapAs(Multichunk, filePtr, multichunkOffset);
                     if (!mc->isCorrect(file->fullSize(), file->fullSize() - multichunkOffset)) return String::Print(TRANS("Invalid %u-th multichunk in revision %u"), i, c->revision);
                     if (mc->UID > maxMultichunkID) maxMultichunkID = mc->UID;
+                    // The catalogs are read from the last one, so a reopened multichunk's previous records are ignored
                     multichunksRO.storeValue(mc->UID, mc);
 
                     multichunkOffset += mc->getSize();
@@ -566,7 +604,15 @@ namespace Frost
                 return String::Print(TRANS("Could not load the file tree for revision %u"), catalog->revision);
 
             ChunkUIDSorter sorter;
-            if (!readWrite) Container::Algorithms<Container::PlainOldData<Chunk>::Array>::sortContainer(consolidated.chunks, sorter); // This is only using UID to sort
+            if (!readWrite)
+            {
+                // A compacted index already stores its chunks sorted
+                bool sorted = true;
+                for (size_t i = 1; sorted && i < consolidated.chunks.getSize(); i++)
+                    sorted = consolidated.chunks.getElementAtUncheckedPosition(i - 1).UID < consolidated.chunks.getElementAtUncheckedPosition(i).UID;
+                if (!sorted) Container::Algorithms<Container::PlainOldData<Chunk>::Array>::sortContainer(consolidated.chunks, sorter); // This is only using UID to sort
+                buildChunkLocations();
+            }
 //            else            Container::Algorithms<Container::PlainOldData<Chunk>::Array>::sortContainer(consolidated.chunks, consolidated.chunks[0]); // This is using size and checksum to sort
             else
             {
@@ -577,16 +623,50 @@ namespace Frost
                     if (!chunkIndices->storeValue(consolidated.chunks.getElementAtUncheckedPosition(i).checksum, i))
                         return String::Print(TRANS("Could not insert the chunk at pos %u with UID: %u"), (uint32)i, consolidated.chunks.getElementAtUncheckedPosition(i).UID);
                 }
-                prevRevisionMaxChunkID = maxMultichunkID;
+                prevRevisionMaxChunkID = maxChunkID;
             }
             // Ok, done loading this file
             return "";
         }
+        // Build the chunk locations table
+        void IndexFile::buildChunkLocations()
+        {
+            chunkLocations.Clear();
+            for (uint32 i = 0; i <= maxChunkID; i++) chunkLocations.Append(ChunkLocation());
+            // The chunk's multichunk and size are in the consolidated array
+            for (size_t i = 0; i < consolidated.chunks.getSize(); i++)
+            {
+                const Chunk & chunk = consolidated.chunks.getElementAtUncheckedPosition(i);
+                ChunkLocation & location = chunkLocations.getElementAtUncheckedPosition(chunk.UID);
+                location.index = (uint32)i;
+                location.multichunkID = chunk.multichunkID;
+                location.size = chunk.size;
+            }
+            // While the chunk's offset is in its multichunk's chunk list
+            for (MultichunksRO::IterT iter = multichunksRO.getFirstIterator(); iter.isValid(); ++iter)
+            {
+                const Multichunk * mc = *iter;
+                const ChunkList * cl = getChunkList(mc->listID);
+                if (!cl || !cl->offset) continue;
+                for (size_t i = 0; i < cl->chunksID.getSize() && i < cl->offsets.getSize(); i++)
+                {
+                    const uint32 uid = cl->chunksID.getElementAtPosition(i);
+                    if (uid > maxChunkID) continue;
+                    ChunkLocation & location = chunkLocations.getElementAtUncheckedPosition(uid);
+                    if (location.multichunkID == mc->UID) location.offset = cl->offsets.getElementAtPosition(i);
+                }
+            }
+        }
         const Chunk * IndexFile::findChunk(const uint32 uid) const
         {
             size_t pos = 0;
             CondScopeProfiler;
             Chunk item(uid);
+            if (chunkLocations.getSize())
+            {   // O(1) search with the location table
+                const ChunkLocation * location = getChunkLocation(uid);
+                return location ? &getChunk(*location) : 0;
+            }
             if (readOnly)
             {   // The consolidated array is sorted by UID, so we can do a O(log N) search here
                 ChunkUIDSorter sorter;
@@ -608,11 +688,12 @@ namespace Frost
             if (!file || readOnly || (fileTree.items.getSize() == 0 && !metadata.modified))
             {
                 file = 0; catalog = 0; header = 0; chunkIndices = 0;
+                listRefs.Clear(); chunkRefs.Clear();
                 fileTree.Clear(); fileTreeRO.Clear();
                 metadata.Reset(); arguments.Reset();
-                consolidated.Clear();       prevRevisionMaxChunkID = 0; maxChunkID = 0;
+                consolidated.Clear();       prevRevisionMaxChunkID = 0; maxChunkID = 0; chunkLocations.Clear();
                 chunkListRO.clearTable();   chunkList.clearTable();     maxChunkListID = 0;
-                multichunks.clearTable();   multichunksRO.clearTable(); maxMultichunkID = 0;
+                multichunks.clearTable();   multichunksRO.clearTable(); maxMultichunkID = 0; replacedMultichunks.clearTable();
                 return ""; // Nothing to do or no modifications done
             }
 
@@ -621,12 +702,12 @@ namespace Frost
             // This will also consume all new chunks memory additionally
             for (size_t i = 0; i < consolidated.chunks.getSize(); i++)
             {
-                if (consolidated.chunks.getElementAtUncheckedPosition(i).multichunkID > prevRevisionMaxChunkID)
+                if (consolidated.chunks.getElementAtUncheckedPosition(i).UID > prevRevisionMaxChunkID)
                     local.chunks.Append(consolidated.chunks.getElementAtUncheckedPosition(i));
             }
 
             // Get a coarse approximation of the required size for the file expansion required
-            uint64 requiredAdditionalSize = fileTree.getSize() + (arguments.modified ? arguments.getSize() : 0) + (metadata.modified ? metadata.getSize() : 0) + multichunks.getSize() * Multichunk::getSize()
+            uint64 requiredAdditionalSize = fileTree.getSize() + (arguments.modified ? arguments.getSize() : 0) + (metadata.modified ? metadata.getSize() : 0) + (multichunks.getSize() + replacedMultichunks.getSize()) * Multichunk::getSize()
                                             + local.getSize() + Catalog::getSize();
             // We need to iterate the chunklists to know their size
             ChunkLists::IterT cl = chunkList.getFirstIterator();
@@ -636,6 +717,14 @@ namespace Frost
             uint64 initialCatalog = header->catalogOffset.fileOffset();
             if (!initialCatalog && initialSize > header->getSize()) initialCatalog = initialSize - Catalog::getSize();
 
+            // The reference counts are only valid for the file's current state, so load them before it grows
+            bool counted = false;
+            if (refCountsPath)
+            {
+                counted = !initialCatalog || loadRefCounts(refCountsPath);
+                if (!initialCatalog) { listRefs.Clear(); chunkRefs.Clear(); }
+            }
+
             // Make sure we can allocate such size now on file
             Offset prevOptMetadata = catalog->optionMetadata, prevFilterArg = catalog->optionFilterArg;
             if (!file->map(0, file->fullSize() + requiredAdditionalSize))
@@ -657,16 +746,20 @@ namespace Frost
             cat.chunkLists.fileOffset(wo);
             cat.chunkListsCount = chunkList.getSize();
             {
+                bool zeroExtents = false;
                 ChunkLists::IterT iter = chunkList.getFirstIterator();
                 while (iter.isValid())
                 {
+                    zeroExtents = zeroExtents || (*iter)->hasZeroExtent();
                     (*iter)->write(filePtr + wo); wo += (*iter)->getSize();
                     ++iter;
                 }
+                // The previous versions can't read the zero extents, so prevent them from opening this index
+                if (zeroExtents) (MapAs(MainHeader, filePtr, 0))->version = MainHeader::ZeroExtentsVersion;
             }
             // Write the multichunk list
             cat.multichunks.fileOffset(wo);
-            cat.multichunksCount = multichunks.getSize();
+            cat.multichunksCount = multichunks.getSize() + replacedMultichunks.getSize();
             {
                 Multichunks::IterT iter = multichunks.getFirstIterator();
                 while (iter.isValid())
@@ -674,6 +767,12 @@ namespace Frost
                     (*iter)->write(filePtr + wo); wo += (*iter)->getSize();
                     ++iter;
                 }
+                // The reopened multichunks' new records are saved with this revision, and replace the previous ones when the index is read
+                for (iter = replacedMultichunks.getFirstIterator(); iter.isValid(); ++iter)
+                {
+                    (*iter)->write(filePtr + wo); wo += (*iter)->getSize();
+                }
+                replacedMultichunks.clearTable();
             }
             // We need to write the file tree too
             cat.fileTree.fileOffset(wo);
@@ -696,11 +795,550 @@ namespace Frost
             // Now we can write the catalog
             if (wo + cat.getSize() != file->fullSize()) return TRANS("Invalid file size computation");
             cat.write(filePtr + wo);
+            // The counts are a cache for purging, so if they can't be saved, they'll be rebuilt there
+            if (counted)
+            {
+                addReferences(fileTree);
+                saveRefCounts(refCountsPath, cat.revision, file->fullSize());
+            }
             file->unmap(true);
             file = 0;
             return "";
         }
 
+        // Save a checkpoint of the revision being built
+        String IndexFile::saveCheckpoint(const String & path, CheckpointHeader & stats)
+        {
+            if (!file || readOnly) return TRANS("No revision being built");
+            // Only the chunks in closed multichunks are stored in the remote, the others will be lost if interrupted
+            Chunks local(fileTree.revision);
+            Container::PlainOldData<uint32>::Array pending; // Sorted since chunks are appended in UID order
+            for (size_t i = 0; i < consolidated.chunks.getSize(); i++)
+            {
+                Chunk & chunk = consolidated.chunks.getElementAtUncheckedPosition(i);
+                if (chunk.UID <= prevRevisionMaxChunkID) continue;
+                if (multichunks.getValue(chunk.multichunkID)) local.chunks.Append(chunk);
+                else pending.Append(chunk.UID);
+            }
+            // Then only keep the chunk lists that don't refer to those chunks
+            Container::PlainOldData<ChunkList *>::Array lists;
+            uint64 listsSize = 0;
+            for (ChunkLists::IterT iter = chunkList.getFirstIterator(); iter.isValid(); ++iter)
+            {
+                ChunkList * list = *iter;
+                bool stored = true;
+                for (size_t i = 0; stored && !list->offset && pending.getSize() && i < list->chunksID.getSize(); i++)
+                    stored = ChunkList::isZeroExtent(list->chunksID[i]) || pending.indexOfSorted(list->chunksID[i]) == pending.getSize();
+                if (stored) { lists.Append(list); listsSize += list->getSize(); }
+            }
+
+            stats.revision = fileTree.revision;
+            stats.baseRevision = catalog->revision;
+            stats.indexSize = file->fullSize();
+            stats.maxChunkID = maxChunkID;
+            stats.maxChunkListID = maxChunkListID;
+            stats.maxMultichunkID = maxMultichunkID;
+            stats.chunkListsCount = (uint32)lists.getSize();
+            stats.multichunksCount = (uint32)multichunks.getSize();
+
+            // Write to a temporary file so the previous checkpoint is only replaced by a complete one
+            const String tempPath = path + ".tmp";
+            {
+                Stream::OutputFileStream stream(tempPath);
+                Utils::MemoryBlock buffer;
+                uint64 written = stream.write(&stats, sizeof(stats));
+                uint64 expected = sizeof(stats) + local.getSize() + listsSize + multichunks.getSize() * Multichunk::getSize() + arguments.getSize() + fileTree.getSize();
+
+                #define WriteBlock(X) if (buffer.ensureSize((uint32)(X).getSize(), true)) { memset(buffer.getBuffer(), 0, buffer.getSize()); (X).write(buffer.getBuffer()); written += stream.write(buffer.getConstBuffer(), (uint32)(X).getSize()); }
+                WriteBlock(local);
+                for (size_t i = 0; i < lists.getSize(); i++) WriteBlock(*lists[i]);
+                for (Multichunks::IterT iter = multichunks.getFirstIterator(); iter.isValid(); ++iter) WriteBlock(**iter);
+                WriteBlock(arguments);
+                WriteBlock(fileTree);
+                #undef WriteBlock
+                if (written != expected) { File::Info(tempPath).remove(); return TRANS("Could not write the checkpoint file (is disk full?): ") + tempPath; }
+            }
+            if (!File::Info(tempPath).moveTo(path)) return TRANS("Could not replace the checkpoint file: ") + path;
+            return "";
+        }
+
+        // Load a checkpoint in the revision being built
+        String IndexFile::loadCheckpoint(const String & path, FileTree & tree, CheckpointHeader & stats)
+        {
+            if (!file || readOnly) return TRANS("No revision being built");
+            Stream::MemoryMappedFileStream stream(path, false);
+            if (!stream.map()) return TRANS("Could not open the checkpoint file: ") + path;
+            const uint8 * ptr = stream.getBuffer();
+            const uint64 size = stream.fullSize();
+            if (!ptr || size < CheckpointHeader::getSize()) return TRANS("Invalid checkpoint file: ") + path;
+            memcpy(&stats, ptr, sizeof(stats));
+            if (!stats.isCorrect()) return TRANS("Invalid checkpoint file: ") + path;
+            if (stats.revision != fileTree.revision || stats.baseRevision != catalog->revision || stats.indexSize != file->fullSize())
+                return TRANS("The checkpoint was not saved for this index's state, was a backup made since?");
+
+            // Check everything can be read before modifying this revision
+            uint64 offset = CheckpointHeader::getSize();
+            Chunks local;
+            if (!local.load(ptr + offset, size - offset) || !local.isCorrect(size, offset)) return TRANS("Could not read the checkpoint's chunks");
+            offset += local.getSize();
+            Container::NotConstructible<ChunkList>::IndexList lists;
+            for (uint32 i = 0; i < stats.chunkListsCount; i++)
+            {
+                ChunkList * list = new ChunkList();
+                lists.Append(list);
+                if (!list->load(ptr + offset, size - offset)) return TRANS("Could not read the checkpoint's chunk lists");
+                offset += list->getSize();
+            }
+            Container::NotConstructible<Multichunk>::IndexList mchunks;
+            for (uint32 i = 0; i < stats.multichunksCount; i++)
+            {
+                Multichunk * mc = new Multichunk();
+                mchunks.Append(mc);
+                if (!mc->load(ptr + offset, size - offset)) return TRANS("Could not read the checkpoint's multichunks");
+                offset += mc->getSize();
+            }
+            FilterArguments args;
+            if (!args.load(ptr + offset, size - offset)) return TRANS("Could not read the checkpoint's filter arguments");
+            offset += args.getSize();
+            if (!tree.load(ptr + offset, size - offset)) return TRANS("Could not read the checkpoint's file tree");
+
+            // Then append it to this revision
+            for (size_t i = 0; i < local.chunks.getSize(); i++)
+            {
+                if (shouldResizeChunkIndexMap() && !resizeChunkIndexMap()) return TRANS("Could not resize the chunk index table");
+                Chunk & chunk = local.chunks.getElementAtUncheckedPosition(i);
+                if (!appendChunk(chunk, chunk.UID)) return String::Print(TRANS("Could not insert the chunk with UID: %u"), chunk.UID);
+            }
+            for (size_t i = lists.getSize(); i; i--)
+            {
+                ChunkList * list = lists.Forget(i - 1);
+                if (!chunkList.storeValue(list->UID, list)) return String::Print(TRANS("Chunk list with UID %u already exist"), list->UID);
+            }
+            for (size_t i = mchunks.getSize(); i; i--)
+            {
+                Multichunk * mc = mchunks.Forget(i - 1);
+                if (!multichunks.storeValue(mc->UID, mc)) return String::Print(TRANS("Multichunk with UID %u already exist"), mc->UID);
+            }
+            if (args.arguments.getSize() != arguments.arguments.getSize())
+            {
+                arguments.arguments = args.arguments;
+                arguments.modified = true;
+            }
+            maxChunkID = max(maxChunkID, stats.maxChunkID);
+            maxChunkListID = max(maxChunkListID, stats.maxChunkListID);
+            maxMultichunkID = max(maxMultichunkID, (uint16)stats.maxMultichunkID);
+            return "";
+        }
+
+        // Grow the counts in a single allocation, so they can hold the given UID
+        static void growCounts(Container::PlainOldData<uint32>::Array & counts, const uint32 maxUID)
+        {
+            const size_t prevSize = counts.getSize();
+            if (prevSize > maxUID) return;
+            counts.Grow(maxUID + 1 - prevSize, 0);
+            if (counts.getSize() == (size_t)maxUID + 1) memset(&counts.getElementAtUncheckedPosition(prevSize), 0, (maxUID + 1 - prevSize) * sizeof(uint32));
+        }
+        // Get the counter for the given UID, growing the counts if required
+        static uint32 & countAt(Container::PlainOldData<uint32>::Array & counts, const uint32 uid)
+        {
+            if (counts.getSize() <= uid) growCounts(counts, uid);
+            return counts.getElementAtUncheckedPosition(uid);
+        }
+        // Load the reference counts saved for this index
+        bool IndexFile::loadRefCounts(const String & path)
+        {
+            listRefs.Clear(); chunkRefs.Clear();
+            if (!file || !catalog || !File::Info(path).doesExist()) return false;
+            Stream::MemoryMappedFileStream stream(path, false);
+            if (!stream.map()) return false;
+            const uint8 * ptr = stream.getBuffer();
+            const uint64 size = stream.fullSize();
+            RefCountsHeader refs;
+            if (!ptr || size < RefCountsHeader::getSize()) return false;
+            memcpy(&refs, ptr, sizeof(refs));
+            if (!refs.isCorrect() || refs.revision != catalog->revision || refs.indexSize != file->fullSize()
+                || size != RefCountsHeader::getSize() + ((uint64)refs.listsCount + refs.chunksCount) * sizeof(uint32)) return false;
+
+            uint32 * counts = (uint32*)(ptr + RefCountsHeader::getSize());
+            listRefs.Grow(refs.listsCount, counts);
+            chunkRefs.Grow(refs.chunksCount, counts + refs.listsCount);
+            return true;
+        }
+        // Save the reference counts
+        String IndexFile::saveRefCounts(const String & path, const uint32 revision, const uint64 indexSize) const
+        {
+            RefCountsHeader refs;
+            refs.revision = revision;
+            refs.indexSize = indexSize;
+            refs.listsCount = (uint32)listRefs.getSize();
+            refs.chunksCount = (uint32)chunkRefs.getSize();
+
+            // Write to a temporary file so the previous counts are only replaced by complete ones
+            const String tempPath = path + ".tmp";
+            {
+                Stream::OutputFileStream stream(tempPath);
+                uint64 written = stream.write(&refs, sizeof(refs));
+                if (refs.listsCount) written += stream.write(&listRefs.getElementAtPosition(0), refs.listsCount * sizeof(uint32));
+                if (refs.chunksCount) written += stream.write(&chunkRefs.getElementAtPosition(0), refs.chunksCount * sizeof(uint32));
+                if (written != RefCountsHeader::getSize() + ((uint64)refs.listsCount + refs.chunksCount) * sizeof(uint32))
+                {
+                    File::Info(tempPath).remove();
+                    return TRANS("Could not write the reference counts file (is disk full?): ") + tempPath;
+                }
+            }
+            if (!File::Info(tempPath).moveTo(path)) return TRANS("Could not replace the reference counts file: ") + path;
+            return "";
+        }
+        // Rebuild the reference counts by walking all the revisions
+        void IndexFile::rebuildRefCounts()
+        {
+            listRefs.Clear(); chunkRefs.Clear();
+            for (uint32 rev = 1; rev <= getCurrentRevision(); rev++)
+            {
+                Utils::OwnPtr<FileTree> ft(getFileTree(rev));
+                if (ft) addReferences(*ft); // The first revisions might be missing if they were purged
+            }
+        }
+        // Count the references of the given file tree
+        void IndexFile::addReferences(const FileTree & tree)
+        {
+            growCounts(listRefs, maxChunkListID);
+            growCounts(chunkRefs, maxChunkID);
+            for (size_t i = 0; i < tree.items.getSize(); i++)
+            {
+                const uint32 listID = tree.items[i].getChunkListID();
+                // A chunk list's chunks are only counted once, whatever the number of items referring to it
+                if (!listID || countAt(listRefs, listID)++) continue;
+                const ChunkList * cl = getChunkList(listID);
+                for (size_t c = 0; cl && c < cl->chunksID.getSize(); c++)
+                {
+                    const uint32 chunkID = cl->chunksID.getElementAtPosition(c);
+                    if (!ChunkList::isZeroExtent(chunkID)) countAt(chunkRefs, chunkID)++;
+                }
+            }
+        }
+        // Remove the references of the given file tree
+        void IndexFile::removeReferences(const FileTree & tree, UIDBitmap & visitedLists, UIDBitmap & referenced)
+        {
+            for (size_t i = 0; i < tree.items.getSize(); i++)
+            {
+                const uint32 listID = tree.items[i].getChunkListID();
+                if (!listID) continue;
+                const bool firstVisit = visitedLists.set(listID);
+                uint32 * count = listID < listRefs.getSize() ? &listRefs.getElementAtUncheckedPosition(listID) : 0;
+                // The list's chunks are only released when the last item referring to it is removed
+                const bool release = count && *count && !--*count;
+                if (!firstVisit && !release) continue;
+                const ChunkList * cl = getChunkList(listID);
+                for (size_t c = 0; cl && c < cl->chunksID.getSize(); c++)
+                {
+                    const uint32 chunkID = cl->chunksID.getElementAtPosition(c);
+                    if (ChunkList::isZeroExtent(chunkID)) continue;
+                    referenced.set(chunkID);
+                    if (release && chunkID < chunkRefs.getSize() && chunkRefs.getElementAtUncheckedPosition(chunkID))
+                        chunkRefs.getElementAtUncheckedPosition(chunkID)--;
+                }
+            }
+        }
+
+        /** The blocks of a kept catalog that's written again when purging in place.
+            A section that's not rewritten stays where it is in the file */
+        struct CatalogRewrite
+        {
+            /** The catalog that's copied */
+            const Catalog *     source;
+            /** The chunks block */
+            Chunks              chunks;
+            /** The chunk lists and multichunks blocks, as written in the file */
+            Utils::MemoryBlock  lists, multichunks;
+            /** The number of chunk lists and multichunks in the blocks above */
+            uint32              listsCount, multichunksCount;
+            /** Set for the sections that are rewritten */
+            bool                newChunks, newLists, newMultichunks;
+
+            /** Append a block that's copied as is */
+            static bool appendBlock(Utils::MemoryBlock & section, uint32 & count, const uint8 * block, const uint64 size) { count++; return section.Append(block, (uint32)size); }
+            /** Append a block object */
+            template <typename T>
+            static bool appendBlock(Utils::MemoryBlock & section, uint32 & count, T & block)
+            {
+                const uint32 previous = section.getSize();
+                if (!section.ensureSize(previous + (uint32)block.getSize(), true)) return false;
+                block.write(section.getBuffer() + previous);
+                count++;
+                return true;
+            }
+            /** Get the size of the rewritten sections and the catalog */
+            uint64 getSize() const { return (newChunks ? chunks.getSize() : 0) + (newLists ? lists.getSize() : 0) + (newMultichunks ? multichunks.getSize() : 0) + Catalog::getSize(); }
+            /** Write the rewritten sections at the given position, and point the catalog to them
+                @return The position after the written sections */
+            uint64 write(uint8 * filePtr, uint64 wo, Catalog & cat)
+            {
+                if (newChunks)
+                {
+                    cat.chunks.fileOffset(wo);
+                    chunks.write(filePtr + wo); wo += chunks.getSize();
+                }
+                if (newLists)
+                {
+                    cat.chunkLists.fileOffset(wo); cat.chunkListsCount = listsCount;
+                    memcpy(filePtr + wo, lists.getConstBuffer(), lists.getSize()); wo += lists.getSize();
+                }
+                if (newMultichunks)
+                {
+                    cat.multichunks.fileOffset(wo); cat.multichunksCount = multichunksCount;
+                    memcpy(filePtr + wo, multichunks.getConstBuffer(), multichunks.getSize()); wo += multichunks.getSize();
+                }
+                return wo;
+            }
+
+            CatalogRewrite(const Catalog * source) : source(source), chunks(source->revision), listsCount(0), multichunksCount(0), newChunks(false), newLists(false), newMultichunks(false) {}
+        };
+
+        // Purge the revisions up to the given one, without rewriting the whole index
+        String IndexFile::purgeInPlace(const String & filePath, const uint32 upToRevision, const UIDBitmap & removedMultichunks, ChunkLists & lists, Multichunks & mchunks)
+        {
+            if (!file || !readOnly) return TRANS("The index must be opened read only to be purged in place");
+            const uint8 * filePtr = file->getBuffer();
+            const uint64 initialSize = file->fullSize();
+
+            // Split the catalogs in the kept ones (from the last revision) and the purged ones
+            Container::PlainOldData<const Catalog *>::Array kept, purged;
+            for (const Catalog * c = catalog; c; c = c->previous.fileOffset() ? MapAs(const Catalog, filePtr, c->previous.fileOffset()) : 0)
+                (c->revision > upToRevision ? kept : purged).Append(c);
+            // Without any purged revision, the repacked (coalesced) multichunks are still appended in a new base
+            if (!purged.getSize() && !mchunks.getSize()) return "";
+            if (!kept.getSize()) return TRANS("Can't purge all the revisions of a backup");
+
+            // The chunk lists of the removed or repacked multichunks must go too (the repacked ones are replaced by the new lists)
+            UIDBitmap removedLists(maxChunkListID), keptMultichunkLists(maxChunkListID);
+            for (uint32 id = 0; id < 65536; id++)
+            {
+                const Multichunk * mc = removedMultichunks.isSet(id) ? getMultichunk((uint16)id) : 0;
+                if (mc) removedLists.set(mc->listID);
+            }
+
+            // The oldest kept revision becomes the new base. It holds its own blocks and what's still used from the purged revisions
+            Container::NotConstructible<CatalogRewrite>::IndexList rewrites;
+            CatalogRewrite * base = new CatalogRewrite(kept[kept.getSize() - 1]);
+            rewrites.Append(base);
+            base->newChunks = base->newLists = base->newMultichunks = true;
+            Container::PlainOldData<const Catalog *>::Array sources;
+            for (size_t i = purged.getSize(); i; i--) sources.Append(purged[i - 1]);
+            sources.Append(base->source);
+
+            for (size_t s = 0; s < sources.getSize(); s++)
+            {
+                const Catalog * c = sources[s];
+                const bool wasPurged = c != base->source;
+                Chunks chunks;
+                if (!LoadRO(chunks, c->chunks)) return String::Print(TRANS("Could not read the chunks for revision %d"), c->revision);
+                for (size_t i = 0; i < chunks.chunks.getSize(); i++)
+                {
+                    Chunk chunk = chunks.chunks[i];
+                    // The chunks that were only used by the purged revisions are removed
+                    if (wasPurged && !getChunkReferences(chunk.UID)) continue;
+                    // And the repacked ones moved to another multichunk
+                    const Chunk * current = findChunk(chunk.UID);
+                    if (current) chunk.multichunkID = current->multichunkID;
+                    base->chunks.chunks.Append(chunk);
+                }
+
+                uint64 offset = c->multichunks.fileOffset();
+                for (uint32 i = 0; i < c->multichunksCount; i++, offset += Multichunk::getSize())
+                {
+                    const Multichunk * mc = MapAs(const Multichunk, filePtr, offset);
+                    // A reopened multichunk's previous records are dropped, only its current one is kept
+                    if (removedMultichunks.isSet(mc->UID) || getMultichunk(mc->UID) != mc) continue;
+                    keptMultichunkLists.set(mc->listID);
+                    if (!CatalogRewrite::appendBlock(base->multichunks, base->multichunksCount, filePtr + offset, Multichunk::getSize())) return TRANS("Out of memory");
+                }
+            }
+            // A purged revision's file chunk list is kept if a kept revision refers to it, and a multichunk's chunk list if the multichunk is kept
+            for (size_t s = 0; s < sources.getSize(); s++)
+            {
+                const Catalog * c = sources[s];
+                const bool wasPurged = c != base->source;
+                uint64 offset = c->chunkLists.fileOffset();
+                for (uint32 i = 0; i < c->chunkListsCount; i++)
+                {
+                    const ChunkList * cl = MapAs(const ChunkList, filePtr, offset);
+                    const uint64 size = cl->header.getSize();
+                    const bool keep = !removedLists.isSet(cl->UID)
+                                   && (!wasPurged || (cl->UID < listRefs.getSize() && listRefs[cl->UID]) || keptMultichunkLists.isSet(cl->UID));
+                    if (keep && !CatalogRewrite::appendBlock(base->lists, base->listsCount, filePtr + offset, size)) return TRANS("Out of memory");
+                    offset += size;
+                }
+            }
+            // Then the repacked multichunks
+            for (Multichunks::IterT iter = mchunks.getFirstIterator(); iter.isValid(); ++iter)
+                if (!CatalogRewrite::appendBlock(base->multichunks, base->multichunksCount, **iter)) return TRANS("Out of memory");
+            for (ChunkLists::IterT iter = lists.getFirstIterator(); iter.isValid(); ++iter)
+                if (!CatalogRewrite::appendBlock(base->lists, base->listsCount, **iter)) return TRANS("Out of memory");
+
+            // The other kept revisions are only rewritten if they refer to a removed or repacked multichunk
+            for (size_t k = kept.getSize() - 1; k; k--)
+            {
+                CatalogRewrite * rewrite = new CatalogRewrite(kept[k - 1]);
+                rewrites.Append(rewrite);
+                const Catalog * c = rewrite->source;
+                Chunks chunks;
+                if (!LoadRO(chunks, c->chunks)) return String::Print(TRANS("Could not read the chunks for revision %d"), c->revision);
+                for (size_t i = 0; i < chunks.chunks.getSize(); i++)
+                {
+                    Chunk chunk = chunks.chunks[i];
+                    const Chunk * current = findChunk(chunk.UID);
+                    if (current && current->multichunkID != chunk.multichunkID) { chunk.multichunkID = current->multichunkID; rewrite->newChunks = true; }
+                    rewrite->chunks.chunks.Append(chunk);
+                }
+
+                uint64 offset = c->chunkLists.fileOffset();
+                for (uint32 i = 0; i < c->chunkListsCount; i++)
+                {
+                    const ChunkList * cl = MapAs(const ChunkList, filePtr, offset);
+                    const uint64 size = cl->header.getSize();
+                    if (removedLists.isSet(cl->UID)) rewrite->newLists = true;
+                    else if (!CatalogRewrite::appendBlock(rewrite->lists, rewrite->listsCount, filePtr + offset, size)) return TRANS("Out of memory");
+                    offset += size;
+                }
+                offset = c->multichunks.fileOffset();
+                for (uint32 i = 0; i < c->multichunksCount; i++, offset += Multichunk::getSize())
+                {
+                    const Multichunk * mc = MapAs(const Multichunk, filePtr, offset);
+                    if (removedMultichunks.isSet(mc->UID)) rewrite->newMultichunks = true;
+                    else if (!CatalogRewrite::appendBlock(rewrite->multichunks, rewrite->multichunksCount, filePtr + offset, Multichunk::getSize())) return TRANS("Out of memory");
+                }
+            }
+
+            // Append everything to the file, the last catalog being the last revision's one
+            uint64 requiredAdditionalSize = arguments.modified ? arguments.getSize() : 0;
+            for (size_t i = 0; i < rewrites.getSize(); i++) requiredAdditionalSize += rewrites[i].getSize();
+
+            Stream::MemoryMappedFileStream output(filePath, true);
+            if (!output.map(0, initialSize + requiredAdditionalSize))
+                return String::Print(TRANS("Cannot allocate %llu more bytes for the index file, is disk full?"), requiredAdditionalSize);
+            uint8 * outPtr = output.getBuffer();
+            uint64 wo = initialSize, previous = 0;
+            for (size_t i = 0; i < rewrites.getSize(); i++)
+            {
+                Catalog cat(*rewrites[i].source);
+                wo = rewrites[i].write(outPtr, wo, cat);
+                if (i + 1 == rewrites.getSize() && arguments.modified)
+                {
+                    cat.optionFilterArg.fileOffset(wo);
+                    arguments.write(outPtr + wo); wo += arguments.getSize();
+                }
+                cat.previous.fileOffset(previous);
+                previous = wo;
+                cat.write(outPtr + wo); wo += cat.getSize();
+            }
+            if (wo != output.fullSize()) return TRANS("Invalid file size computation");
+            output.unmap(true);
+            return "";
+        }
+
+        // Write a compacted copy of this index
+        String IndexFile::compact(const String & filePath)
+        {
+            if (!file || !readOnly) return TRANS("The index must be opened read only to be compacted");
+            if (File::Info(filePath, true).doesExist()) return TRANS("File already exists: ") + filePath;
+            const uint8 * filePtr = file->getBuffer();
+
+            // Collect the catalogs from the first revision
+            Container::PlainOldData<const Catalog *>::Array newestFirst, catalogs;
+            for (const Catalog * c = catalog; c; c = c->previous.fileOffset() ? MapAs(const Catalog, filePtr, c->previous.fileOffset()) : 0)
+                newestFirst.Append(c);
+            for (size_t i = newestFirst.getSize(); i; i--) catalogs.Append(newestFirst[i - 1]);
+            if (!catalogs.getSize()) return TRANS("Nothing to compact");
+
+            // The first revision holds all the chunks, that are already sorted by UID, all the chunk lists and all the multichunks
+            Chunks base(catalogs[0]->revision);
+            if (consolidated.chunks.getSize()) base.chunks.Grow(consolidated.chunks.getSize(), &consolidated.chunks.getElementAtUncheckedPosition(0));
+            uint64 requiredSize = MainHeader::getSize() + base.getSize() + multichunksRO.getSize() * Multichunk::getSize() + (arguments.arguments.getSize() ? arguments.getSize() : 0);
+            for (ChunkLists::IterT iter = chunkListRO.getFirstIterator(); iter.isValid(); ++iter) requiredSize += (*iter)->getSize();
+
+            // The file trees and metadata are copied as is, and only once since a revision refers to the previous metadata if it did not change it
+            Container::PlainOldData<uint64>::Array blocks, newOffsets;
+            for (size_t i = 0; i < catalogs.getSize(); i++)
+            {
+                const Catalog * c = catalogs[i];
+                const uint64 offsets[] = { c->fileTree.fileOffset(), c->optionMetadata.fileOffset() };
+                for (size_t j = 0; j < ArrSz(offsets); j++)
+                {
+                    if (!offsets[j] || blocks.indexOf(offsets[j]) != blocks.getSize()) continue;
+                    blocks.Append(offsets[j]);
+                    requiredSize += (MapAs(const DataHeader, filePtr, offsets[j]))->getSize();
+                }
+                if (i) requiredSize += Chunks(c->revision).getSize();
+                requiredSize += Catalog::getSize();
+            }
+
+            Stream::MemoryMappedFileStream output(filePath, true);
+            if (!output.map(0, requiredSize))
+                return String::Print(TRANS("Cannot allocate %llu bytes for the compacted index file, is disk full?"), requiredSize);
+            uint8 * outPtr = output.getBuffer();
+            if (!outPtr) return TRANS("Failed to get a pointer on the mapped area");
+
+            // The header is kept, the last catalog being at the end of the file
+            const MainHeader * mainHeader = header;
+            memcpy(outPtr, mainHeader, MainHeader::getSize());
+            (MapAs(MainHeader, outPtr, 0))->catalogOffset.fileOffset(0);
+            uint64 wo = MainHeader::getSize(), previous = 0;
+            Offset filterArgs;
+            for (size_t i = 0; i < catalogs.getSize(); i++)
+            {
+                Catalog cat(*catalogs[i]);
+                cat.chunks.fileOffset(wo);
+                if (!i)
+                {
+                    base.write(outPtr + wo); wo += base.getSize();
+                    cat.chunkLists.fileOffset(wo); cat.chunkListsCount = chunkListRO.getSize();
+                    for (ChunkLists::IterT iter = chunkListRO.getFirstIterator(); iter.isValid(); ++iter)
+                    {
+                        (*iter)->write(outPtr + wo); wo += (*iter)->getSize();
+                    }
+                    cat.multichunks.fileOffset(wo); cat.multichunksCount = multichunksRO.getSize();
+                    for (MultichunksRO::IterT iter = multichunksRO.getFirstIterator(); iter.isValid(); ++iter)
+                    {
+                        memcpy(outPtr + wo, *iter, Multichunk::getSize()); wo += Multichunk::getSize();
+                    }
+                    if (arguments.arguments.getSize())
+                    {
+                        filterArgs.fileOffset(wo);
+                        arguments.write(outPtr + wo); wo += arguments.getSize();
+                    }
+                } else
+                {
+                    Chunks empty(cat.revision);
+                    empty.write(outPtr + wo); wo += empty.getSize();
+                    cat.chunkLists.fileOffset(0); cat.chunkListsCount = 0;
+                    cat.multichunks.fileOffset(0); cat.multichunksCount = 0;
+                }
+                cat.optionFilterArg = filterArgs;
+
+                Offset * offsets[] = { &cat.fileTree, &cat.optionMetadata };
+                for (size_t j = 0; j < ArrSz(offsets); j++)
+                {
+                    const uint64 offset = offsets[j]->fileOffset();
+                    if (!offset) continue;
+                    const size_t pos = blocks.indexOf(offset);
+                    if (pos < newOffsets.getSize()) { offsets[j]->fileOffset(newOffsets[pos]); continue; }
+                    // First time this block is seen, so copy it now (the blocks were collected in the same order)
+                    const uint64 size = (MapAs(const DataHeader, filePtr, offset))->getSize();
+                    memcpy(outPtr + wo, filePtr + offset, (size_t)size);
+                    newOffsets.Append(wo);
+                    offsets[j]->fileOffset(wo); wo += size;
+                }
+
+                cat.previous.fileOffset(previous);
+                previous = wo;
+                cat.write(outPtr + wo); wo += cat.getSize();
+            }
+            if (wo != output.fullSize()) return TRANS("Invalid file size computation");
+            output.unmap(true);
+            return "";
+        }
+
         // Get the file base name for this multichunk
         String Multichunk::getFileName() const
         {
@@ -730,7 +1368,8 @@ namespace Frost
                     if (!ft->load(filePtr + c->fileTree.fileOffset(), file->fullSize() - c->fileTree.fileOffset())) return 0;
                     return ft;
                 }
-                c = MapAs(Catalog, filePtr, c->previous.fileOffset());
+                // The first revisions might be missing if they were purged in place
+                c = c->previous.fileOffset() ? MapAs(Catalog, filePtr, c->previous.fileOffset()) : 0;
             }
             return 0;
         }
@@ -761,6 +1400,24 @@ namespace Frost
         String excludedFilePath;
         // Included file list if found
         String includedFilePath;
+        // The checkpoint file path for the backup in progress (if empty, no checkpoint is saved)
+        String checkpointPath;
+        // The interval in seconds between checkpoints
+        uint32 checkpointInterval = 600;
+        // Whether to resume the backup from its last checkpoint
+        bool resumeBackup = false;
+        // The memory budget for the multichunks decoded ahead of time while restoring (0 to disable)
+        size_t prefetchSize = 32*1024*1024;
+        // The path of the file or directory to restore from the backup (empty to restore everything)
+        String restoreSubtree;
+        // Whether to store the multichunks in independently decodable frames
+        bool framedMultichunks = false;
+        // The (uncompressed) size of a frame in a framed multichunk
+        const uint32 frameSize = 256*1024;
+        // Whether to purge the revisions in place instead of rewriting the index
+        bool purgeInPlace = false;
+        // Whether to merge the undersized multichunks together when purging
+        bool coalesceMultichunks = false;
 
         // The index file we are using
         FileFormat::IndexFile indexFile;
@@ -791,20 +1448,27 @@ namespace Frost
         bool AESCounterEncrypt(const KeyFactory::KeyT & nonceRandom, const ::Stream::InputStream & input, ::Stream::OutputStream & output)
         {
             KeyFactory::KeyT nonce = {0}, key = {0}, salt = {0}, plainText = {0}, cipherText = {0};
-            getKeyFactory().createNewKey(key);
-            getKeyFactory().getCurrentSalt(salt);
+            // The factory is only read, and the ciphering state is local, so multichunks can be encrypted from multiple threads
+            const KeyFactory & factory = getKeyFactory();
+            {   // The random generator is shared
+                static Threading::FastLock randomLock;
+                Threading::ScopedLock scope(randomLock);
+                KeyFactory::createNewSalt(salt);
+            }
+            factory.deriveKey(salt, key);
 
             // Write the salt to the output stream
-            if (!output.write(salt)) return false;
+            if (!output.write(salt)) { Crypto::SafeMemclean(key, ArrSz(key)); return false; }
 
-            getKeyFactory().createNewNonce(nonceRandom);
+            KeyFactory::CounterNonce counter(nonceRandom);
             Crypto::OSSL_AES cipher;
             cipher.setKey(key, (Crypto::BaseSymCrypt::BlockSize)ArrSz(key), 0, (Crypto::BaseSymCrypt::BlockSize)ArrSz(key));
+            Crypto::SafeMemclean(key, ArrSz(key));
 
             for (uint64 i = 0; i < input.fullSize(); i += ArrSz(nonce))
             {
                 // Increment the nonce including the counter
-                getKeyFactory().incrementNonce(nonce);
+                counter.incrementNonce(nonce);
                 // Read the data
                 uint64 inputSize = input.read(plainText, (uint64)ArrSz(plainText));
                 if (inputSize == (uint64)-1) return false;
@@ -823,20 +1487,21 @@ namespace Frost
         {
             // Get the salt from the system
             KeyFactory::KeyT nonce = {0}, key = {0}, salt = {0}, plainText = {0}, cipherText = {0};
+            // The factory is only read, and the ciphering state is local, so multichunks can be decrypted from multiple threads
+            const KeyFactory & factory = getKeyFactory();
 
             if (!input.read(salt)) return false;
-            getKeyFactory().setCurrentSalt(salt);
-            getKeyFactory().deriveNewKey(key);
+            factory.deriveKey(salt, key);
 
-            getKeyFactory().createNewNonce(nonceRandom);
+            KeyFactory::CounterNonce counter(nonceRandom);
             Crypto::OSSL_AES cipher;
             cipher.setKey(key, (Crypto::BaseSymCrypt::BlockSize)ArrSz(key), 0, (Crypto::BaseSymCrypt::BlockSize)ArrSz(key));
-            memset(key, 0, ArrSz(key));
+            Crypto::SafeMemclean(key, ArrSz(key));
 
             for (uint64 i = ArrSz(salt); i < input.fullSize(); i += ArrSz(nonce))
             {
                 // Increment the nonce including the counter
-                getKeyFactory().incrementNonce(nonce);
+                counter.incrementNonce(nonce);
                 // Read the data
                 uint64 inputSize = input.read(cipherText, (uint64)ArrSz(cipherText));
                 if (inputSize == (uint64)-1) return false;
@@ -851,6 +1516,40 @@ namespace Frost
 
             return true;
         }
+        // Decrypt only a part of a block encrypted with AES counter mode.
+        // The offset and size are in the decrypted data, and the input stream must be seekable
+        bool AESCounterDecryptAt(const KeyFactory::KeyT & nonceRandom, ::Stream::InputStream & input, const uint64 offset, const uint64 size, ::Stream::OutputStream & output)
+        {
+            KeyFactory::KeyT nonce = {0}, key = {0}, salt = {0}, plainText = {0}, cipherText = {0};
+            const KeyFactory & factory = getKeyFactory();
+
+            if (!input.setPosition(0) || !input.read(salt)) return false;
+            factory.deriveKey(salt, key);
+
+            KeyFactory::CounterNonce counter(nonceRandom);
+            Crypto::OSSL_AES cipher;
+            cipher.setKey(key, (Crypto::BaseSymCrypt::BlockSize)ArrSz(key), 0, (Crypto::BaseSymCrypt::BlockSize)ArrSz(key));
+            Crypto::SafeMemclean(key, ArrSz(key));
+
+            // Each block is processed with its own counter value, so we can start from any block
+            const uint64 firstBlock = offset / ArrSz(nonce), end = offset + size;
+            counter.setCounter((uint32)firstBlock);
+            if (!input.setPosition(ArrSz(salt) + firstBlock * ArrSz(nonce))) return false;
+
+            for (uint64 i = firstBlock * ArrSz(nonce); i < end; i += ArrSz(nonce))
+            {
+                counter.incrementNonce(nonce);
+                uint64 inputSize = input.read(cipherText, (uint64)ArrSz(cipherText));
+                if (inputSize == (uint64)-1 || i + inputSize < min(end, i + ArrSz(nonce))) return false;
+                if (!Crypto::CTR_BlockProcess(cipher, nonce, salt)) return false;
+                Crypto::Xor(plainText, cipherText, salt, (size_t)inputSize);
+
+                // Only output the requested part of the block
+                const uint64 skip = i < offset ? offset - i : 0, count = min(end - i, inputSize) - skip;
+                if (output.write(&plainText[skip], count) != count) return false;
+            }
+            return true;
+        }
         // Encrypt or decrypt using AES counter mode.
         bool AESCounterProcess(const KeyFactory::KeyT & key, const KeyFactory::KeyT & nonceRandom, const ::Stream::InputStream & input, ::Stream::OutputStream & output, ProgressCallback & callback, uint8 * inputHash, uint8 * outputHash)
         {
@@ -937,11 +1636,34 @@ namespace Frost
             return "";
         }
 
+        String encryptIndexFile(const String & encryptedIndexPath, const String & localIndexPath, const KeyFactory::KeyT & key, ProgressCallback & callback)
+        {
+            {
+                Stream::OutputFileStream output(encryptedIndexPath);
+                Stream::InputFileStream input(localIndexPath);
+
+                FileFormat::CipheredIndexHeader indexHeader;
+                Random::fillBlock(indexHeader.nonce, ArrSz(indexHeader.nonce), true);
+                if (output.write(&indexHeader, sizeof(indexHeader)) != sizeof(indexHeader)) return TRANS("Could not write the output header to: ") + encryptedIndexPath;
+
+                KeyFactory::KeyT nonce = {};
+                memcpy(nonce, indexHeader.nonce, ArrSz(indexHeader.nonce));
+                if (!AESCounterProcess(key, nonce, input, output, callback, indexHeader.hash, 0)) return TRANS("Error while encrypting the index");
+                if (!output.setPosition(0)) return TRANS("Could not seek back to the start of the ciphered index file");
+
+                // Update the header now we know about the hash of the input file
+                if (output.write(&indexHeader, sizeof(indexHeader)) != sizeof(indexHeader)) return TRANS("Could not write the output header to: ") + encryptedIndexPath;
+            }
+            // Need to set the ciphered file's modification time now it's done writing and closed, so the local copy is used on next run
+            File::Info(encryptedIndexPath, true).setModifiedTime(File::Info(localIndexPath, true).modification);
+            return "";
+        }
+
         static String getFilterArgument(CompressorToUse actualComp)
         {
             if (actualComp == Default) actualComp = compressor;
             const char * compressorName[] = { "none", "zLib", "BSC" };
-            return String::Print("%d:%s:AES_CTR", File::MultiChunk::MaximumSize, compressorName[actualComp]);
+            return String::Print("%d:%s:AES_CTR%s", File::MultiChunk::MaximumSize, compressorName[actualComp], framedMultichunks ? ":Framed" : "");
         }
 
         static uint16 getFilterArgumentIndex(CompressorToUse actualComp, FileFormat::IndexFile * idxFile = 0)
@@ -955,6 +1677,145 @@ namespace Frost
         }
         typedef Utils::ScopePtr<FileFormat::ChunkList> & ChunkListT;
 
+        /** Check if the given filter argument is for a framed multichunk */
+        static bool isFramed(const String & filterMode) { return filterMode.fromLast(":") == "Framed"; }
+
+        /** Compress a block of data with the given compressor */
+        static bool compressBlock(CompressorToUse actualComp, const uint8 * data, const uint32 size, ::Stream::OutputStream & output)
+        {
+            switch (actualComp)
+            {
+            case ZLib:
+                {
+                    Compression::ZLib * zlib = new Compression::ZLib;
+                    zlib->setCompressionFactor(1.0f);
+                    ::Stream::CompressOutputStream compressor(output, zlib);
+                    return compressor.write(data, size) == size;
+                }
+            case BSC:
+                {   // BSC rewrites its header at the beginning of the stream when done, so it needs its own stream
+                    ::Stream::OutputMemStream block;
+                    {
+                        ::Stream::CompressOutputStream compressor(block, new Compression::BSCLib);
+                        if (compressor.write(data, size) != size) return false;
+                    }
+                    return output.write(block.getBuffer(), block.fullSize()) == block.fullSize();
+                }
+            case None: return output.write(data, size) == size;
+            default: return false;
+            }
+        }
+        /** Decompress a block of data whose decompressed size is known */
+        static bool decompressBlock(const String & compUsed, const uint8 * data, const uint32 size, uint8 * out, const uint32 outSize)
+        {
+            ::Stream::MemoryBlockStream compressedStream(data, size);
+            if (compUsed == "none") return compressedStream.read(out, outSize) == outSize;
+            Compression::BaseCompressor * comp = 0;
+            if (compUsed == "zLib")
+            {
+                Compression::ZLib * zlib = new Compression::ZLib;
+                zlib->setCompressionFactor(1.0f);
+                comp = zlib;
+            }
+            else if (compUsed == "BSC") comp = new Compression::BSCLib;
+            else return false;
+            ::Stream::DecompressInputStream decompressor(compressedStream, comp);
+            return decompressor.read(out, outSize) == outSize;
+        }
+
+        /** Write a multichunk as independently compressed frames, preceded by the frame table.
+            @sa FileFormat::FrameTable for the format */
+        static bool writeFramedMultichunk(const File::MultiChunk & multiChunk, CompressorToUse actualComp, ::Stream::OutputStream & output)
+        {
+            const uint8 * data = multiChunk.chunkArray.getConstBuffer();
+            const size_t count = multiChunk.chunkPos.getSize(), total = multiChunk.getSize();
+            FileFormat::FrameEntries frames;
+            ::Stream::OutputMemStream compressed;
+            for (size_t i = 0; i < count; )
+            {
+                FileFormat::FrameEntry frame(multiChunk.chunkPos[i]);
+                // Frames are cut on chunk boundaries
+                size_t next = i + 1;
+                while (next < count && multiChunk.chunkPos[next] - frame.dataOffset < frameSize) next++;
+                frame.dataSize = (uint32)((next < count ? multiChunk.chunkPos[next] : total) - frame.dataOffset);
+                frame.offset = (uint32)compressed.fullSize();
+
+                KeyFactory::BigHashT hash;
+                hash.Start(); hash.Hash(&data[frame.dataOffset], frame.dataSize); hash.Finalize(frame.checksum);
+
+                if (!compressBlock(actualComp, &data[frame.dataOffset], frame.dataSize, compressed)) return false;
+                frame.compressedSize = (uint32)(compressed.fullSize() - frame.offset);
+                frames.Append(frame);
+                i = next;
+            }
+
+            FileFormat::FrameTable table((uint32)frames.getSize());
+            const uint64 entriesSize = frames.getSize() * sizeof(FileFormat::FrameEntry);
+            KeyFactory::KeyT tableHash;
+            KeyFactory::BigHashT hash;
+            hash.Start();
+            hash.Hash((const uint8*)&table, sizeof(table));
+            if (entriesSize) hash.Hash((const uint8*)&frames[0], entriesSize);
+            hash.Finalize(tableHash);
+
+            return output.write(&table, sizeof(table)) == sizeof(table)
+                && (!entriesSize || output.write(&frames[0], entriesSize) == entriesSize)
+                && output.write(tableHash, ArrSz(tableHash)) == ArrSz(tableHash)
+                && output.write(compressed.getBuffer(), compressed.fullSize()) == compressed.fullSize();
+        }
+        /** Parse and check the frame table at the beginning of a decrypted framed multichunk */
+        static bool parseFrameTable(const uint8 * data, const uint64 size, FileFormat::FrameEntries & frames)
+        {
+            FileFormat::FrameTable table;
+            if (size < sizeof(table)) return false;
+            memcpy(&table, data, sizeof(table));
+            if (!table.isCorrect() || size < table.getSize()) return false;
+
+            KeyFactory::KeyT tableHash;
+            KeyFactory::BigHashT hash;
+            hash.Start(); hash.Hash(data, table.getSize() - ArrSz(tableHash)); hash.Finalize(tableHash);
+            if (memcmp(tableHash, &data[table.getSize() - ArrSz(tableHash)], ArrSz(tableHash))) return false;
+
+            frames.Clear();
+            for (uint32 i = 0; i < table.frameCount; i++)
+            {
+                FileFormat::FrameEntry frame;
+                memcpy(&frame, &data[sizeof(table) + i * sizeof(frame)], sizeof(frame));
+                frames.Append(frame);
+            }
+            return true;
+        }
+        /** Decode a compressed frame and append its chunks to the given multichunk */
+        static bool decodeFrame(const uint8 * compressed, const FileFormat::FrameEntry & frame, const String & compUsed, File::MultiChunk & mchunk)
+        {
+            const uint32 start = (uint32)mchunk.chunkArray.getSize();
+            if (!mchunk.chunkArray.Append(0, frame.dataSize)) return false;
+            uint8 * data = &mchunk.chunkArray.getBuffer()[start];
+            if (!decompressBlock(compUsed, compressed, frame.compressedSize, data, frame.dataSize)) return false;
+
+            KeyFactory::KeyT checksum;
+            KeyFactory::BigHashT hash;
+            hash.Start(); hash.Hash(data, frame.dataSize); hash.Finalize(checksum);
+            if (memcmp(checksum, frame.checksum, ArrSz(checksum))) return false;
+
+            // Then index the chunks in this frame
+            uint32 pos = 0;
+            while (pos < frame.dataSize)
+            {
+                if (frame.dataSize - pos < (uint32)File::Chunk::HeaderSize) return false;
+                mchunk.chunkPos.Append(start + pos);
+                pos += File::Chunk::HeaderSize + ((const File::Chunk *)&data[pos])->size;
+            }
+            return pos == frame.dataSize;
+        }
+        /** Get the multichunk hash (used as the nonce) from its file name */
+        static bool getMultichunkHash(const String & fullMultiChunkPath, KeyFactory::KeyT & chunkHash)
+        {
+            uint32 chunkHashSize = (uint32)ArrSz(chunkHash);
+            return Helpers::toBinary(fullMultiChunkPath.fromLast("/").upToLast("."), chunkHash, chunkHashSize, false)
+                && chunkHashSize == (uint32)ArrSz(chunkHash);
+        }
+
         bool closeMultiChunkBin(String & chunkPath, File::MultiChunk & multiChunk, uint64 * totalOutSize, ProgressCallback & callback, CompressorToUse actualComp, KeyFactory::KeyT & chunkHash)
         {
             bool worthTelling = multiChunk.getSize() > 2*1024*1024;
@@ -970,7 +1831,11 @@ namespace Frost
                 return false;
 
             if (actualComp == Default) actualComp = compressor;
-            switch (actualComp)
+            if (framedMultichunks)
+            {   // Each frame is compressed independently
+                if (!writeFramedMultichunk(multiChunk, actualComp, compressedStream)) return false;
+            }
+            else switch (actualComp)
             {
             case ZLib:
                 {   // Compress the data
@@ -1022,20 +1887,16 @@ namespace Frost
             String backPath = backupTo;
             if (!closeMultiChunkBin(backPath, multiChunk, totalOutSize, callback, actualComp, chunkHash)) return false;
 
-            if (previousMultiChunkID)
-            {
-                // Might need to update the previous multichunk ID
-                FileFormat::Multichunk * mc = indexFile.getMultichunk((uint16)previousMultiChunkID);
-                if (mc->listID == multiChunkID->UID)
-                {   // Same multichunk, so let's modify it (remove the previous file)
-                    File::Info(backupTo + mc->getFileName()).remove();
-                    // Update it (this will modify the file multichunk position)
-                    mc->filterArgIndex = getFilterArgumentIndex(actualComp);
-                    memcpy(mc->checksum, chunkHash, ArrSz(chunkHash));
-                    previousMultiChunkID = 0;
-                    multiChunk.Reset();
-                    return true;
-                }
+            if (previousMultiChunkID && previousMultiChunkID == currentMultiChunkID)
+            {   // This multichunk was reopened, so replace it (its previous file is removed once the index is saved)
+                FileFormat::Multichunk * mc = new FileFormat::Multichunk((uint16)currentMultiChunkID);
+                mc->filterArgIndex = getFilterArgumentIndex(actualComp);
+                memcpy(mc->checksum, chunkHash, ArrSz(chunkHash));
+                if (!indexFile.replaceMultichunk(mc, multiChunkID.Forget())) return false;
+                previousMultiChunkID = 0;
+                multiChunk.Reset();
+                currentMultiChunkID = 0;
+                return true;
             }
             FileFormat::Multichunk * mc = new FileFormat::Multichunk(currentMultiChunkID);
             mc->filterArgIndex = getFilterArgumentIndex(actualComp);
@@ -1047,42 +1908,252 @@ namespace Frost
             return true;
         }
 
+        /** A decoded multichunk in the cache */
         struct ChunkCache
         {
+            /** The decoded multichunk (0 while loading or if loading failed) */
             Utils::ScopePtr<File::MultiChunk> chunk;
-            time_t                            lastAccessTime;
-            ChunkCache(File::MultiChunk * chunk) : chunk(chunk), lastAccessTime(time(NULL)) {}
+            /** The multichunk ID */
+            const uint64                      id;
+            /** The memory used by this multichunk, in bytes */
+            size_t                            size;
+            /** The number of users of this multichunk, it can't be evicted while used */
+            uint32                            pins;
+            /** The previous (more recently used) and next entries in the LRU list */
+            ChunkCache *                      prev, * next;
+            /** Set when the multichunk is loaded (or failed loading) */
+            Threading::Event                  loaded;
+            /** The loading error, if any */
+            String                            error;
+
+            ChunkCache(const uint64 id) : id(id), size(0), pins(1), prev(0), next(0), loaded(NULL, Threading::Event::ManualReset) {}
+        };
+        /** The callback used by the worker threads, they are not allowed to report anything, only the main thread does */
+        struct SilentProgressCallback : public ProgressCallback
+        {
+            virtual bool progressed(const Action, const String &, const uint64, const uint64, const uint32, const uint32, const FlushMode) { return true; }
         };
+        /** The interface used to load a multichunk that's not in the cache */
+        struct MultiChunkLoader
+        {
+            /** Load the multichunk
+                @return An empty string on success, or the error message */
+            virtual String load(File::MultiChunk & mchunk) = 0;
+            virtual ~MultiChunkLoader() {}
+        };
+        /** The decoded multichunk cache.
+            This is a LRU cache accounting for the memory actually used by the multichunks. It's split in shards, each with its own lock,
+            so it can be used from multiple threads. A multichunk is only decoded once, even if multiple threads ask for it at the same time.
+            The multichunks are pinned while used, and they are not evicted until released */
         struct MultiChunkCache
         {
+            enum { ShardCount = 16 };
             typedef Container::HashTable<ChunkCache, uint64> MultiChunkHash;
-            MultiChunkHash       hash;
+            /** A part of the cache */
+            struct Shard
+            {
+                Threading::FastLock lock;
+                MultiChunkHash      hash;
+                /** The most and least recently used loaded multichunks */
+                ChunkCache *        head, * tail;
+                Shard() : head(0), tail(0) {}
+            };
+
+            /** Pin a multichunk from the cache while it's used, and release it when destructed or when pinning another one */
+            struct Pin
+            {
+                MultiChunkCache & cache;
+                ChunkCache *      entry;
+
+                /** Set the pinned entry, releasing the previous one */
+                void set(ChunkCache * newEntry) { if (entry) cache.release(entry); entry = newEntry; }
+                File::MultiChunk * get() const { return entry ? (File::MultiChunk*)entry->chunk : 0; }
+
+                Pin(MultiChunkCache & cache) : cache(cache), entry(0) {}
+                ~Pin() { set(0); }
+            };
+
+            /** The cache usage statistics */
+            struct Statistics
+            {
+                /** The number of multichunks found in the cache (or being loaded by another thread) */
+                uint64 hits;
+                /** The number of multichunks that were loaded */
+                uint64 misses;
+                /** The time spent loading the multichunks, in milliseconds */
+                uint64 loadTime;
+                Statistics() : hits(0), misses(0), loadTime(0) {}
+            };
+
+            Shard                shards[ShardCount];
             const size_t         maxCacheSize;
+            /** The lock protecting the total size and the statistics */
+            Threading::FastLock  sizeLock;
             size_t               totalCacheSize;
+            Statistics           stats;
 
-            File::MultiChunk * getChunk(const uint64 id) { ChunkCache * cache = hash.getValue(id); if (cache) { cache->lastAccessTime = time(NULL); return cache->chunk; } return 0; }
-            bool storeChunk(File::MultiChunk * chunk, const uint64 id)
-            {
-                if (!chunk) return false;
-                // Check the cumulative size
-                if (totalCacheSize + chunk->getSize() > maxCacheSize)
-                {
-                    // Need to prune the oldest multichunk from the cache
-                    MultiChunkHash::IterT iter = hash.getFirstIterator();
-                    time_t oldest = time(NULL); uint64 oldestHash = 0; size_t oldSize = 0;
-                    while(iter.isValid())
-                    {
-                        if ((*iter)->lastAccessTime < oldest) { oldest = (*iter)->lastAccessTime; oldestHash = *iter.getKey(); oldSize = (*iter)->chunk->getSize(); }
-                        ++iter;
-                    }
+            Shard & getShard(const uint64 id) { return shards[id % ShardCount]; }
 
-                    totalCacheSize -= oldSize;
-                    hash.removeValue(oldestHash);
-                }
-                totalCacheSize += chunk->getSize();
-                return hash.storeValue(id, new ChunkCache(chunk));
+            /** Unlink an entry from its shard's LRU list */
+            static void unlink(Shard & shard, ChunkCache * entry)
+            {
+                if (entry->prev) entry->prev->next = entry->next; else if (shard.head == entry) shard.head = entry->next;
+                if (entry->next) entry->next->prev = entry->prev; else if (shard.tail == entry) shard.tail = entry->prev;
+                entry->prev = entry->next = 0;
             }
-
+            /** Link an entry at the front of its shard's LRU list */
+            static void linkFront(Shard & shard, ChunkCache * entry)
+            {
+                entry->prev = 0; entry->next = shard.head;
+                if (shard.head) shard.head->prev = entry;
+                shard.head = entry;
+                if (!shard.tail) shard.tail = entry;
+            }
+            /** Get a copy of the cache statistics */
+            Statistics getStatistics()
+            {
+                Threading::ScopedLock scope(sizeLock);
+                return stats;
+            }
+            /** Account a cache access */
+            void accountAccess(const bool hit, const uint32 loadTime = 0)
+            {
+                Threading::ScopedLock scope(sizeLock);
+                if (hit) stats.hits++; else stats.misses++;
+                stats.loadTime += loadTime;
+            }
+            /** Change the total size and check if the cache is over budget */
+            bool accountSize(const size_t added, const size_t removed)
+            {
+                Threading::ScopedLock scope(sizeLock);
+                totalCacheSize = totalCacheSize + added - removed;
+                return totalCacheSize > maxCacheSize;
+            }
+
+            /** Evict the least recently used multichunks that are not pinned until the cache fits its budget.
+                The shards are visited starting with the given one, and only one shard lock is held at a time */
+            void trim(const size_t firstShard)
+            {
+                for (size_t s = 0; s < ShardCount && accountSize(0, 0); s++)
+                {
+                    Shard & shard = shards[(firstShard + s) % ShardCount];
+                    Threading::ScopedLock scope(shard.lock);
+                    ChunkCache * entry = shard.tail;
+                    while (entry)
+                    {
+                        ChunkCache * prev = entry->prev;
+                        if (!entry->pins)
+                        {
+                            unlink(shard, entry);
+                            const bool overBudget = accountSize(0, entry->size);
+                            shard.hash.removeValue(entry->id);
+                            if (!overBudget) return;
+                        }
+                        entry = prev;
+                    }
+                }
+            }
+
+            /** Release a pinned multichunk */
+            void release(ChunkCache * entry)
+            {
+                const size_t shardIndex = (size_t)(entry->id % ShardCount);
+                {
+                    Shard & shard = shards[shardIndex];
+                    Threading::ScopedLock scope(shard.lock);
+                    if (--entry->pins) return;
+                    // Failed entries are forgotten once no one is waiting on them anymore
+                    if (!entry->chunk) { shard.hash.removeValue(entry->id); return; }
+                }
+                trim(shardIndex);
+            }
+
+            /** Get the given multichunk and pin it, loading it if it's not in the cache.
+                If another thread is already loading the multichunk, this waits for it instead of loading it again.
+                @return true on success, or false on error (the error message is set) */
+            bool acquire(Pin & pin, const uint64 id, MultiChunkLoader & loader, String & error)
+            {
+                Shard & shard = getShard(id);
+                ChunkCache * entry = 0;
+                bool mustLoad = false;
+                {
+                    Threading::ScopedLock scope(shard.lock);
+                    entry = shard.hash.getValue(id);
+                    if (entry)
+                    {
+                        entry->pins++;
+                        if (entry->chunk) { unlink(shard, entry); linkFront(shard, entry); }
+                    }
+                    else
+                    {
+                        entry = new ChunkCache(id);
+                        shard.hash.storeValue(id, entry);
+                        mustLoad = true;
+                    }
+                }
+                pin.set(entry);
+
+                if (!mustLoad)
+                {
+                    accountAccess(true);
+                    // Wait for the loading thread, if any
+                    entry->loaded.Wait();
+                    if (entry->chunk) return true;
+                    error = entry->error;
+                    return false;
+                }
+
+                File::MultiChunk * mchunk = new File::MultiChunk;
+                const uint32 startTime = Time::getTimeWithBase(1000);
+                String loadError = loader.load(*mchunk);
+                accountAccess(false, Time::getTimeWithBase(1000) - startTime);
+                if (loadError) delete mchunk;
+                else
+                {   // Don't keep the preallocated space that's not used
+                    mchunk->chunkArray.ensureSize(mchunk->chunkArray.getSize());
+                    entry->size = sizeof(*mchunk) + mchunk->getSize() + mchunk->chunkPos.getSize() * sizeof(uint32);
+                }
+                {
+                    Threading::ScopedLock scope(shard.lock);
+                    if (loadError) entry->error = loadError;
+                    else
+                    {
+                        entry->chunk = mchunk;
+                        linkFront(shard, entry);
+                    }
+                }
+                entry->loaded.Set();
+                if (loadError) { error = loadError; return false; }
+                if (accountSize(entry->size, 0)) trim((size_t)(id % ShardCount));
+                return true;
+            }
+
+            /** Check if the given multichunk is in the cache (or being loaded), without pinning it */
+            bool contains(const uint64 id)
+            {
+                Shard & shard = getShard(id);
+                Threading::ScopedLock scope(shard.lock);
+                return shard.hash.getValue(id) != 0;
+            }
+
+            /** Pin the given multichunk only if it's already loaded in the cache
+                @return true if the multichunk was found and pinned */
+            bool acquireCached(Pin & pin, const uint64 id)
+            {
+                Shard & shard = getShard(id);
+                ChunkCache * entry = 0;
+                {
+                    Threading::ScopedLock scope(shard.lock);
+                    entry = shard.hash.getValue(id);
+                    if (!entry || !entry->chunk) return false;
+                    entry->pins++;
+                    unlink(shard, entry); linkFront(shard, entry);
+                }
+                pin.set(entry);
+                accountAccess(true);
+                return true;
+            }
+
             MultiChunkCache(const size_t maxCacheSize) : maxCacheSize(maxCacheSize), totalCacheSize(0) {}
         };
 
@@ -1095,19 +2166,18 @@ namespace Frost
             ::Stream::OutputMemStream compressedData;
 
             KeyFactory::KeyT chunkHash;
-            uint32 chunkHashSize = (uint32)ArrSz(chunkHash);
             if (worthTelling && !callback.progressed(ProgressCallback::Restore, TRANS("Checking multichunk integrity"), 0, 0, 0, 0, ProgressCallback::KeepLine))
                 return "Interrupted";
 
-            if (!Helpers::toBinary(fullMultiChunkPath.fromLast("/").upToLast("."), chunkHash, chunkHashSize, false)
-                || chunkHashSize != (uint32)ArrSz(chunkHash))
+            if (!getMultichunkHash(fullMultiChunkPath, chunkHash))
                 return TRANS("Error while decoding the hash of the multichunk: ") + fullMultiChunkPath;
 
             // Decrypt it now
             if (worthTelling && !callback.progressed(ProgressCallback::Restore, TRANS("Decrypting multichunk"), 0, 0, 0, 0, ProgressCallback::KeepLine))
                 return "";
             // We only support counter mode for now
-            if (filterMode.fromLast(":") == "AES_CTR" && !Helpers::AESCounterDecrypt(chunkHash, chunkFile, compressedData))
+            const bool framed = isFramed(filterMode);
+            if ((framed || filterMode.fromLast(":") == "AES_CTR") && !Helpers::AESCounterDecrypt(chunkHash, chunkFile, compressedData))
                 return TRANS("Can not decode the multichunk: ") + fullMultiChunkPath;
 
             // Decompress it
@@ -1120,7 +2190,23 @@ namespace Frost
 
             // Then decompress
             String compUsed = filterMode.fromTo(":", ":");
-            if (compUsed == "zLib")
+            if (framed)
+            {   // Decode all the frames
+                FileFormat::FrameEntries frames;
+                const uint8 * data = compressedData.getBuffer();
+                if (!parseFrameTable(data, compressedData.fullSize(), frames))
+                    return TRANS("Invalid frame table in multichunk: ") + fullMultiChunkPath;
+                const uint64 tableSize = FileFormat::FrameTable((uint32)frames.getSize()).getSize();
+                mchunk.Reset();
+                for (size_t i = 0; i < frames.getSize(); i++)
+                {
+                    const FileFormat::FrameEntry & frame = frames[i];
+                    if (tableSize + frame.offset + frame.compressedSize > compressedData.fullSize()
+                        || !decodeFrame(&data[tableSize + frame.offset], frame, compUsed, mchunk))
+                        return TRANS("Can not decompress data from multichunk: ") + fullMultiChunkPath;
+                }
+            }
+            else if (compUsed == "zLib")
             {   // And zLib
                 ::Stream::MemoryBlockStream compressedStream(compressedData.getBuffer(), compressedData.fullSize());
                 {
@@ -1166,38 +2252,141 @@ namespace Frost
             return "";
         }
 
-        File::Chunk * extractChunkBin(String & error, const String & basePath, const String & MultiChunkPath, const uint64 MultiChunkID, const size_t chunkOffset, const uint8 * chunkCS, const String & filterMode, MultiChunkCache & cache, ProgressCallback & callback)
+        /** Load a multichunk from the backup folder */
+        struct MultiChunkFileLoader : public MultiChunkLoader
         {
-            File::MultiChunk * cached = cache.getChunk(MultiChunkID);
+            const String &     fullPath;
+            const String &     filterMode;
+            ProgressCallback & callback;
+
+            String load(File::MultiChunk & mchunk) { return readMultichunk(fullPath, filterMode, mchunk, callback); }
+            MultiChunkFileLoader(const String & fullPath, const String & filterMode, ProgressCallback & callback) : fullPath(fullPath), filterMode(filterMode), callback(callback) {}
+        };
 
-            if (!cached)
+        /** The frame tables of the framed multichunks, so they are only read once.
+            The cache is bounded, since it lives as long as the process (a FUSE mount can read any number of multichunks).
+            When full, it's simply emptied: reading a frame table again only decrypts the table, not the frames */
+        struct FrameTableCache
+        {
+            /** The frame tables, indexed by multichunk file path (which depends on the multichunk content) */
+            typedef Container::HashTable<FileFormat::FrameEntries, String, Container::HashKey<String> > FrameTables;
+            enum { MaxCacheSize = 4 * 1024 * 1024 };
+            Threading::FastLock lock;
+            FrameTables         tables;
+            /** The size of the cached frame entries, in bytes */
+            size_t              cacheSize;
+
+            /** Find the frame containing the given offset in the multichunk's chunk array, reading the frame table if required
+                @param frame        On output, set to the found frame
+                @param framesStart  On output, set to the offset of the compressed frames in the decrypted multichunk
+                @return the frame index, or -1 on error */
+            uint32 findFrame(const String & fullPath, const size_t chunkOffset, FileFormat::FrameEntry & frame, uint64 & framesStart)
             {
-                cached = new File::MultiChunk;
-                if (!cached)
                 {
-                    error = TRANS("Not enough memory to allocate multichunk: ") + MultiChunkPath;
-                    return 0;
+                    Threading::ScopedLock scope(lock);
+                    const FileFormat::FrameEntries * frames = tables.getValue(fullPath);
+                    if (frames) return findFrame(*frames, chunkOffset, frame, framesStart);
                 }
-                File::MultiChunk & mchunk = *cached;
-
-                error = readMultichunk(basePath + MultiChunkPath, filterMode, mchunk, callback);
-                if (error) return 0;
-
-                // It worked, so let's save it to avoid reloading it
-                if (!cache.storeChunk(cached, MultiChunkID))
+                // Only decrypt the frame table from the multichunk
+                KeyFactory::KeyT chunkHash;
+                if (!getMultichunkHash(fullPath, chunkHash)) return (uint32)-1;
+                ::Stream::InputFileStream file(fullPath);
+                ::Stream::OutputMemStream tableData;
+                FileFormat::FrameTable table;
+                if (!AESCounterDecryptAt(chunkHash, file, 0, sizeof(table), tableData) || tableData.fullSize() != sizeof(table)) return (uint32)-1;
+                memcpy(&table, tableData.getBuffer(), sizeof(table));
+                if (!table.isCorrect() || !AESCounterDecryptAt(chunkHash, file, sizeof(table), table.getSize() - sizeof(table), tableData)) return (uint32)-1;
+
+                FileFormat::FrameEntries * frames = new FileFormat::FrameEntries;
+                if (!parseFrameTable(tableData.getBuffer(), tableData.fullSize(), *frames)) { delete frames; return (uint32)-1; }
+
+                Threading::ScopedLock scope(lock);
+                // Another thread might have read it in the meantime
+                if (tables.getValue(fullPath)) { delete frames; frames = tables.getValue(fullPath); }
+                else
                 {
-                    error = TRANS("Can not store multichunk in cache: ") + MultiChunkPath;
-                    return 0;
+                    const size_t size = frames->getSize() * sizeof(FileFormat::FrameEntry);
+                    if (cacheSize + size > MaxCacheSize) { tables.clearTable(); cacheSize = 0; }
+                    tables.storeValue(fullPath, frames);
+                    cacheSize += size;
+                }
+                return findFrame(*frames, chunkOffset, frame, framesStart);
+            }
+            /** Find the frame containing the given offset (the frames are sorted by offset) */
+            static uint32 findFrame(const FileFormat::FrameEntries & frames, const size_t chunkOffset, FileFormat::FrameEntry & frame, uint64 & framesStart)
+            {
+                size_t low = 0, high = frames.getSize();
+                while (low < high)
+                {
+                    size_t mid = (low + high) / 2;
+                    if (frames[mid].contains(chunkOffset)) { frame = frames[mid]; framesStart = FileFormat::FrameTable((uint32)frames.getSize()).getSize(); return (uint32)mid; }
+                    if (chunkOffset < frames[mid].dataOffset) high = mid; else low = mid + 1;
                 }
+                return (uint32)-1;
+            }
+
+            FrameTableCache() : cacheSize(0) {}
+        };
+        FrameTableCache frameTables;
+
+        /** Load a single frame of a framed multichunk from the backup folder.
+            The loaded multichunk only contains the frame's chunks, and its opaque value is set to the frame's offset in the whole multichunk */
+        struct MultiChunkFrameLoader : public MultiChunkLoader
+        {
+            const String &                  fullPath;
+            const String &                  filterMode;
+            const FileFormat::FrameEntry &  frame;
+            const uint64                    framesStart;
+
+            String load(File::MultiChunk & mchunk)
+            {
+                KeyFactory::KeyT chunkHash;
+                if (!getMultichunkHash(fullPath, chunkHash)) return TRANS("Error while decoding the hash of the multichunk: ") + fullPath;
+                ::Stream::InputFileStream file(fullPath);
+                ::Stream::OutputMemStream compressed;
+                if (!AESCounterDecryptAt(chunkHash, file, framesStart + frame.offset, frame.compressedSize, compressed) || compressed.fullSize() != frame.compressedSize)
+                    return TRANS("Can not decode the multichunk: ") + fullPath;
+                mchunk.Reset();
+                if (!decodeFrame(compressed.getBuffer(), frame, filterMode.fromTo(":", ":"), mchunk))
+                    return TRANS("Corruption detected in multichunk: ") + fullPath;
+                mchunk.setOpaque(frame.dataOffset);
+                return "";
+            }
+            MultiChunkFrameLoader(const String & fullPath, const String & filterMode, const FileFormat::FrameEntry & frame, const uint64 framesStart)
+                : fullPath(fullPath), filterMode(filterMode), frame(frame), framesStart(framesStart) {}
+        };
+
+        /** Extract a chunk from the given multichunk, using the cache.
+            For framed multichunks, only the frame containing the chunk is decoded, unless the whole multichunk is already in the cache.
+            The multichunk containing the returned chunk is kept in the given pin, so the chunk is valid until the pin is changed */
+        File::Chunk * extractChunkBin(String & error, const String & basePath, const String & MultiChunkPath, const uint64 MultiChunkID, const size_t chunkOffset, const uint8 * chunkCS, const String & filterMode, MultiChunkCache::Pin & pin, ProgressCallback & callback)
+        {
+            const String fullPath = basePath + MultiChunkPath;
+            if (chunkOffset != (size_t)-1 && isFramed(filterMode) && !pin.cache.acquireCached(pin, MultiChunkID))
+            {
+                FileFormat::FrameEntry frame;
+                uint64 framesStart = 0;
+                const uint32 frameIndex = frameTables.findFrame(fullPath, chunkOffset, frame, framesStart);
+                if (frameIndex == (uint32)-1) { error = TRANS("Invalid frame table in multichunk: ") + fullPath; return 0; }
+                // The frames are cached with their own identifier
+                MultiChunkFrameLoader frameLoader(fullPath, filterMode, frame, framesStart);
+                if (!pin.cache.acquire(pin, ((uint64)(frameIndex + 1) << 32) | MultiChunkID, frameLoader, error)) return 0;
+                File::Chunk * chunk = pin.get()->findChunk(chunkCS, chunkOffset - frame.dataOffset);
+                if (chunk) return chunk;
+                // Not in the expected frame, so fallback to searching the whole multichunk
             }
+            else if (pin.get() && pin.entry->id == MultiChunkID) return pin.get()->findChunk(chunkCS, (size_t)chunkOffset);
+
+            MultiChunkFileLoader loader(fullPath, filterMode, callback);
+            if (!pin.cache.acquire(pin, MultiChunkID, loader, error)) return 0;
 
             // Ok, extract the chunk
-            File::Chunk * chunk = cached->findChunk(chunkCS, (size_t)chunkOffset);
+            File::Chunk * chunk = pin.get()->findChunk(chunkCS, (size_t)chunkOffset);
             return chunk;
         }
 
 
-        File::Chunk * extractChunk(String & error, const String & basePath, const String & MultiChunkPath, const uint64 MultiChunkID, const size_t chunkOffset, const String & chunkChecksum, const String & filterMode, MultiChunkCache & cache, ProgressCallback & callback)
+        File::Chunk * extractChunk(String & error, const String & basePath, const String & MultiChunkPath, const uint64 MultiChunkID, const size_t chunkOffset, const String & chunkChecksum, const String & filterMode, MultiChunkCache::Pin & pin, ProgressCallback & callback)
         {
             error = "";
             // Ok, extract the chunk
@@ -1208,9 +2397,282 @@ namespace Frost
                 error = TRANS("Bad checksum for chunk with checksum: ") + chunkChecksum;
                 return 0;
             }
-            return extractChunkBin(error, basePath, MultiChunkPath, MultiChunkID, chunkOffset, chunkCS, filterMode, cache, callback);
+            return extractChunkBin(error, basePath, MultiChunkPath, MultiChunkID, chunkOffset, chunkCS, filterMode, pin, callback);
         }
 
+        /** Decode the multichunks that will be needed soon in background threads, so decoding overlaps with writing the output.
+            The prefetched multichunks are kept pinned in the cache until they are used, and the lookahead is bounded by a memory budget */
+        class MultiChunkPrefetcher
+        {
+            /** The thread decoding the multichunks ahead */
+            struct Worker : public Threading::Thread
+            {
+                MultiChunkPrefetcher & prefetcher;
+                uint32 runThread() { prefetcher.prefetch(); return 0; }
+
+                Worker(MultiChunkPrefetcher & prefetcher) : prefetcher(prefetcher) {}
+                ~Worker() { destroyThread(); }
+            };
+            typedef Container::NotConstructible<Worker>::IndexList Workers;
+
+            MultiChunkCache &    cache;
+            /** The multichunks to prefetch, in the order they are used */
+            Container::PlainOldData<uint64>::Array ids;
+            /** The multichunks path and filter arguments (the index can't be used from the workers) */
+            Strings::StringArray paths, filters;
+            /** The pins on the prefetched multichunks, until they are used */
+            Container::PlainOldData<MultiChunkCache::Pin *>::Array pins;
+            /** The largest multichunk size */
+            uint32               largestSize;
+            /** The number of multichunks to decode ahead */
+            uint32               lookahead;
+            /** The lock protecting the positions below */
+            Threading::FastLock  lock;
+            /** Signaled when the used multichunk changes */
+            Threading::Event     moved;
+            /** The next multichunk to prefetch, and the one currently used */
+            uint32               next, current;
+            bool                 stop;
+            Workers              workers;
+
+            /** Decode the next multichunks, while in the lookahead window */
+            void prefetch()
+            {
+                SilentProgressCallback silent;
+                while (true)
+                {
+                    uint32 index = (uint32)-1;
+                    {
+                        Threading::ScopedLock scope(lock);
+                        if (stop || exitRequired || next >= ids.getSize()) return;
+                        if (next <= current + lookahead) index = next++;
+                    }
+                    if (index == (uint32)-1) { moved.Wait((uint32)100); continue; }
+
+                    MultiChunkCache::Pin * pin = new MultiChunkCache::Pin(cache);
+                    MultiChunkFileLoader loader(paths[index], filters[index], silent);
+                    String error;
+                    // Errors are ignored here, they are reported when the multichunk is actually used
+                    cache.acquire(*pin, ids[index], loader, error);
+
+                    Threading::ScopedLock scope(lock);
+                    if (index < current) delete pin;
+                    else pins.getElementAtUncheckedPosition(index) = pin;
+                }
+            }
+
+        public:
+            /** Append a multichunk to prefetch, in the order they'll be used */
+            void append(const uint64 id, const String & path, const String & filterMode)
+            {
+                if (ids.getSize() && ids[ids.getSize() - 1] == id) return;
+                ids.Append(id); paths.Append(path); filters.Append(filterMode); pins.Append(0);
+                largestSize = max(largestSize, (uint32)filterMode.upToFirst(":").parseInt(10));
+            }
+            /** Start prefetching within the given memory budget */
+            void start(const size_t budget)
+            {
+                if (!budget || ids.getSize() < 2) return;
+                // Make sure the multichunk size is large enough before the workers start decoding
+                if (largestSize > File::MultiChunk::MaximumSize) File::MultiChunk::setMaximumSize(largestSize);
+                lookahead = (uint32)max((size_t)1, budget / File::MultiChunk::MaximumSize);
+                const uint32 threads = min((uint32)max(1, Threading::Thread::getCurrentCoreCount()), lookahead);
+                for (uint32 i = 0; i < threads; i++)
+                {
+                    Worker * worker = new Worker(*this);
+                    workers.Append(worker);
+                    if (!worker->createThread()) break;
+                }
+            }
+            /** Tell the prefetcher which multichunk is used now, so the previous ones are released and the window moves forward */
+            void use(const uint64 id)
+            {
+                if (!workers.getSize()) return;
+                Threading::ScopedLock scope(lock);
+                uint32 index = current;
+                while (index < ids.getSize() && ids[index] != id) index++;
+                if (index == ids.getSize()) return;
+                for (; current < index; current++)
+                {
+                    delete pins[current];
+                    pins.getElementAtUncheckedPosition(current) = 0;
+                }
+                moved.Set();
+            }
+
+            MultiChunkPrefetcher(MultiChunkCache & cache) : cache(cache), largestSize(0), lookahead(0), moved(NULL, Threading::Event::AutoReset), next(0), current(0), stop(false) {}
+            ~MultiChunkPrefetcher()
+            {
+                {
+                    Threading::ScopedLock scope(lock);
+                    stop = true;
+                }
+                moved.Set();
+                // Wait for the workers to finish
+                workers.Clear();
+                for (size_t i = 0; i < pins.getSize(); i++) delete pins[i];
+            }
+        };
+
+        /** Seal (compress, encrypt and write) the full multichunks in background threads, while the next ones are being filled.
+            The multichunks content and their index record are decided by the caller, so the result doesn't depend on the number of threads.
+            The sealed multichunk's checksum is stored in its record, so the record must not be saved before finishing */
+        class MultiChunkSealer
+        {
+            /** The thread sealing the multichunks */
+            struct Worker : public Threading::Thread
+            {
+                MultiChunkSealer & sealer;
+                uint32 runThread() { sealer.sealJobs(); return 0; }
+
+                Worker(MultiChunkSealer & sealer) : sealer(sealer) {}
+                ~Worker() { destroyThread(); }
+            };
+            typedef Container::NotConstructible<Worker>::IndexList Workers;
+            /** A multichunk to seal */
+            struct Job
+            {
+                /** The multichunk to seal (owned until it's sealed) */
+                File::MultiChunk *          multichunk;
+                /** The compressor to use */
+                CompressorToUse             compressor;
+                /** The index record to store the checksum into */
+                FileFormat::Multichunk *    record;
+
+                Job(File::MultiChunk * multichunk, const CompressorToUse compressor, FileFormat::Multichunk * record) : multichunk(multichunk), compressor(compressor), record(record) {}
+                ~Job() { delete0(multichunk); }
+            };
+            typedef Container::NotConstructible<Job>::IndexList Jobs;
+
+            /** The folder to write the multichunks into */
+            const String         folder;
+            /** The multichunks to seal, in the order they were filled */
+            Jobs                 jobs;
+            /** The path of the multichunks written so far (even if sealing failed afterwards), it's owned by the caller */
+            Strings::StringArray & written;
+            /** The maximum number of multichunks waiting to be sealed, this bounds the memory used */
+            uint32               maxPending;
+            /** The lock protecting the members below */
+            Threading::FastLock  lock;
+            /** Signaled when a job is appended, or when a job is done */
+            Threading::Event     appended, sealed;
+            /** The next job to seal, and the number of jobs done */
+            uint32               next, done;
+            bool                 stop;
+            /** The first error that happened in the workers */
+            String               error;
+            Workers              workers;
+
+            /** Seal a multichunk, and release it
+                @return false on error */
+            bool sealJob(Job & job)
+            {
+                SilentProgressCallback silent;
+                KeyFactory::KeyT chunkHash;
+                String chunkPath = folder;
+                const bool ok = closeMultiChunkBin(chunkPath, *job.multichunk, 0, silent, job.compressor, chunkHash);
+                if (ok) memcpy(job.record->checksum, chunkHash, ArrSz(chunkHash));
+                delete0(job.multichunk);
+
+                Threading::ScopedLock scope(lock);
+                if (chunkPath != folder) written.Append(chunkPath);
+                if (!ok && !error) error = TRANS("Error: Closing multichunk failed");
+                done++;
+                sealed.Set();
+                return ok;
+            }
+            /** Seal the queued multichunks until asked to stop */
+            void sealJobs()
+            {
+                while (true)
+                {
+                    Job * job = 0;
+                    {
+                        Threading::ScopedLock scope(lock);
+                        if (error || exitRequired) return;
+                        if (next < jobs.getSize()) job = jobs.getElementAtUncheckedPosition(next++);
+                        else if (stop) return;
+                    }
+                    if (!job) { appended.Wait((uint32)100); continue; }
+                    if (!sealJob(*job)) return;
+                }
+            }
+
+        public:
+            /** Seal the given multichunk in the background.
+                This blocks while too many multichunks are waiting to be sealed.
+                @param multichunk   The multichunk to seal, it's owned
+                @param compressor   The compressor to use
+                @param record       The multichunk's record in the index, its checksum is set when sealed
+                @return An empty string on success, or the first error that happened while sealing */
+            String seal(File::MultiChunk * multichunk, const CompressorToUse compressor, FileFormat::Multichunk * record)
+            {
+                Job * job = new Job(multichunk, compressor, record);
+                while (true)
+                {
+                    {
+                        Threading::ScopedLock scope(lock);
+                        if (error) { delete job; return error; }
+                        if (exitRequired) { delete job; return TRANS("Interrupted"); }
+                        if (!workers.getSize())
+                        {   // No thread to seal in the background, so seal it now
+                            jobs.Append(job);
+                            next++;
+                            break;
+                        }
+                        if (jobs.getSize() - done < maxPending)
+                        {
+                            jobs.Append(job);
+                            appended.Set();
+                            return "";
+                        }
+                    }
+                    sealed.Wait((uint32)100);
+                }
+                sealJob(*job);
+                return error;
+            }
+            /** Wait for all the multichunks to be sealed
+                @return An empty string on success, or the first error that happened while sealing */
+            String finish()
+            {
+                {
+                    Threading::ScopedLock scope(lock);
+                    stop = true;
+                }
+                appended.Set();
+                // Wait for the workers to finish
+                workers.Clear();
+                if (!error && done < jobs.getSize()) return TRANS("Interrupted");
+                return error;
+            }
+
+            /** Build a sealer
+                @param folder   The folder to write the multichunks into
+                @param written  The array to append the path of the written multichunks to. It must not be used until finished */
+            MultiChunkSealer(const String & folder, Strings::StringArray & written) : folder(folder), written(written), maxPending(1), appended(NULL, Threading::Event::AutoReset), sealed(NULL, Threading::Event::AutoReset), next(0), done(0), stop(false)
+            {
+                const uint32 threads = (uint32)max(1, Threading::Thread::getCurrentCoreCount());
+                // Let the caller fill the next multichunks while the previous ones are sealed
+                maxPending = 2 * threads;
+                for (uint32 i = 0; i < threads; i++)
+                {
+                    Worker * worker = new Worker(*this);
+                    if (!worker->createThread()) { delete worker; break; }
+                    workers.Append(worker);
+                }
+            }
+            ~MultiChunkSealer()
+            {
+                {
+                    Threading::ScopedLock scope(lock);
+                    stop = true;
+                }
+                appended.Set();
+                workers.Clear();
+            }
+        };
+
         uint32 allocateChunkList()
         {
             return indexFile.allocateChunkListID();
@@ -1224,11 +2686,28 @@ namespace Frost
         if (!File::Info(indexPath).doesExist())
         {
             revisionID = 1;
+            Helpers::indexFile.maintainRefCounts(FileFormat::IndexFile::getRefCountsPath(indexPath));
             return Helpers::indexFile.createNew(indexPath, cipheredMasterKey, backupPath);
         }
+        // An initial backup that was interrupted before saving its revision leaves an index with only a header, so start it again (with the same master key)
+        File::Info indexInfo(indexPath);
+        if (backupPath && indexInfo.size == FileFormat::MainHeader::getSize())
+        {
+            FileFormat::MainHeader header;
+            Stream::InputFileStream stream(indexPath);
+            if (stream.read(&header, sizeof(header)) == sizeof(header) && header.isSupportedFormat())
+            {
+                cipheredMasterKey = MemoryBlock(header.cipheredMasterKey, ArrSz(header.cipheredMasterKey));
+                if (!indexInfo.remove()) return TRANS("Could not remove the incomplete index file: ") + indexPath;
+                revisionID = 1;
+                Helpers::indexFile.maintainRefCounts(FileFormat::IndexFile::getRefCountsPath(indexPath));
+                return Helpers::indexFile.createNew(indexPath, cipheredMasterKey, backupPath);
+            }
+        }
         // File exists, let's create a new revision if required
         const String & ret = Helpers::indexFile.readFile(indexPath, backupPath);
         if (ret) return ret;
+        if (backupPath) Helpers::indexFile.maintainRefCounts(FileFormat::IndexFile::getRefCountsPath(indexPath));
         cipheredMasterKey = Helpers::indexFile.getCipheredMasterKey().getMovable();
         if (backupPath && !Helpers::indexFile.startNewRevision())
             return TRANS("Could not start a new revision in index file.");
@@ -1271,6 +2750,28 @@ namespace Frost
     /** The cache of files for a revision */
     typedef Container::HashTable<FileMDEntry, String, Container::HashKey<String> > PathIDMapT;
 
+    /** The hard link map (from "dev/inode" to the chunk list ID of the first link seen) */
+    typedef Container::HashTable<uint32, String, Container::HashKey<String> > HardLinkMapT;
+    /** The restored hard link map (from "dev/inode" to the first link's restored path) */
+    typedef Container::HashTable<String, String, Container::HashKey<String> > RestoredLinkMapT;
+    /** The item map (from a path to the item's index in a file tree) */
+    typedef Container::HashTable<uint32, String, Container::HashKey<String> > ItemIDMapT;
+
+    /** Get the hard link identifier for the given (expanded) metadata.
+        @param metadata     The expanded metadata string (as returned by File::Info::expandMetaData)
+        @return "dev/inode" for a regular file with more than one link, or an empty string otherwise */
+    String getHardLinkKey(const String & metadata)
+    {
+        // Symbolic links and devices are prefixed by PS or PT, they are never hard link candidates
+        if (metadata.getLength() < 2 || metadata[0] != 'P' || metadata[1] == 'S' || metadata[1] == 'T') return "";
+        String md = metadata.midString(1, metadata.getLength());
+        String dev = md.splitUpTo("/"), ino = md.splitUpTo("/");
+        uint32 mode = (uint32)md.splitUpTo("/").parseInt(16);
+        md.splitUpTo("/"); // Skip size
+        if ((mode & S_IFMT) != S_IFREG || (uint32)md.splitUpTo("/").parseInt(16) < 2) return "";
+        return dev + "/" + ino;
+    }
+
     /** The index array */
     typedef Container::PlainOldData<uint32>::Array IndexArray;
     /** Collect the list of files in a directory based on the Entry's in the database.
@@ -1359,6 +2860,56 @@ namespace Frost
 
         return true;
     }
+    /** Collect the items of a subtree of the file tree.
+        This only uses the parent index of each item, so no path is built for the items out of the subtree.
+        @param fileTree     The file tree to walk
+        @param subtreePath  The path of the subtree's root in the backup (empty for the whole tree)
+        @param items        On output, contains the index of the subtree's items and of the root's parent directories, in file tree order
+        @return false if the subtree's root is not found */
+    bool collectSubtreeItems(const FileFormat::FileTree & fileTree, const String & subtreePath, IndexArray & items)
+    {
+        CondScopeProfiler;
+        items.Clear();
+        const uint32 count = (uint32)fileTree.items.getSize();
+        if (!subtreePath)
+        {
+            for (uint32 i = 0; i < count; i++) items.Append(i);
+            return true;
+        }
+        const uint32 root = fileTree.findItem(subtreePath);
+        if (root == fileTree.notFound()) return false;
+
+        enum { Unknown = 0, Inside, Outside, Parent };
+        Utils::MemoryBlock state(count);
+        if (!state.ensureSize(count, true)) return false;
+        uint8 * status = state.getBuffer();
+        memset(status, Unknown, count);
+        // The root's parents are required to restore the root, but their other children are not
+        for (uint32 p = fileTree.items[root].getParentID(), depth = 0; p && p <= count && depth < count; p = fileTree.items[p-1].getParentID(), depth++)
+            status[p-1] = Parent;
+        status[root] = Inside;
+
+        IndexArray chain;
+        for (uint32 i = 0; i < count; i++)
+        {
+            // Walk up until an item with a known status is found, and propagate it down the chain
+            chain.Clear();
+            uint32 h = i;
+            while (status[h] == Unknown && chain.getSize() < count)
+            {
+                chain.Append(h);
+                const uint32 p = fileTree.items[h].getParentID();
+                if (!p || p > count) break;
+                h = p - 1;
+            }
+            const uint8 found = status[h] == Inside ? Inside : Outside;
+            for (size_t c = 0; c < chain.getSize(); c++) status[chain[c]] = found;
+
+            if (status[i] == Inside || status[i] == Parent) items.Append(i);
+        }
+        return true;
+    }
+
     /** Create a list of directories based on the Entry's in the database.
         @param dirList  On output, will be filled with the directories to create for restoring
         @param revID    The maximum revision ID to include
@@ -1505,18 +3056,150 @@ namespace Frost
         AllFiles(ProgressCallback & callback) : count(0), callback(callback) {}
     };
 
+    /** Match many literal patterns at once (this is an Aho-Corasick automaton).
+        A text is tested against all patterns in a single pass, whatever the number of patterns */
+    class LiteralMatcher
+    {
+        /** A node in the patterns' trie */
+        struct Node
+        {
+            /** The first edge leaving this node (1-based index in the edges array, 0 for none) */
+            uint32 firstEdge;
+            /** The node to continue from when no edge matches (the longest suffix that's also a prefix of a pattern) */
+            uint32 fail;
+            /** Set if a pattern ends here (or in any of its suffixes) */
+            bool   terminal;
+
+            Node(const uint32 firstEdge = 0) : firstEdge(firstEdge), fail(0), terminal(false) {}
+        };
+        /** An edge in the patterns' trie */
+        struct Edge
+        {
+            /** The child node */
+            uint32 child;
+            /** The next edge for the same parent (1-based index, 0 for none) */
+            uint32 next;
+            /** The byte for this edge */
+            uint8  byte;
+
+            Edge(const uint8 byte = 0, const uint32 child = 0, const uint32 next = 0) : child(child), next(next), byte(byte) {}
+        };
+        typedef Container::PlainOldData<Node>::Array NodeArray;
+        typedef Container::PlainOldData<Edge>::Array EdgeArray;
+        typedef Container::PlainOldData<uint32>::Array IndexArray;
+
+        NodeArray nodes;
+        EdgeArray edges;
+
+        /** Find the child of the given node for the given byte (0 if not found, since the root can't be a child) */
+        inline uint32 findChild(const uint32 node, const uint8 byte) const
+        {
+            for (uint32 e = nodes[node].firstEdge; e; e = edges[e - 1].next)
+                if (edges[e - 1].byte == byte) return edges[e - 1].child;
+            return 0;
+        }
+
+    public:
+        /** Check if any pattern was added */
+        inline bool hasPatterns() const { return nodes.getSize() > 1; }
+        /** Add a pattern to match (you must call compile() after all patterns are added) */
+        void addPattern(const String & pattern)
+        {
+            uint32 node = 0;
+            for (int i = 0; i < pattern.getLength(); i++)
+            {
+                const uint8 byte = (uint8)pattern[i];
+                uint32 child = findChild(node, byte);
+                if (!child)
+                {
+                    child = (uint32)nodes.getSize();
+                    nodes.Append(Node());
+                    edges.Append(Edge(byte, child, nodes[node].firstEdge));
+                    nodes.getElementAtUncheckedPosition(node).firstEdge = (uint32)edges.getSize();
+                }
+                node = child;
+            }
+            nodes.getElementAtUncheckedPosition(node).terminal = true;
+        }
+        /** Compute the failure links, breadth first */
+        void compile()
+        {
+            IndexArray queue;
+            for (uint32 e = nodes[0].firstEdge; e; e = edges[e - 1].next) queue.Append(edges[e - 1].child);
+            for (size_t head = 0; head < queue.getSize(); head++)
+            {
+                const uint32 parent = queue[head];
+                for (uint32 e = nodes[parent].firstEdge; e; e = edges[e - 1].next)
+                {
+                    const uint32 child = edges[e - 1].child; const uint8 byte = edges[e - 1].byte;
+                    queue.Append(child);
+                    uint32 fail = nodes[parent].fail;
+                    while (fail && !findChild(fail, byte)) fail = nodes[fail].fail;
+                    fail = findChild(fail, byte);
+                    Node & node = nodes.getElementAtUncheckedPosition(child);
+                    node.fail = fail;
+                    node.terminal |= nodes[fail].terminal;
+                }
+            }
+        }
+        /** Check if any pattern is found in the given text */
+        bool matches(const String & text) const
+        {
+            if (!hasPatterns()) return false;
+            uint32 node = 0;
+            for (int i = 0; i < text.getLength(); i++)
+            {
+                const uint8 byte = (uint8)text[i];
+                uint32 child = findChild(node, byte);
+                while (!child && node) { node = nodes[node].fail; child = findChild(node, byte); }
+                node = child;
+                if (nodes[node].terminal) return true;
+            }
+            return false;
+        }
+
+        LiteralMatcher() { nodes.Append(Node()); }
+    };
+
     /** Match the excluded files */
     class MatchExcludedFiles
     {
-        struct MatchAFile { virtual bool isExcluded(const String & relPath) const { return false; } virtual String getRule() const { return ""; } virtual ~MatchAFile() {} };
-        struct MatchSimpleRule : public MatchAFile { String rule; String getRule() const { return rule; } bool isExcluded(const String & relPath) const { return relPath.Find(rule) != -1; } MatchSimpleRule(const String & rule) : rule(rule) {} };
-        struct MatchRegEx : public MatchAFile { String regEx; bool inv; mutable void * capts; int capCount; String getRule() const { return "Regexp: " + regEx; } bool isExcluded(const String & relPath) const { int capCount = 0; bool a = relPath.regExFit(regEx, true, &capts, &capCount); return inv ? !a:a; }
-                                                MatchRegEx(const String & regEx, const bool inv = false) : regEx(regEx), capts(0), capCount(0), inv(inv) {} ~MatchRegEx() { free(capts); capCount = 0; } };
+        struct MatchAFile { virtual bool isExcluded(const String & relPath) const { return false; } virtual bool canMatchBelow(const String & dirPath) const { return true; } virtual ~MatchAFile() {} };
+        struct MatchRegEx : public MatchAFile
+        {
+            String regEx; bool inv; mutable void * capts; mutable int capCount;
+            bool isExcluded(const String & relPath) const
+            {
+                bool a = relPath.regExFit(regEx, true, &capts, &capCount);
+                if (!capCount) { free(capts); capts = 0; } // Without capture, the buffer is allocated each time
+                return inv ? !a:a;
+            }
+            /** Check if this rule could match any path below the given directory.
+                Only a rule anchored at the beginning can be proven not to match, by comparing its literal prefix with the directory path */
+            bool canMatchBelow(const String & dirPath) const
+            {
+                if (inv || !regEx || regEx[0] != '^') return true;
+                static const char metaChars[] = ".^$()[]*+?\\";
+                int len = 1;
+                while (len < regEx.getLength() && !strchr(metaChars, regEx[len])) len++;
+                // A quantifier makes the previous character optional
+                if (len < regEx.getLength() && strchr("*?", regEx[len])) len--;
+                const String prefix = regEx.midString(1, len - 1), below = dirPath + PathSeparator;
+                const int common = min(prefix.getLength(), below.getLength());
+                return memcmp((const char*)prefix, (const char*)below, common) == 0;
+            }
+            MatchRegEx(const String & regEx, const bool inv = false) : regEx(regEx), inv(inv), capts(0), capCount(0) {} ~MatchRegEx() { free(capts); capCount = 0; }
+        };
 
         typedef Container::NotConstructible<MatchAFile>::IndexList MatchArray;
+        /** The regular expression rules */
         MatchArray excMatches, incMatches;
+        /** The simple rules are compiled in a single automaton */
+        LiteralMatcher excLiterals, incLiterals;
+        /** The rules, for display */
+        Strings::StringArray excRules, incRules;
 
-        void buildMatchList(const String & filePath, MatchArray & matches)
+        void buildMatchList(const String & filePath, MatchArray & matches, LiteralMatcher & literals, Strings::StringArray & display)
         {
             // Get a list of rules in this file
             Strings::StringArray rules(File::Info(filePath, true).getContent());
@@ -1525,79 +3208,349 @@ namespace Frost
                 const String & rule = rules.getElementAtUncheckedPosition(i);
                 if (!rule.Trimmed()) continue; // Empty lines are ignored
 
-                if (rule.midString(0, 2) == "r/")
-                    matches.Append(new MatchRegEx(rule.midString(2, rule.getLength())));
-                else if (rule.midString(0, 2) == "R/")
-                    matches.Append(new MatchRegEx(rule.midString(2, rule.getLength()), true));
-                else matches.Append(new MatchSimpleRule(rule));
+                if (rule.midString(0, 2) == "r/" || rule.midString(0, 2) == "R/")
+                {
+                    matches.Append(new MatchRegEx(rule.midString(2, rule.getLength()), rule[0] == 'R'));
+                    display.Append("Regexp: " + rule.midString(2, rule.getLength()));
+                }
+                else
+                {
+                    literals.addPattern(rule);
+                    display.Append(rule);
+                }
             }
+            literals.compile();
+        }
+        static bool matchAny(const MatchArray & matches, const String & relPath)
+        {
+            for (size_t i = 0; i < matches.getSize(); i++)
+                if (matches.getElementAtUncheckedPosition(i)->isExcluded(relPath)) return true;
+            return false;
         }
     public:
         /** Get the rules used (this is used when verbose) */
         String getRules() const
         {
-            String ret = "Excluded:\n";
-            for (size_t i = 0; i < excMatches.getSize(); i++)
-                ret += excMatches[i].getRule() + "\n";
-            ret += "Included after exclusion:\n";
-            for (size_t i = 0; i < incMatches.getSize(); i++)
-                ret += incMatches[i].getRule() + "\n";
-            return ret;
+            return "Excluded:\n" + excRules.Join("\n") + (excRules.getSize() ? "\n" : "") + "Included after exclusion:\n" + incRules.Join("\n") + (incRules.getSize() ? "\n" : "");
         }
         /** Complete isExcluded function that applies the complete logic of exclusion and then inclusion */
         bool isExcluded(const String & relPath, bool * isExcluded = 0) const
         {
             CondScopeProfiler;
-            for (size_t i = 0; i < excMatches.getSize(); i++)
-                if (excMatches.getElementAtUncheckedPosition(i)->isExcluded(relPath))
-                {
-                    if (isExcluded) *isExcluded = true;
-                    for (size_t j = 0; j < incMatches.getSize(); j++)
-                        if (incMatches.getElementAtUncheckedPosition(j)->isExcluded(relPath))
-                            return false;
-                    return true;
-                }
-            return false;
+            if (!excLiterals.matches(relPath) && !matchAny(excMatches, relPath)) return false;
+            if (isExcluded) *isExcluded = true;
+            return !incLiterals.matches(relPath) && !matchAny(incMatches, relPath);
+        }
+        /** Check if the content of an excluded directory can be skipped entirely, that is, if no inclusion rule could match anything below it.
+            A simple inclusion rule can match anywhere in a path, so it prevents pruning */
+        bool canPrune(const String & dirPath) const
+        {
+            if (incLiterals.hasPatterns()) return false;
+            for (size_t i = 0; i < incMatches.getSize(); i++)
+                if (incMatches.getElementAtUncheckedPosition(i)->canMatchBelow(dirPath)) return false;
+            return true;
         }
 
+        /** Check if there is any exclusion rule */
+        bool hasRules() const { return excLiterals.hasPatterns() || excMatches.getSize(); }
+
         MatchExcludedFiles()
         {
             if (!Helpers::excludedFilePath) return;
-            buildMatchList(Helpers::excludedFilePath, excMatches);
-            if (Helpers::includedFilePath) buildMatchList(Helpers::includedFilePath, incMatches);
+            buildMatchList(Helpers::excludedFilePath, excMatches, excLiterals, excRules);
+            if (Helpers::includedFilePath) buildMatchList(Helpers::includedFilePath, incMatches, incLiterals, incRules);
         }
     };
 
-    /** The file filter that's accepting all files and backuping them */
-    struct BackupFile : public File::Scanner::EventIterator::FileFoundCB
+    /** An event based iterator, like File::Scanner::EventIterator, except that the callback can prevent descending in a directory */
+    class PruningEventIterator : public File::Scanner::EntryIterator
     {
-        ProgressCallback & callback;
-        const String & backupTo;
-        const String folderToBackup;
-        const unsigned int revID;
-        uint32 seen;
-        uint32 total;
-
-        uint32 fileCount;
-        uint32 dirCount;
-        uint64 totalInSize;
-        uint64 totalOutSize;
+    public:
+        /** The callback to implement */
+        struct FileFoundCB : public File::Scanner::EventIterator::FileFoundCB
+        {
+            /** Called after fileFound for a directory.
+                @return true if the directory's content must not be scanned */
+            virtual bool isPruned(const String & strippedDirPath) const = 0;
+        };
+    private:
+        /** Set to true when the iteration is finished */
+        bool finished;
+        /** The callback to call */
+        FileFoundCB & callback;
+    public:
+        virtual bool getNextFile(File::DirectoryIterator & dir, File::Info & file, const String & name)
+        {
+            if (finished) return false;
+            while (dir.getNextFilePath(file))
+            {
+                if (file.name == "." || file.name == "..") continue;
+                const String strippedPath = name + file.name;
+                if (!callback.fileFound(file, strippedPath)) { finished = true; return false; }
+                // Let the scanner feed the directory in the stack of directory to scan
+                if (recursive && file.isDir() && !file.isLink() && !callback.isPruned(strippedPath)) return true;
+            }
+            return false;
+        }
+        PruningEventIterator(const bool recursive, FileFoundCB & callback) : File::Scanner::EntryIterator(recursive), finished(false), callback(callback) {}
+    };
 
-        File::TTTDChunker chunker;
-        File::MultiChunk  compMultiChunk, encMultiChunk;
-        uint64            compMultiChunkListID, encMultiChunkListID;
-        uint64            compPreviousMCID, encPreviousMCID;
-        uint64            compMCID, encMCID;
+    /** The change journal is written by the watcher (see watchFolder) and consumed by the next backup, so it does not need to scan the unchanged entries.
+        Each record is a line made of a type letter, a space and a path relative to the backup folder (the root folder is an empty path):
+          'S' The watcher (re)started, so any change before this point is unknown
+          'R' The watcher is ready, every change from this point is recorded
+          'O' Some events were lost (queue overflow, too many directories to watch, journal too large)
+          'C' The entry at path was changed (content or metadata), created or moved in
+          'L' The entries list in the directory at path changed (entry added, removed or renamed)
+          'T' The complete subtree at path must be scanned (directory created or moved in)
+        While running, the watcher holds a lock on the journal's lock file that also contains the watched folder's path */
+    namespace ChangeJournal
+    {
+        /** The flags for a path */
+        enum Flags { Changed = 1, ListingChanged = 2, Subtree = 4, ChangedBelow = 8 };
+        /** The changed paths with their flags */
+        typedef Container::HashTable<uint32, String, Container::HashKey<String> > PathFlagsT;
+
+        /** The maximum journal size. Past this, a full scan is cheaper than replaying the records, so they are not recorded anymore */
+        static const off_t maxJournalSize = 16 * 1024 * 1024;
+
+        /** Get the lock file path */
+        static inline String getLockPath(const String & journalPath) { return journalPath + ".lock"; }
+        /** Get the path to the records that were taken by a backup that did not finish yet */
+        static inline String getPendingPath(const String & journalPath) { return journalPath + ".pending"; }
+
+        /** Get the flags for the given path */
+        static inline uint32 getFlags(const PathFlagsT & paths, const String & path) { const uint32 * flags = paths.getValue(path); return flags ? *flags : 0; }
+        /** Check if the given directory, or any of its parent, must be scanned completely */
+        static bool isInSubtree(const PathFlagsT & paths, const String & dirPath)
+        {
+            for (String path = dirPath; ; path = path.upToLast("/"))
+            {
+                if (getFlags(paths, path) & Subtree) return true;
+                if (!path) return false;
+            }
+        }
+        /** Add the flag to the given path, and mark all its parents so they are visited */
+        static void markPath(PathFlagsT & paths, const String & path, const uint32 flag)
+        {
+            uint32 * flags = paths.getValue(path);
+            if (flags) *flags |= flag; else paths.storeValue(path, new uint32(flag));
+            for (String parent = path; parent; )
+            {
+                parent = parent.upToLast("/");
+                flags = paths.getValue(parent);
+                if (flags && (*flags & ChangedBelow)) break; // Already done
+                if (flags) *flags |= ChangedBelow; else paths.storeValue(parent, new uint32(ChangedBelow));
+            }
+        }
+
+#ifdef _POSIX
+        /** Read the whole content of the given file descriptor */
+        static String readAll(int fd)
+        {
+            String content; char buffer[4096];
+            ssize_t len = 0;
+            while ((len = ::read(fd, buffer, sizeof(buffer))) > 0) content += String(buffer, (int)len);
+            return content;
+        }
+        /** Append some records to the journal.
+            If the journal would grow over maxJournalSize, a single overflow record is written instead, and the next records are dropped
+            until the journal is consumed (the next backup has to scan the folder anyway) */
+        static bool appendRecords(const String & path, const String & records)
+        {
+            if (!records) return true;
+            int fd = ::open(path, O_RDWR | O_APPEND | O_CREAT, 0600);
+            if (fd < 0) return false;
+            struct stat status;
+            if (flock(fd, LOCK_EX) != 0 || fstat(fd, &status) != 0) { ::close(fd); return false; }
+            String toWrite = records;
+            if (status.st_size + (off_t)records.getLength() > maxJournalSize)
+            {
+                char last[3] = { 0 };
+                bool overflowed = status.st_size >= 3 && pread(fd, last, sizeof(last), status.st_size - 3) == 3 && !memcmp(last, "O \n", 3);
+                toWrite = overflowed ? "" : "O \n";
+            }
+            bool done = !toWrite || ::write(fd, (const char*)toWrite, toWrite.getLength()) == (ssize_t)toWrite.getLength();
+            ::close(fd); // This also releases the lock
+            return done;
+        }
+#endif
+
+        /** Take the records from the journal, the watcher starts a new journal from this point.
+            The records are first moved to the pending file, and only removed when the backup succeeded (see commit).
+            @param journalPath  The journal path
+            @param folder       The folder to backup
+            @param paths        On output, filled with the changed paths if the journal is valid
+            @return true if the journal can be used instead of scanning the folder */
+        bool consume(const String & journalPath, const String & folder, PathFlagsT & paths)
+        {
+#ifndef _POSIX
+            return false;
+#else
+            // Check if a watcher is running for this folder
+            bool watched = false;
+            int lockFd = ::open(getLockPath(journalPath), O_RDONLY);
+            if (lockFd >= 0)
+            {
+                watched = flock(lockFd, LOCK_SH | LOCK_NB) != 0 && readAll(lockFd) == File::Info(folder, true).getRealFullPath();
+                ::close(lockFd);
+            }
+
+            int fd = ::open(journalPath, O_RDWR);
+            if (fd >= 0)
+            {
+                if (flock(fd, LOCK_EX) != 0) { ::close(fd); return false; }
+                String records = readAll(fd);
+                if (records && !appendRecords(getPendingPath(journalPath), records)) { ::close(fd); return false; }
+                if (ftruncate(fd, 0) != 0) { ::close(fd); return false; }
+                // If the watcher is not ready yet, some changes could be missed after the next backup is done, so it'll need a scan too
+                records = "\n" + records;
+                int started = records.reverseFind("\nS ", records.getLength()), ready = records.reverseFind("\nR ", records.getLength());
+                if (started != -1 && (ready == -1 || ready < started)) ::write(fd, "S \n", 3);
+                ::close(fd);
+            }
+            if (!watched) return false;
+
+            Strings::StringArray records(File::Info(getPendingPath(journalPath)).getContent(), "\n");
+            for (size_t i = 0; i < records.getSize(); i++)
+            {
+                const String & record = records[i];
+                if (record.getLength() < 2) continue;
+                const String path = record.midString(2, record.getLength());
+                switch (record[0])
+                {
+                case 'S': case 'O': paths.clearTable(); return false;
+                case 'C': markPath(paths, path, Changed); break;
+                case 'L': markPath(paths, path, ListingChanged); break;
+                case 'T': markPath(paths, path, Subtree); break;
+                default: break;
+                }
+            }
+            return true;
+#endif
+        }
+        /** The backup succeeded, so the pending records are not required anymore */
+        void commit(const String & journalPath)
+        {
+            File::Info(getPendingPath(journalPath)).remove();
+        }
+    }
+
+    /** A data extent in a file (that is, not a hole) */
+    struct DataExtent
+    {
+        /** The extent start offset in the file */
+        uint64 start;
+        /** The extent end offset in the file (excluded) */
+        uint64 stop;
+
+        DataExtent(const uint64 start = 0, const uint64 stop = (uint64)-1) : start(start), stop(stop) {}
+    };
+    /** The data extent array */
+    typedef Container::PlainOldData<DataExtent>::Array DataExtentArray;
+
+    /** Find out the data extents of a sparse file, so its holes are never read.
+        @param path     The file path
+        @param extents  On output, contains the data extents of the file (in order), the last one is an empty extent at the end of file
+        @return false if the file is not sparse (or if the system can't tell), extents are then not filled */
+    bool getDataExtents(const String & path, DataExtentArray & extents)
+    {
+#if defined(_POSIX) && defined(SEEK_DATA)
+        int fd = ::open(path, O_RDONLY);
+        if (fd < 0) return false;
+        struct stat status;
+        // A file with as many allocated blocks as its size has no hole
+        if (fstat(fd, &status) != 0 || (uint64)status.st_blocks * 512 >= (uint64)status.st_size) { ::close(fd); return false; }
+
+        off_t pos = 0;
+        while (pos < status.st_size)
+        {
+            off_t data = lseek(fd, pos, SEEK_DATA);
+            if (data < 0)
+            {
+                if (errno == ENXIO) break; // Only a hole up to the end of file
+                ::close(fd); extents.Clear(); return false; // Not supported here
+            }
+            off_t hole = lseek(fd, data, SEEK_HOLE);
+            if (hole < 0) hole = status.st_size;
+            extents.Append(DataExtent((uint64)data, (uint64)hole));
+            pos = hole;
+        }
+        // Add an empty extent at the end of file, so a trailing hole is accounted for too
+        extents.Append(DataExtent((uint64)status.st_size, (uint64)status.st_size));
+        ::close(fd);
+        return true;
+#else
+        return false;
+#endif
+    }
+
+    /** An input stream limited to a data extent of a file. Positions are kept absolute in the file */
+    class ExtentInputStream : public ::Stream::ForwardInputStream
+    {
+        /** The extent end position (excluded) */
+        uint64 stop;
+
+    public:
+        virtual uint64 read(void * const buffer, const uint64 size) const throw() { const uint64 pos = ref.currentPosition(); return pos >= stop ? 0 : ref.read(buffer, min(stop - pos, size)); }
+        virtual bool goForward(const uint64 skipAmount) { return ref.currentPosition() + skipAmount <= stop && ref.goForward(skipAmount); }
+        virtual bool endReached() const { return ref.currentPosition() >= stop || ref.endReached(); }
+        virtual bool setPosition(const uint64 newPos) { return newPos <= stop && ref.setPosition(newPos); }
+        /** Select the extent to read from */
+        bool setExtent(const DataExtent & extent) { stop = extent.stop; return ref.setPosition(extent.start); }
+
+        ExtentInputStream(::Stream::InputStream & ref) : ::Stream::ForwardInputStream(ref), stop((uint64)-1) {}
+    };
+
+    /** Check if the given buffer only contains zeros */
+    static inline bool isZeroFilled(const uint8 * data, const size_t size) { return size && data[0] == 0 && memcmp(data, data + 1, size - 1) == 0; }
+
+    /** The file filter that's accepting all files and backuping them */
+    struct BackupFile : public PruningEventIterator::FileFoundCB
+    {
+        ProgressCallback & callback;
+        const String & backupTo;
+        const String folderToBackup;
+        const unsigned int revID;
+        uint32 seen;
+        uint32 total;
+
+        uint32 fileCount;
+        uint32 dirCount;
+        uint64 totalInSize;
+        uint64 totalOutSize;
+
+        File::TTTDChunker chunker;
+        File::MultiChunk  compMultiChunk, encMultiChunk;
+        uint64            compMultiChunkListID, encMultiChunkListID;
+        uint64            compPreviousMCID, encPreviousMCID;
+        uint64            compMCID, encMCID;
+        /** The files of the reopened multichunks (removed once the index is saved), and their size when reopened */
+        String            compReopenedFile, encReopenedFile;
+        size_t            compReopenedSize, encReopenedSize;
 
         String               prevParentFolder;
         MatchExcludedFiles   excludes;
+        String               prunedDir;
 
         PathIDMapT           prevFilesInDir;
+        HardLinkMapT         hardLinks;
+        /** When replaying the previous revision, its children index (children of item i are in prevChildren[prevChildStart[i] .. prevChildStart[i+1]]) */
+        IndexArray           prevChildStart, prevChildren;
+        /** When replaying the previous revision, the directories' index in the previous and the current file tree */
+        ItemIDMapT           prevDirs, newDirs;
+        /** When replaying the previous revision, the hard linked files and the directories containing any of them */
+        Utils::ScopePtr<FileFormat::UIDBitmap> prevLinked;
         uint32               prevParentID;
         Utils::OwnPtr<FileFormat::FileTree> fileTree, prevFileTree;
         Utils::MemoryBlock   metadataTmp;
         Utils::ScopePtr<FileFormat::Multichunk> compMultichunk, encMultichunk;
         Utils::ScopePtr<FileFormat::ChunkList> compMultichunkList, encMultichunkList;
+        /** When resuming, the file tree saved in the checkpoint and the completely stored items in it (from their path to their index) */
+        Utils::ScopePtr<FileFormat::FileTree> resumedTree;
+        ItemIDMapT           resumedItems;
+        time_t               lastCheckpoint;
+        bool                 replaying;
         bool                 worthSaving;
 
         // Check if a file has content to save
@@ -1606,10 +3559,154 @@ namespace Frost
             return info.isFile() && !info.isDir() && !info.isLink();
         }
 
+        // Check if the directory that was just found is excluded with all its content
+        virtual bool isPruned(const String & strippedDirPath) const { return prunedDir && strippedDirPath == prunedDir; }
+
+        // Select the directory the given entry is in. When it changes, the entries remaining in the previous directory's list were deleted
+        bool selectParent(const String & strippedFilePath, const String & name)
+        {
+            String parentFolder = strippedFilePath.upToLast("/");
+            if (parentFolder == prevParentFolder) return true;
+
+            const uint32 * dirID = newDirs.getValue(parentFolder);
+            uint32 parentID = dirID ? *dirID : fileTree->findItem(parentFolder);
+            if (parentID == fileTree->notFound())
+            {
+                WARN_CB(ProgressCallback::Backup, name, TRANS("File found in subdir before dir was seen: ") + strippedFilePath);
+                return false;
+            }
+
+            // Check if we have remaining entries in the file list (in that case, this means they were deleted)
+            if (prevFilesInDir.getSize()) worthSaving = true;
+
+            prevParentID = parentID;
+            prevParentFolder = parentFolder;
+
+            String relativeParentPath = File::General::normalizePath(strippedFilePath + "/../").normalizedPath(Platform::Separator, false);
+            createFileListInDir(relativeParentPath, prevFilesInDir, prevFileTree);
+            return true;
+        }
+
+        /** Index the previous revision's file tree so its entries can be replayed (see replayItem).
+            @return false if there is no previous revision */
+        bool prepareReplay()
+        {
+            if (!prevFileTree) return false;
+            const uint32 count = prevFileTree->notFound();
+            // Count the children of each item, and then place them
+            prevChildStart.Clear(); prevChildren.Clear();
+            for (uint32 i = 0; i <= count; i++) prevChildStart.Append(0);
+            for (uint32 i = 0; i < count; i++)
+            {
+                const uint32 parentID = prevFileTree->getItem(i)->getParentID();
+                if (parentID && parentID <= count) prevChildStart.getElementAtUncheckedPosition(parentID)++;
+                prevChildren.Append(0);
+            }
+            for (uint32 i = 1; i <= count; i++) prevChildStart.getElementAtUncheckedPosition(i) += prevChildStart[i - 1];
+            IndexArray next(prevChildStart);
+            for (uint32 i = 0; i < count; i++)
+            {
+                const uint32 parentID = prevFileTree->getItem(i)->getParentID();
+                if (parentID && parentID <= count) prevChildren.getElementAtUncheckedPosition(next.getElementAtUncheckedPosition(parentID - 1)++) = i;
+            }
+            // Then remember where the directories are
+            prevDirs.clearTable();
+            for (uint32 i = 0; i < count; i++)
+                if (prevChildStart[i + 1] != prevChildStart[i]) prevDirs.storeValue(prevFileTree->getItemFullPath(i), new uint32(i), true);
+            // The journal only records the path that was written for a hard linked file, so its other links can't be replayed
+            prevLinked = new FileFormat::UIDBitmap(count);
+            for (uint32 i = 0; i < count; i++)
+            {
+                if (!getHardLinkKey(prevFileTree->getItem(i)->getMetaData())) continue;
+                for (uint32 item = i + 1; item && item <= count && prevLinked->set(item - 1); item = prevFileTree->getItem(item - 1)->getParentID()) {}
+            }
+            replaying = true;
+            return true;
+        }
+
+        /** Check if the given entry of the previous revision is a hard linked file or a directory containing any.
+            Such an entry must be checked on the file system, even if the journal did not record a change for its path */
+        bool hasHardLinks(const uint32 prevIndex) const { return prevLinked && prevLinked->isSet(prevIndex); }
+
+        /** Copy an unchanged entry, and everything below it, from the previous revision without accessing the file system */
+        bool replayItem(const uint32 prevIndex, const String & strippedFilePath)
+        {
+            if (Frost::exitRequired) return false;
+            CondScopeProfiler;
+            const String name = prevFileTree->getItem(prevIndex)->getBaseName();
+            if (!selectParent(strippedFilePath, name)) return false;
+            prevFilesInDir.removeValue(strippedFilePath);
+
+            // Copy breadth first, so a parent is always appended before its children
+            IndexArray pending, parents;
+            Strings::StringArray paths;
+            const bool checkExclusion = excludes.hasRules();
+            pending.Append(prevIndex); parents.Append(prevParentID + 1);
+            if (checkExclusion) paths.Append(strippedFilePath);
+            for (size_t i = 0; i < pending.getSize(); i++)
+            {
+                // The exclusion rules could have changed since the previous revision
+                if (checkExclusion && excludes.isExcluded(paths[i])) continue;
+
+                const uint32 index = pending[i];
+                const FileFormat::FileTree::Item * item = prevFileTree->getItem(index);
+                fileTree->appendItem(&FileFormat::FileTree::Item::createNew(false).setMetaData(item->metaData, item->fixed->metadataSize)
+                                                                                    .setBaseName(item->getBaseName())
+                                                                                    .setChunkListID(item->getChunkListID())
+                                                                                    .setParentID(parents[i]));
+                seen++;
+                const uint32 newID = fileTree->notFound(); // That's the appended item index + 1
+                for (uint32 c = prevChildStart[index]; c < prevChildStart[index + 1]; c++)
+                {
+                    const uint32 child = prevChildren[c];
+                    pending.Append(child); parents.Append(newID);
+                    if (checkExclusion) paths.Append(paths[i] + PathSeparator + prevFileTree->getItem(child)->getBaseName());
+                    total++;
+                }
+            }
+            return callback.progressed(ProgressCallback::Backup, TRANS("Unchanged: ") + name, 0, 0, seen, total, ProgressCallback::KeepLine);
+        }
+
+        /** Save a checkpoint of the backup in progress, so it can be resumed if interrupted */
+        bool saveCheckpoint()
+        {
+            lastCheckpoint = time(NULL);
+            FileFormat::CheckpointHeader stats;
+            stats.backupSize = totalOutSize;
+            const String & error = Helpers::indexFile.saveCheckpoint(Helpers::checkpointPath, stats);
+            if (error) return WARN_CB(ProgressCallback::Backup, TRANS("Checkpoint"), error);
+            return callback.progressed(ProgressCallback::Backup, TRANS("Checkpoint saved"), 0, 0, seen, total, ProgressCallback::KeepLine);
+        }
+
+        /** Resume the backup from its last checkpoint. What was completely stored then is not read again if it was not modified since.
+            @return A empty string on success, or a translated error message on error */
+        String resume()
+        {
+            FileFormat::CheckpointHeader stats;
+            resumedTree = new FileFormat::FileTree(0, false);
+            const String & error = Helpers::indexFile.loadCheckpoint(Helpers::checkpointPath, *resumedTree, stats);
+            if (error) { resumedTree = 0; return error; }
+            for (uint32 i = 0; i < resumedTree->notFound(); i++)
+            {   // A file whose chunk list was not saved was not completely stored
+                const uint32 listID = resumedTree->getItem(i)->getChunkListID();
+                if (!listID || Helpers::indexFile.getChunkList(listID))
+                    resumedItems.storeValue(resumedTree->getItemFullPath(i), new uint32(i), true);
+            }
+            totalOutSize += stats.backupSize;
+            worthSaving = true;
+            return "";
+        }
+
         // Returns true if the file is different (else fills the previous chunklist ID if applicable)
         bool checkDifferentFile(File::Info & info, const String & strippedFilePath, const String & metadata, uint32 & prevChunkListID)
         {
             CondScopeProfiler;
+            const uint32 * resumedID = resumedTree ? resumedItems.getValue(strippedFilePath) : 0;
+            if (resumedID && info.hasSimilarMetadata(resumedTree->getItem(*resumedID)->getMetaData(), File::Info::AllButAccessTime, &metadata))
+            {   // Already stored before the backup was interrupted
+                prevChunkListID = resumedTree->getItem(*resumedID)->getChunkListID();
+                return false;
+            }
             if (!prevFileTree) return true;
             uint32 prevItemID = prevFileTree->findItem(strippedFilePath);
             if (prevItemID == prevFileTree->notFound()) return true;
@@ -1627,6 +3724,8 @@ namespace Frost
             if (Frost::exitRequired) return false; // Premature stopping
 
             CondScopeProfiler;
+            if (Helpers::checkpointPath && Helpers::checkpointInterval && time(NULL) >= lastCheckpoint + (time_t)Helpers::checkpointInterval && !saveCheckpoint())
+                return false;
             if (!fileTree) return WARN_CB(ProgressCallback::Backup, info.name, TRANS("Invalid File Tree found. Are you trying to backup using a bad revision ID ?"));
             // Compute stats first
             uint32 entriesCount = info.getEntriesCount();
@@ -1639,6 +3738,7 @@ namespace Frost
             bool isExcludedInitially = false;
             if (excludes.isExcluded(strippedFilePath, &isExcludedInitially))
             {   // This file is excluded
+                if (info.isDir() && excludes.canPrune(strippedFilePath)) prunedDir = strippedFilePath;
                 if (!callback.progressed(ProgressCallback::Backup, TRANS("Excluded: ") + info.name, 0, 0, seen, total, ProgressCallback::FlushLine))
                     return false;
                 return true;
@@ -1689,34 +3789,30 @@ namespace Frost
                 dirCount++;
                 return callback.progressed(ProgressCallback::Backup, info.name, 0, 0, seen, total, ProgressCallback::KeepLine);
             }
-            String parentFolder = info.getParentFolder();
-            if (parentFolder != prevParentFolder)
-            {
-                uint32 parentID = fileTree->findItem(strippedFilePath.upToLast("/"));
-                if (parentID == fileTree->notFound())
-                {
-                    WARN_CB(ProgressCallback::Backup, info.name, TRANS("File found in subdir before dir was seen: ") + strippedFilePath);
-                    return false;
-                }
-
-                // Check if we have remaining entries in the file list (in that case, this means they were deleted)
-                if (prevFilesInDir.getSize()) worthSaving = true;
-
-                prevParentID = parentID;
-                prevParentFolder = parentFolder;
-
-                String relativeParentPath = File::General::normalizePath(strippedFilePath + "/../").normalizedPath(Platform::Separator, false);
-                createFileListInDir(relativeParentPath, prevFilesInDir, prevFileTree);
-            }
+            if (!selectParent(strippedFilePath, info.name)) return false;
 
             // Remove this file from the the previous file list because we've seen it now
             prevFilesInDir.removeValue(strippedFilePath);
+            // Directories are looked up by path when replaying, remember where they are
+            if (replaying && info.isDir() && !info.isLink()) newDirs.storeValue(strippedFilePath, new uint32(fileTree->notFound()), true);
 
             // We'll need the parent directory ID to link with
 
             // Check if the entry already exists in the database
             uint32 prevChunkListID = 0;
-            if (!checkDifferentFile(info, strippedFilePath, metadata, prevChunkListID))
+            // Hard linked files share their content, so only the first link seen is read
+            const String linkKey = hasContent(info) ? getHardLinkKey(metadata) : "";
+            const uint32 * linkedChunkListID = linkKey ? hardLinks.getValue(linkKey) : 0;
+            if (linkedChunkListID)
+            {
+                FileFormat::_CondScopeProfiler profile("HardLink");
+                if (checkDifferentFile(info, strippedFilePath, metadata, prevChunkListID)) worthSaving = true;
+                fileTree->appendItem(&FileFormat::FileTree::Item::createNew(false).setMetaData(metadataTmp.getConstBuffer(), (uint16)metadataTmp.getSize())
+                                                                                    .setBaseName(info.name)
+                                                                                    .setChunkListID(*linkedChunkListID)
+                                                                                    .setParentID(prevParentID+1));
+            }
+            else if (!checkDifferentFile(info, strippedFilePath, metadata, prevChunkListID))
             {
                 FileFormat::_CondScopeProfiler profile("SameFile");
                 // The file already exists in the previous file tree, so we'll skip chunking and all other process, just copy the relevant informations
@@ -1724,6 +3820,9 @@ namespace Frost
                                                                                     .setBaseName(info.name)
                                                                                     .setChunkListID(prevChunkListID)
                                                                                     .setParentID(prevParentID+1));
+                if (linkKey) hardLinks.storeValue(linkKey, new uint32(prevChunkListID));
+                // A file stored before the backup was interrupted is still part of this backup's statistics
+                if (resumedTree && prevChunkListID && Helpers::indexFile.getChunkLists()->getValue(prevChunkListID)) { info.restatFile(); totalInSize += info.size; fileCount++; }
             }
             else
             {
@@ -1750,15 +3849,43 @@ namespace Frost
                     uint64 fullSize = stream.fullSize();
                     totalInSize += fullSize;
                     bool chunkCreation = true;
+
+                    // Sparse files are only read in their data extents, holes are stored as zero extents
+                    DataExtentArray extents;
+                    if (!getDataExtents(info.getFullPath(), extents)) extents.Append(DataExtent());
+                    size_t extentIndex = 0;
+                    bool extentStarted = false;
+                    ExtentInputStream extentStream(stream);
                     while (true)
                     {
+                        if (!extentStarted)
+                        {
+                            if (extentIndex == extents.getSize()) break;
+                            const DataExtent & extent = extents[extentIndex];
+                            if (streamOffset < extent.start) fileList->appendZeroExtent(extent.start - streamOffset);
+                            if (!extentStream.setExtent(extent)) break;
+                            streamOffset = extent.start;
+                            extentStarted = true;
+                        }
                         {   // We want to profile the time it takes to create chunks
                             AccScopeProfiler(3);
-                            if (!chunker.createChunk(stream, temporaryChunk)) break;
+                            if (!chunker.createChunk(extentStream, temporaryChunk))
+                            {   // Done with this extent, let's go to the next one
+                                extentIndex++;
+                                extentStarted = false;
+                                continue;
+                            }
                         }
                         if (!callback.progressed(ProgressCallback::Backup, info.name, streamOffset, fullSize, seen, total, ProgressCallback::KeepLine))
                             return false;
 
+                        if (isZeroFilled(temporaryChunk.data, temporaryChunk.size))
+                        {   // No need to store a chunk full of zero, it's restored as a hole
+                            fileList->appendZeroExtent(temporaryChunk.size);
+                            streamOffset = stream.currentPosition();
+                            continue;
+                        }
+
                         FileFormat::Chunk tmpChunk(temporaryChunk.checksum, temporaryChunk.size);
                         // Ok, got a chunk, let's first figure out if we need to store it in the database
                         uint32 chunkID = Helpers::indexFile.findChunk(tmpChunk);
@@ -1802,6 +3929,11 @@ namespace Frost
 
                             // Then add to the chunk list for multichunk
                             chunkID = Helpers::indexFile.allocateChunkID();
+                            if (FileFormat::ChunkList::isZeroExtent(chunkID))
+                            {
+                                WARN_CB(ProgressCallback::Backup, info.name, TRANS("The maximum number of chunks in this backup set is reached, can't process: ") + strippedFilePath);
+                                return false;
+                            }
                             mcl->appendChunk(chunkID, offsetInMC);
                             // And remember in which multichunk it is in too
                             tmpChunk.multichunkID = currentMCID; // This is safe because it returns the next multichunk's ID until it's closed & saved
@@ -1826,7 +3958,9 @@ namespace Frost
 
 
                     // Ok, done with synchronization, insert in index
-                    Helpers::indexFile.appendFileItem(item.Forget(), fileList.Forget());
+                    FileFormat::FileTree::Item * savedItem = item.Forget();
+                    Helpers::indexFile.appendFileItem(savedItem, fileList.Forget());
+                    if (linkKey) hardLinks.storeValue(linkKey, new uint32(savedItem->getChunkListID()));
                     fileCount++;
                 }
                 else
@@ -1849,11 +3983,46 @@ namespace Frost
             return callback.progressed(ProgressCallback::Backup, info.name, 0, 0, seen, total, ProgressCallback::FlushLine);
         }
 
+        /** Reopen the last multichunk of the previous revision with the given compression if it's less than half full.
+            Its chunks are decoded and the new chunks are appended to them, so frequent small backups don't create a tiny multichunk each time.
+            @return true if the multichunk was reopened */
+        bool reopenMultichunk(const bool compressed, File::MultiChunk & multiChunk, Helpers::ChunkListT multiChunkList, uint64 & previousMCID, uint64 & currentMCID, String & reopenedFile, size_t & reopenedSize)
+        {
+            // The last multichunk is the one with the largest UID (it might be recorded in any previous catalog if it was already reopened)
+            FileFormat::Multichunk last;
+            for (uint16 ID = Helpers::indexFile.lastMultichunkID(); ID > 0 && !last.UID; ID--)
+            {
+                const FileFormat::Multichunk * mc = Helpers::indexFile.getMultichunk(ID);
+                if (mc && (Helpers::indexFile.getFilterArgumentForMultichunk(ID).fromTo(":", ":") != "none") == compressed) last = *mc;
+            }
+            if (!last.UID) return false;
+
+            // Only reopen it if it's undersized (its last chunk's offset is a good enough estimate of its size) and was made with the same maximum size
+            const String filterMode = Helpers::indexFile.getFilterArgumentForMultichunk(last.UID);
+            const FileFormat::ChunkList * list = Helpers::indexFile.getChunkList(last.listID);
+            if (!list || !list->chunksID.getSize() || list->offsets.getSize() != list->chunksID.getSize()) return false;
+            if (list->offsets[list->offsets.getSize() - 1] >= File::MultiChunk::MaximumSize / 2 || (uint32)filterMode.upToFirst(":").parseInt(10) != File::MultiChunk::MaximumSize) return false;
+
+            Helpers::SilentProgressCallback silent;
+            const String fileName = backupTo + last.getFileName();
+            if (Helpers::readMultichunk(fileName, filterMode, multiChunk, silent) || multiChunk.chunkPos.getSize() != list->chunksID.getSize())
+            {
+                multiChunk.Reset();
+                return false;
+            }
+            multiChunkList = new FileFormat::ChunkList(0, true);
+            for (size_t i = 0; i < list->chunksID.getSize(); i++) multiChunkList->appendChunk(list->chunksID[i], multiChunk.chunkPos[i]);
+            previousMCID = currentMCID = last.UID;
+            reopenedFile = fileName;
+            reopenedSize = multiChunk.getSize();
+            return true;
+        }
+
         /** Accessible wrapper from outside to finish the multichunks */
         bool finishMultiChunks()
         {
-            if (!finishMultiChunk(compMultiChunk, compMultichunkList, compPreviousMCID, compMCID, Helpers::Default)) return false;
-            if (!finishMultiChunk(encMultiChunk, encMultichunkList, encPreviousMCID, encMCID, Helpers::None)) return false;
+            if (!finishMultiChunk(compMultiChunk, compMultichunkList, compPreviousMCID, compMCID, Helpers::Default, compReopenedFile, compReopenedSize)) return false;
+            if (!finishMultiChunk(encMultiChunk, encMultichunkList, encPreviousMCID, encMCID, Helpers::None, encReopenedFile, encReopenedSize)) return false;
 
             // Do we have any deleted file ?
             if (prevFilesInDir.getSize()) worthSaving = true;
@@ -1866,8 +4035,6 @@ namespace Frost
                 Helpers::indexFile.getMetaData().Append(String::Print("DirCount: %u", dirCount));
                 Helpers::indexFile.getMetaData().Append(String::Print("InitialSize: %lld", totalInSize));
                 Helpers::indexFile.getMetaData().Append(String::Print("BackupSize: %lld", totalOutSize));
-                // If we were appending to a multichunk, remove the previous multichunk
-                //!< @todo
 
                 // Then close the index too
                 String error = Helpers::indexFile.close();
@@ -1876,6 +4043,9 @@ namespace Frost
                     WARN_CB(ProgressCallback::Backup, TRANS("Error"), error);
                     return false;
                 }
+                // If we were appending to a multichunk, remove the previous multichunk now that the index refers to the new one
+                if (compReopenedFile) File::Info(compReopenedFile, true).remove();
+                if (encReopenedFile) File::Info(encReopenedFile, true).remove();
             }
             // If there was no noticeable changes, don't record this backup
             if (!worthSaving) Helpers::indexFile.backupWasEmpty();
@@ -1885,8 +4055,16 @@ namespace Frost
 
 
         /** Finish the current multichunk, as it's the end of the backup process */
-        bool finishMultiChunk(File::MultiChunk & multiChunk, Helpers::ChunkListT & multiChunkList, uint64 & previousMCID, uint64 & currentMCID, const Helpers::CompressorToUse comp)
+        bool finishMultiChunk(File::MultiChunk & multiChunk, Helpers::ChunkListT multiChunkList, uint64 & previousMCID, uint64 & currentMCID, const Helpers::CompressorToUse comp, String & reopenedFile, const size_t reopenedSize)
         {
+            // A reopened multichunk that did not get any new chunk is left as is
+            if (reopenedFile && previousMCID && multiChunk.getSize() == reopenedSize)
+            {
+                multiChunk.Reset();
+                multiChunkList = 0;
+                previousMCID = currentMCID = 0;
+                reopenedFile = "";
+            }
             // Check if we started a multichunk (need to close it in that case)
             if (multiChunk.getSize())
             {
@@ -1901,17 +4079,15 @@ namespace Frost
             : callback(callback), backupTo(backupTo),
               folderToBackup(rootFolder.normalizedPath(Platform::Separator, true)), revID(revID), seen(0), total(1),
               fileCount(0), dirCount(0), totalInSize(0), totalOutSize(0),
-              compMultiChunkListID(0), encMultiChunkListID(0), compPreviousMCID(0), encPreviousMCID(0), compMCID(0), encMCID(0), prevParentFolder("*")
-              , prevParentID(0), fileTree(Helpers::indexFile.getFileTree(revID)), prevFileTree(Helpers::indexFile.getFileTree(revID - 1)), worthSaving(false)
+              compMultiChunkListID(0), encMultiChunkListID(0), compPreviousMCID(0), encPreviousMCID(0), compMCID(0), encMCID(0), compReopenedSize(0), encReopenedSize(0), prevParentFolder("*")
+              , prevParentID(0), fileTree(Helpers::indexFile.getFileTree(revID)), prevFileTree(Helpers::indexFile.getFileTree(revID - 1)), lastCheckpoint(time(NULL)), replaying(false), worthSaving(false)
         {
-            /* TODO
             if (strategy == Slow)
             {
                 // Need to reopen last multichunks if it makes any sense
-                reopenMultichunk(Helpers::Default, compMultiChunk, compMultiChunkListID, compPreviousMCID);
-                reopenMultichunk(Helpers::None, encMultiChunk, encMultiChunkListID, encPreviousMCID);
+                reopenMultichunk(true, compMultiChunk, compMultichunkList, compPreviousMCID, compMCID, compReopenedFile, compReopenedSize);
+                reopenMultichunk(false, encMultiChunk, encMultichunkList, encPreviousMCID, encMCID, encReopenedFile, encReopenedSize);
             }
-            */
         }
     };
 
@@ -1926,7 +4102,285 @@ namespace Frost
         Helpers::MultiChunkCache cache;
 
         Utils::OwnPtr<FileFormat::FileTree> tree;
+        RestoredLinkMapT restoredLinks;
+        /** The restored contents (from the content key of a chunk list to the first restored file's path) */
+        RestoredLinkMapT restoredContents;
 
+#ifdef _POSIX
+        /** A chunk to write in a restored file */
+        struct PlannedChunk
+        {
+            /** The chunk in the index */
+            const FileFormat::Chunk * chunk;
+            /** The chunk's offset in the restored file */
+            uint64 fileOffset;
+            /** The likely offset of the chunk in its multichunk, or -1 if unknown */
+            size_t chunkOffset;
+            /** The restored file's index in the planned files */
+            uint32 file;
+
+            PlannedChunk(int = 0) : chunk(0), fileOffset(0), chunkOffset((size_t)-1), file(0) {}
+        };
+        /** Sort the planned chunks by multichunk, then by file and offset, so the writes of a multichunk are sequential */
+        struct PlannedChunkSorter
+        {
+            static int compareData(const PlannedChunk & a, const PlannedChunk & b)
+            {
+                if (a.chunk->multichunkID != b.chunk->multichunkID) return a.chunk->multichunkID < b.chunk->multichunkID ? -1 : 1;
+                if (a.file != b.file) return a.file < b.file ? -1 : 1;
+                return a.fileOffset < b.fileOffset ? -1 : (a.fileOffset == b.fileOffset ? 0 : 1);
+            }
+        };
+        typedef Container::PlainOldData<PlannedChunk>::Array PlannedChunks;
+        /** Sort the items by parent directory, so the metadata of a directory's files is restored relative to a single directory descriptor */
+        struct ParentSorter
+        {
+            const FileFormat::FileTree & tree;
+            int compareData(const uint32 & a, const uint32 & b) const
+            {
+                const uint32 parentA = tree.getItem(a)->getParentID(), parentB = tree.getItem(b)->getParentID();
+                if (parentA != parentB) return parentA < parentB ? -1 : 1;
+                return a < b ? -1 : (a == b ? 0 : 1);
+            }
+            ParentSorter(const FileFormat::FileTree & tree) : tree(tree) {}
+        };
+
+        /** The maximum number of consecutive chunks written in a single call */
+        enum { MaxWriteRun = 256 };
+
+        /** The worker thread decoding the planned multichunks */
+        struct PlanWorker : public Threading::Thread
+        {
+            RestoreFile & restore;
+            uint32 runThread() { restore.processPlan(); return 0; }
+
+            PlanWorker(RestoreFile & restore) : restore(restore) {}
+            ~PlanWorker() { destroyThread(); }
+        };
+        typedef Container::NotConstructible<PlanWorker>::IndexList PlanWorkers;
+
+        /** When set, the files content is planned instead of being written immediately.
+            When the plan is run, each multichunk is decoded only once, and its chunks are written at their offset in all the files using them */
+        bool            planning;
+        /** The maximum number of files to keep open while planning */
+        uint32          maxOpenFiles;
+        /** The memory budget for the decoded multichunks */
+        const size_t    maxCacheSize;
+        /** The planned chunks */
+        PlannedChunks   plannedChunks;
+        /** The planned files descriptors */
+        Container::PlainOldData<int>::Array plannedFiles;
+        /** The items whose metadata must be restored once their content is written */
+        IndexArray      pendingMetadata;
+        /** The amount of data to write */
+        uint64          plannedSize;
+        /** The amount of existing data that was kept since it matches the backup (in delta mode) */
+        uint64          reusedSize;
+        /** The files to clone once the plan is run, since their source content is only written then */
+        Strings::StringArray pendingCloneSources, pendingCloneTargets;
+
+        /** The first planned chunk of each multichunk to decode, the last entry is the number of planned chunks */
+        IndexArray      groupStart;
+        /** The path and filter arguments of each multichunk to decode */
+        Strings::StringArray groupPaths, groupFilters;
+        /** The lock protecting the workers' progress below */
+        Threading::FastLock planLock;
+        /** The next multichunk to decode */
+        uint32          nextGroup;
+        /** The number of multichunks decoded and written */
+        uint32          doneGroups;
+        /** The amount of data written */
+        uint64          doneSize;
+        /** The first error that happened in the workers */
+        String          planError;
+
+        /** Get the number of files we can open while planning */
+        static uint32 getMaxOpenFiles()
+        {
+            struct rlimit limit;
+            if (getrlimit(RLIMIT_NOFILE, &limit) != 0) return 32;
+            // Raise the soft limit as much as allowed
+            if (limit.rlim_cur != RLIM_INFINITY && limit.rlim_cur < limit.rlim_max)
+            {
+                const rlim_t previous = limit.rlim_cur;
+                limit.rlim_cur = limit.rlim_max == RLIM_INFINITY ? max(previous, (rlim_t)65536) : limit.rlim_max;
+                if (setrlimit(RLIMIT_NOFILE, &limit) != 0) limit.rlim_cur = previous;
+            }
+            // Keep half of the descriptors for the rest of the process
+            return (uint32)max((rlim_t)16, min(limit.rlim_cur, (rlim_t)65536) / 2);
+        }
+
+        /** Restore a regular file's POSIX metadata relative to its directory descriptor (the format is the one of File::Info::setMetaData).
+            Like File::Info::setMetaData, the file is not modified if its size is not the expected one
+            @return false if the metadata was not restored */
+        static bool setFileMetaDataAt(const int dirFd, const String & name, String metadata)
+        {
+            if (metadata.getLength() < 2 || metadata[0] != 'P' || metadata[1] == 'S' || metadata[1] == 'T') return false;
+            metadata.leftTrim("PSTHL");
+            metadata.splitUpTo("/"); metadata.splitUpTo("/"); // Skip the device and inode
+            const mode_t mode = (mode_t)metadata.splitUpTo("/").parseInt(16);
+            const off_t size = (off_t)metadata.splitUpTo("/").parseInt(16);
+            metadata.splitUpTo("/"); // Skip the link count
+            const uid_t uid = (uid_t)metadata.splitUpTo("/").parseInt(16);
+            const gid_t gid = (gid_t)metadata.splitUpTo("/").parseInt(16);
+            metadata.splitUpTo("/"); // Skip the change time
+            struct timespec times[2] = { { 0, 0 }, { 0, 0 } };
+            times[1].tv_sec = (time_t)metadata.splitUpTo("/").parseInt(16);
+            times[0].tv_sec = (time_t)metadata.splitUpTo("/").parseInt(16);
+
+            struct stat status;
+            if (fstatat(dirFd, name, &status, AT_SYMLINK_NOFOLLOW) != 0 || !S_ISREG(status.st_mode) || status.st_size != size) return false;
+            return fchownat(dirFd, name, uid, gid, AT_SYMLINK_NOFOLLOW) == 0 && fchmodat(dirFd, name, mode & 07777, 0) == 0
+                && utimensat(dirFd, name, times, AT_SYMLINK_NOFOLLOW) == 0;
+        }
+
+        /** Write all the given buffers at the given offset, continuing after a short write (the buffers are modified)
+            @return false on error */
+        static bool writeRun(const int fd, struct iovec * run, int runLength, off_t offset)
+        {
+            while (runLength)
+            {
+                const ssize_t written = pwritev(fd, run, runLength, offset);
+                if (written < 0 && errno == EINTR) continue;
+                if (written <= 0) return false;
+                offset += written;
+                // Skip the completely written buffers, and the written part of the next one
+                size_t left = (size_t)written;
+                while (runLength && left >= run->iov_len) { left -= run->iov_len; run++; runLength--; }
+                if (runLength) { run->iov_base = (uint8*)run->iov_base + left; run->iov_len -= left; }
+            }
+            return true;
+        }
+
+        /** Decode the planned multichunks until none is left, and write their chunks in the restored files.
+            This is run by each worker thread */
+        void processPlan()
+        {
+            Helpers::SilentProgressCallback silent;
+            while (true)
+            {
+                uint32 group = 0;
+                {
+                    Threading::ScopedLock scope(planLock);
+                    if (planError || exitRequired || nextGroup + 1 >= groupStart.getSize()) return;
+                    group = nextGroup++;
+                }
+
+                // Each worker decodes in its own multichunk, so the memory used is bounded by the number of workers
+                File::MultiChunk multichunk;
+                String error = Helpers::readMultichunk(groupPaths[group], groupFilters[group], multichunk, silent);
+                uint64 written = 0;
+                // The chunks are sorted by file and offset, so the consecutive chunks of a file are written in a single call
+                struct iovec run[MaxWriteRun];
+                int runLength = 0;
+                size_t runSize = 0;
+                for (uint32 i = groupStart[group]; !error && i < groupStart[group + 1]; i++)
+                {
+                    const PlannedChunk & planned = plannedChunks[i];
+                    File::Chunk * chunk = multichunk.findChunk(planned.chunk->checksum, planned.chunkOffset);
+                    if (!chunk) { error = TRANS("Missing chunk in multichunk: ") + groupPaths[group]; break; }
+                    run[runLength].iov_base = chunk->data;
+                    run[runLength].iov_len = chunk->size;
+                    runLength++; runSize += chunk->size;
+
+                    const PlannedChunk * next = i + 1 < groupStart[group + 1] ? &plannedChunks[i + 1] : 0;
+                    if (runLength < MaxWriteRun && next && next->file == planned.file && next->fileOffset == planned.fileOffset + chunk->size) continue;
+
+                    const off_t runOffset = (off_t)(planned.fileOffset + chunk->size - runSize);
+                    if (!writeRun(plannedFiles[planned.file], run, runLength, runOffset))
+                        error = TRANS("Can't write the file (disk full ?)");
+                    else written += runSize;
+                    runLength = 0; runSize = 0;
+                }
+
+                Threading::ScopedLock scope(planLock);
+                if (error)
+                {
+                    if (!planError) planError = error;
+                    return;
+                }
+                doneSize += written;
+                doneGroups++;
+            }
+        }
+#endif
+
+
+        /** Skip a zero extent in the output stream. If the stream is seekable, this leaves a hole, else zeros are written */
+        static bool skipZeroExtent(Stream::OutputStream & stream, const uint64 size)
+        {
+            const uint64 target = stream.currentPosition() + size;
+            // Seeking past the end of a file stream only extends it (with a hole), so seek again to actually move there
+            if (stream.setPosition(target) && (stream.currentPosition() == target || stream.setPosition(target))) return true;
+
+            static const uint8 zeros[4096] = { 0 };
+            for (uint64 remaining = size; remaining; )
+            {
+                const uint64 part = min(remaining, (uint64)sizeof(zeros));
+                if (stream.write(zeros, part) != part) return false;
+                remaining -= part;
+            }
+            return true;
+        }
+
+        /** Get the key identifying the content of a chunk list. Files with the same chunks sequence have the same content */
+        static String getContentKey(FileFormat::ChunkList & chunkList)
+        {
+            uint8 digest[Hashing::SHA1::DigestSize];
+            Crypto::OSSL_SHA1 hash;
+            hash.Start();
+            hash.Hash((const uint8*)&chunkList.chunksID.getElementAtUncheckedPosition(0), (uint32)(chunkList.chunksID.getSize() * sizeof(uint32)));
+            hash.Finalize(digest);
+            String ret; uint32 outSize = (uint32)(ArrSz(digest) * 2);
+            if (!Encoding::encodeBase16(digest, ArrSz(digest), (uint8*)ret.Alloc(ArrSz(digest)*2), outSize)) return "";
+            ret.releaseLock((int)outSize);
+            return ret;
+        }
+
+        /** Clone an already restored file's content to another file.
+            The data is shared with the source if the filesystem supports it (FICLONE), else copied in the kernel (copy_file_range), else copied */
+        static bool cloneFile(const String & source, const String & target)
+        {
+#ifdef _POSIX
+            int in = ::open((const char*)source, O_RDONLY);
+            if (in < 0) return false;
+            int out = ::open((const char*)target, O_WRONLY | O_CREAT | O_TRUNC, 0600);
+            struct stat info;
+            bool done = out >= 0 && fstat(in, &info) == 0;
+    #ifdef FICLONE
+            if (done && ioctl(out, FICLONE, in) == 0) { ::close(in); return ::close(out) == 0; }
+    #endif
+            const uint64 size = done ? (uint64)info.st_size : 0;
+            // The target has the final size so the zero blocks skipped below are left as holes
+            done = done && ftruncate(out, (off_t)size) == 0;
+            uint64 offset = 0;
+    #ifdef _LINUX
+            while (done && offset < size)
+            {
+                ssize_t copied = copy_file_range(in, NULL, out, NULL, (size_t)min(size - offset, (uint64)(1<<30)), 0);
+                if (copied <= 0) break; // Not supported here, so finish with a plain copy
+                offset += (uint64)copied;
+            }
+    #endif
+            uint8 data[65536];
+            while (done && offset < size)
+            {
+                const size_t len = (size_t)min(size - offset, (uint64)sizeof(data));
+                done = pread(in, data, len, (off_t)offset) == (ssize_t)len;
+                size_t i = 0;
+                while (done && i < len && !data[i]) i++;
+                if (done && i < len) done = pwrite(out, data, len, (off_t)offset) == (ssize_t)len;
+                offset += len;
+            }
+            ::close(in);
+            if (out >= 0 && ::close(out) != 0) done = false;
+            return done;
+#else
+            File::Info existing(target);
+            if (existing.doesExist() && !existing.remove()) return false;
+            return File::Info(source).copyTo(target);
+#endif
+        }
 
     public:
         /** Helper method that's extracting a file to the given stream */
@@ -1939,27 +4393,40 @@ namespace Frost
                 errorMessage = TRANS("Invalid chunklist for file: ") + filePath;
                 return 1;
             }
-            const FileFormat::Chunks & chunks = Helpers::indexFile.getTotalChunks();
+            Helpers::MultiChunkCache::Pin pin(cache);
+            // The chunks list is known beforehand, so decode the next multichunks in the background while writing
+            Helpers::MultiChunkPrefetcher prefetcher(cache);
+            for (size_t i = 0; Helpers::prefetchSize && i < chunkList->chunksID.getSize(); i++)
+            {
+                const uint32 chunkID = chunkList->chunksID.getElementAtUncheckedPosition(i);
+                const FileFormat::ChunkLocation * location = FileFormat::ChunkList::isZeroExtent(chunkID) ? 0 : Helpers::indexFile.getChunkLocation(chunkID);
+                const FileFormat::Multichunk * mchunk = location ? Helpers::indexFile.getMultichunk(location->multichunkID) : 0;
+                if (mchunk) prefetcher.append(mchunk->UID, backupFolder + mchunk->getFileName(), Helpers::indexFile.getFilterArguments().getArgument(mchunk->filterArgIndex));
+            }
+            prefetcher.start(Helpers::prefetchSize);
+
             for (size_t i = 0; i < chunkList->chunksID.getSize(); i++)
             {
                 const uint32 chunkID = chunkList->chunksID.getElementAtUncheckedPosition(i);
-                // Then search for this chunk in the consolidated chunks array
-                const FileFormat::Chunk * chunkIndex = Helpers::indexFile.findChunk(chunkID);
-                if (!chunkIndex)
+                if (FileFormat::ChunkList::isZeroExtent(chunkID))
+                {
+                    if (!skipZeroExtent(stream, FileFormat::ChunkList::getZeroExtentSize(chunkID)))
+                        ERR(TRANS("Can't write the file (disk full ?)"));
+                    continue;
+                }
+                // Then find where this chunk is stored
+                const FileFormat::ChunkLocation * location = Helpers::indexFile.getChunkLocation(chunkID);
+                if (!location)
                     ERR(TRANS("While processing this file, it's missing chunk index: ") + chunkID);
 
                 // Find the multichunk who's storing this chunk
-                const FileFormat::Multichunk * mchunk = Helpers::indexFile.getMultichunk(chunkIndex->multichunkID);
+                const FileFormat::Multichunk * mchunk = Helpers::indexFile.getMultichunk(location->multichunkID);
                 if (!mchunk)
-                    ERR(TRANS("Missing multichunk index for this file: ") + chunkIndex->multichunkID);
-
-                // We need the offset in the multichunk's chunklist so it's faster to restore
-                FileFormat::ChunkList * mcChunkList = Helpers::indexFile.getChunkList(mchunk->listID);
-                size_t chunkOffset = (size_t)-1;
-                if (mcChunkList) chunkOffset = mcChunkList->getChunkOffset(chunkID);
+                    ERR(TRANS("Missing multichunk index for this file: ") + location->multichunkID);
 
                 errorMessage = "";
-                File::Chunk * chunk = Helpers::extractChunkBin(errorMessage, backupFolder, mchunk->getFileName(), mchunk->UID, chunkOffset, chunkIndex->checksum, Helpers::indexFile.getFilterArguments().getArgument(mchunk->filterArgIndex), cache, callback);
+                prefetcher.use(mchunk->UID);
+                File::Chunk * chunk = Helpers::extractChunkBin(errorMessage, backupFolder, mchunk->getFileName(), mchunk->UID, location->getOffset(), Helpers::indexFile.getChunk(*location).checksum, Helpers::indexFile.getFilterArguments().getArgument(mchunk->filterArgIndex), pin, callback);
                 if (!chunk || errorMessage) return -1;
 
                 // Ok, if we got a chunk, let's save it
@@ -1974,6 +4441,119 @@ namespace Frost
             return 0; // Done
         }
 
+#ifdef _POSIX
+        /** Check if the existing file content at the given offset is the given chunk */
+        static bool isExistingChunk(const int fd, const uint64 offset, const FileFormat::Chunk & chunk)
+        {
+            uint8 data[65536], checksum[Hashing::SHA1::DigestSize];
+            if (pread(fd, data, chunk.size, (off_t)offset) != (ssize_t)chunk.size) return false;
+            Crypto::OSSL_SHA1 hash;
+            hash.Start(); hash.Hash(data, chunk.size); hash.Finalize(checksum);
+            return memcmp(checksum, chunk.checksum, ArrSz(checksum)) == 0;
+        }
+        /** Clear the existing file content in the given range (it's only written if not already zero) */
+        static bool clearExisting(const int fd, uint64 offset, uint64 size)
+        {
+            uint8 data[65536];
+            while (size)
+            {
+                const size_t len = (size_t)min(size, (uint64)sizeof(data));
+                if (pread(fd, data, len, (off_t)offset) != (ssize_t)len) return false;
+                size_t i = 0;
+                while (i < len && !data[i]) i++;
+                if (i < len)
+                {
+                    memset(data, 0, len);
+                    if (pwrite(fd, data, len, (off_t)offset) != (ssize_t)len) return false;
+                }
+                offset += len; size -= len;
+            }
+            return true;
+        }
+
+        /** Reserve the space for the given range of a file, so the planned writes, that are done out of order, don't fragment it.
+            This is only a hint, so errors are ignored */
+        static void preallocate(const int fd, const uint64 start, const uint64 end)
+        {
+#ifdef _LINUX
+            if (end > start) fallocate(fd, FALLOC_FL_KEEP_SIZE, (off_t)start, (off_t)(end - start));
+#endif
+        }
+
+        /** Plan the restoring of a file's content.
+            The file is created with its final size (so zero extents are left as holes), and its chunks are added to the plan
+            @return 0 on success, -1 on error, 1 on warning */
+        int planFile(String & errorMessage, uint64 chunkListID, const String & fullPath, const String & filePath, const uint64 fileSize)
+        {
+            FileFormat::ChunkList * chunkList = Helpers::indexFile.getChunkList((uint32)chunkListID);
+            if (!chunkList)
+            {
+                errorMessage = TRANS("Invalid chunklist for file: ") + filePath;
+                return 1;
+            }
+            // Don't exhaust the file descriptors, run the plan so far instead
+            if (plannedFiles.getSize() >= maxOpenFiles)
+            {
+                errorMessage = runPlan();
+                if (errorMessage) return -1;
+            }
+
+            // In delta mode, the existing content is kept, and only the chunks that differ are written
+            const bool delta = overwritePolicy == Delta;
+            int fd = ::open((const char*)fullPath, delta ? O_RDWR | O_CREAT : O_WRONLY | O_CREAT | O_TRUNC, 0600);
+            if (fd < 0) ERR(TRANS("Can not create file on the system: ") + filePath);
+            const uint32 file = (uint32)plannedFiles.getSize();
+            plannedFiles.Append(fd);
+            struct stat existing;
+            const uint64 existingSize = delta && fstat(fd, &existing) == 0 && S_ISREG(existing.st_mode) ? (uint64)existing.st_size : 0;
+            if (ftruncate(fd, (off_t)fileSize) != 0)
+                ERR(TRANS("Can't write the file (disk full ?)"));
+
+            uint64 offset = 0, runStart = 0;
+            for (size_t i = 0; i < chunkList->chunksID.getSize(); i++)
+            {
+                const uint32 chunkID = chunkList->chunksID.getElementAtUncheckedPosition(i);
+                if (FileFormat::ChunkList::isZeroExtent(chunkID))
+                {
+                    const uint64 size = FileFormat::ChunkList::getZeroExtentSize(chunkID);
+                    // Zero extents are left as holes, so only the data runs around them are allocated
+                    preallocate(fd, runStart, offset);
+                    runStart = offset + size;
+                    if (offset < existingSize && !clearExisting(fd, offset, min(size, existingSize - offset)))
+                        ERR(TRANS("Can't write the file (disk full ?)"));
+                    offset += size;
+                    continue;
+                }
+                const FileFormat::ChunkLocation * location = Helpers::indexFile.getChunkLocation(chunkID);
+                if (!location)
+                    ERR(TRANS("While processing this file, it's missing chunk index: ") + chunkID);
+
+                if (!Helpers::indexFile.getMultichunk(location->multichunkID))
+                    ERR(TRANS("Missing multichunk index for this file: ") + location->multichunkID);
+                if (offset + location->size <= existingSize && isExistingChunk(fd, offset, Helpers::indexFile.getChunk(*location)))
+                {   // Already there, no need to decode it
+                    preallocate(fd, runStart, offset);
+                    offset += location->size;
+                    runStart = offset;
+                    reusedSize += location->size;
+                    continue;
+                }
+
+                PlannedChunk planned;
+                planned.chunk = &Helpers::indexFile.getChunk(*location);
+                planned.fileOffset = offset;
+                planned.file = file;
+                planned.chunkOffset = location->getOffset();
+                plannedChunks.Append(planned);
+
+                offset += location->size;
+                plannedSize += location->size;
+            }
+            preallocate(fd, runStart, offset);
+            return 0;
+        }
+#endif
+
 
         /** File removed, let's apply the same on the file system */
         int removeFile(const String & filePath, String & errorMessage, const uint32 current, const uint32 total)
@@ -2032,20 +4612,79 @@ namespace Frost
             }
 
             // Ok, now check if it's a regular file that need its content to be restored
-            if (outFile.isFile())
+            const String linkKey = outFile.isFile() ? getHardLinkKey(item->getMetaData()) : "";
+            const String * firstLink = linkKey ? restoredLinks.getValue(linkKey) : 0;
+            if (firstLink)
+            {
+                // Another link to this file was already restored, so simply link to it
+                File::Info existing(outFile.getFullPath());
+                if (existing.doesExist() && !existing.remove())
+                    ERR(TRANS("Can not remove file on the system: ") + filePath);
+                if (!existing.createAsLinkTo(*firstLink, true))
+                    firstLink = 0; // Can't link (different device ?), so fallback to restoring the content
+                else if (!callback.progressed(ProgressCallback::Restore, folderTrimmed + filePath, outFile.size, outFile.size, current, total, ProgressCallback::FlushLine))
+                    ERR(TRANS("Interrupted in output"));
+            }
+            // Files with the same chunks are only restored once, the other ones are cloned from the first one
+            FileFormat::ChunkList * chunkList = outFile.isFile() && !firstLink ? Helpers::indexFile.getChunkList(item->getChunkListID()) : 0;
+            const String contentKey = chunkList && chunkList->chunksID.getSize() ? getContentKey(*chunkList) : "";
+            const String * firstCopy = contentKey ? restoredContents.getValue(contentKey) : 0;
+            if (firstCopy)
+            {
+#ifdef _POSIX
+                if (planning)
+                {
+                    pendingCloneSources.Append(*firstCopy);
+                    pendingCloneTargets.Append(outFile.getFullPath());
+                    // The clone is written in place when the plan is run, so create the file now for the other links to this file
+                    if (linkKey)
+                    {
+                        int fd = ::open((const char*)outFile.getFullPath(), O_WRONLY | O_CREAT | O_TRUNC, 0600);
+                        if (fd < 0 || ::close(fd) != 0) ERR(TRANS("Can not create file on the system: ") + filePath);
+                    }
+                } else
+#endif
+                if (!cloneFile(*firstCopy, outFile.getFullPath()))
+                    ERR(TRANS("Can't write the file (disk full ?)"));
+                if (!callback.progressed(ProgressCallback::Restore, folderTrimmed + filePath, outFile.size, outFile.size, current, total, ProgressCallback::FlushLine))
+                    ERR(TRANS("Interrupted in output"));
+                // This is the first link of its file, so the other links are linked to it
+                if (linkKey && !restoredLinks.getValue(linkKey)) restoredLinks.storeValue(linkKey, new String(outFile.getFullPath()));
+            }
+            else if (outFile.isFile() && !firstLink)
             {
                 // Seem so, let's restore it now.
-                ::Stream::OutputFileStream stream(outFile.getFullPath());
-                int ret = restoreSingleFile(stream, errorMessage, item->getChunkListID(), filePath, outFile.size, current, total);
-                if (ret == 1) return WarnAndReturn(errorMessage);
-                if (ret < 0) return ret;
+#ifdef _POSIX
+                if (planning)
+                {
+                    int ret = planFile(errorMessage, item->getChunkListID(), outFile.getFullPath(), filePath, outFile.size);
+                    if (ret == 1) return WarnAndReturn(errorMessage);
+                    if (ret < 0) return ret;
+                } else
+#endif
+                {
+                    ::Stream::OutputFileStream stream(outFile.getFullPath());
+                    int ret = restoreSingleFile(stream, errorMessage, item->getChunkListID(), filePath, outFile.size, current, total);
+                    if (ret == 1) return WarnAndReturn(errorMessage);
+                    if (ret < 0) return ret;
+                }
+                if (linkKey && !restoredLinks.getValue(linkKey)) restoredLinks.storeValue(linkKey, new String(outFile.getFullPath()));
+                if (contentKey) restoredContents.storeValue(contentKey, new String(outFile.getFullPath()));
             }
-            else
+            else if (!firstLink)
             {
                 if (!callback.progressed(ProgressCallback::Restore, outFile.getFullPath(), 0, 0, current, total, ProgressCallback::FlushLine))
                     ERR(TRANS("Interrupted in output"));
             }
 
+#ifdef _POSIX
+            // The content is only written when the plan is run, so the metadata must be restored afterward
+            if (planning && outFile.isFile())
+            {
+                pendingMetadata.Append(fileIndex);
+                return 0;
+            }
+#endif
             // Then restore the metadata here
             if (!outFile.setMetaData(item->getMetaData()))
             {
@@ -2057,16 +4696,223 @@ namespace Frost
             return 0;
         }
 
+#ifdef _POSIX
+        /** Plan the files content instead of writing it immediately, until runPlan is called */
+        void enablePlanning() { planning = true; }
+
+        /** Run the plan: decode each planned multichunk once in the worker threads, write its chunks in the files using it,
+            and then restore the pending metadata
+            @return An empty string on success, or the error message */
+        String runPlan()
+        {
+            if (plannedChunks.getSize())
+            {
+                PlannedChunkSorter sorter;
+                Container::Algorithms<PlannedChunks>::sortContainer(plannedChunks, sorter);
+
+                // Group the chunks by multichunk, and fetch what the workers need from the index now, since it's not thread safe
+                uint32 largestMultichunk = File::MultiChunk::MaximumSize;
+                groupStart.Clear(); groupPaths.Clear(); groupFilters.Clear();
+                for (size_t i = 0; i < plannedChunks.getSize(); i++)
+                {
+                    const uint16 multichunkID = plannedChunks[i].chunk->multichunkID;
+                    if (i && plannedChunks[i - 1].chunk->multichunkID == multichunkID) continue;
+
+                    const FileFormat::Multichunk * mchunk = Helpers::indexFile.getMultichunk(multichunkID);
+                    const String & filterArgument = Helpers::indexFile.getFilterArguments().getArgument(mchunk->filterArgIndex);
+                    groupStart.Append((uint32)i);
+                    groupPaths.Append(backupFolder + mchunk->getFileName());
+                    groupFilters.Append(filterArgument);
+                    largestMultichunk = max(largestMultichunk, (uint32)filterArgument.upToFirst(":").parseInt(10));
+                }
+                groupStart.Append((uint32)plannedChunks.getSize());
+                // The multichunk size is global, so set it before the workers start decoding
+                File::MultiChunk::setMaximumSize(largestMultichunk);
+
+                const uint32 groups = (uint32)groupPaths.getSize();
+                uint32 threads = (uint32)max(1, Threading::Thread::getCurrentCoreCount());
+                threads = min(threads, (uint32)max((size_t)1, maxCacheSize / File::MultiChunk::MaximumSize));
+                threads = min(threads, groups);
+
+                nextGroup = 0; doneGroups = 0; doneSize = 0; planError = "";
+                PlanWorkers workers;
+                for (uint32 i = 0; i < threads; i++)
+                {
+                    PlanWorker * worker = new PlanWorker(*this);
+                    workers.Append(worker);
+                    if (!worker->createThread()) break;
+                }
+
+                bool running = true;
+                while (running)
+                {
+                    Threading::Thread::Sleep(50);
+                    running = false;
+                    for (size_t i = 0; i < workers.getSize(); i++) running = running || workers[i].isRunning();
+
+                    uint64 done = 0; uint32 doneCount = 0;
+                    {
+                        Threading::ScopedLock scope(planLock);
+                        done = doneSize; doneCount = doneGroups;
+                    }
+                    if (!callback.progressed(ProgressCallback::Restore, TRANS("Restoring files content"), done, plannedSize, doneCount, groups, running ? ProgressCallback::KeepLine : ProgressCallback::FlushLine))
+                    {
+                        Threading::ScopedLock scope(planLock);
+                        if (!planError) planError = TRANS("Interrupted in output");
+                    }
+                }
+                // Wait for the workers to finish
+                workers.Clear();
+                if (!planError && doneGroups != groups) planError = TRANS("Interrupted in output");
+            }
+
+            for (size_t i = 0; i < plannedFiles.getSize(); i++)
+                if (::close(plannedFiles[i]) != 0 && !planError) planError = TRANS("Can't write the file (disk full ?)");
+            plannedFiles.Clear();
+            plannedChunks.Clear();
+            plannedSize = 0;
+            if (planError) return planError;
+
+            // The content of the identical files is written now, so clone them
+            for (size_t i = 0; i < pendingCloneTargets.getSize(); i++)
+                if (!cloneFile(pendingCloneSources[i], pendingCloneTargets[i])) return TRANS("Can't write the file (disk full ?)");
+            pendingCloneSources.Clear(); pendingCloneTargets.Clear();
+            if (reusedSize && !callback.progressed(ProgressCallback::Restore, String::Print(TRANS("Kept %s of unchanged content"), (const char*)makeLegibleSize(reusedSize)), 0, 0, 0, 0, ProgressCallback::FlushLine))
+                return TRANS("Interrupted in output");
+            reusedSize = 0;
+
+            // Then restore the metadata of the files now their content is written.
+            // The files are sorted by directory, and their metadata is set relative to the directory, so their whole path is not resolved for each call
+            ParentSorter parentSorter(*tree);
+            Container::Algorithms<IndexArray>::sortContainer(pendingMetadata, parentSorter);
+            int dirFd = -1;
+            uint32 dirID = 0;
+            for (size_t i = 0; i < pendingMetadata.getSize(); i++)
+            {
+                const String & filePath = tree->getItemFullPath(pendingMetadata[i]);
+                const FileFormat::FileTree::Item * item = tree->getItem(pendingMetadata[i]);
+                if (!i || item->getParentID() != dirID)
+                {
+                    if (dirFd >= 0) ::close(dirFd);
+                    dirID = item->getParentID();
+                    dirFd = ::open(folderTrimmed + filePath.upToLast("/"), O_RDONLY | O_DIRECTORY);
+                }
+                if (dirFd >= 0 && setFileMetaDataAt(dirFd, filePath.fromLast("/"), item->getMetaData())) continue;
+
+                // Use the path based version, that handles all the cases
+                File::Info outFile(folderTrimmed + filePath);
+                if (!outFile.analyzeMetaData(item->getMetaData()) || !outFile.setMetaData(item->getMetaData()))
+                {
+                    if (!WARN_CB(ProgressCallback::Restore, filePath, TRANS("Failed to restore the file's metadata")))
+                    {
+                        if (dirFd >= 0) ::close(dirFd);
+                        return TRANS("Failed to restore metadata");
+                    }
+                }
+            }
+            if (dirFd >= 0) ::close(dirFd);
+            pendingMetadata.Clear();
+            return "";
+        }
+#endif
+
 
         RestoreFile(ProgressCallback & callback, const String & folderTrimmed, const String & backupFolder, OverwritePolicy policy, const size_t maxCacheSize, const uint32 revisionID)
             : callback(callback), folderTrimmed(folderTrimmed), backupFolder(backupFolder.normalizedPath(Platform::Separator, true)),
               overwritePolicy(policy), cache(maxCacheSize)
             , tree(Helpers::indexFile.getFileTree(revisionID))
+#ifdef _POSIX
+            , planning(false), maxOpenFiles(getMaxOpenFiles()), maxCacheSize(maxCacheSize), plannedSize(0), reusedSize(0), nextGroup(0), doneGroups(0), doneSize(0)
+#endif
         {}
+#ifdef _POSIX
+        ~RestoreFile() { for (size_t i = 0; i < plannedFiles.getSize(); i++) ::close(plannedFiles[i]); }
+#endif
+    };
+
+    /** An iterator that only checks the entries recorded in the change journal, the unchanged entries are copied from the previous revision.
+        The entries of a directory are only listed if the journal recorded a change in its list, else they are taken from the previous revision */
+    class JournalIterator : public File::Scanner::EntryIterator
+    {
+        /** Set to true when the iteration is finished */
+        bool finished;
+        /** The backup processor */
+        BackupFile & processor;
+        /** The changed paths */
+        const ChangeJournal::PathFlagsT & paths;
+        /** The current directory (as given by the scanner) */
+        String currentDir;
+        /** The current directory index in the previous revision (or notFound if it's new) */
+        uint32 prevDir;
+        /** Set when the current directory must be listed */
+        bool listing;
+        /** The next child to process in the previous revision, when not listing */
+        uint32 nextChild;
+        /** The entries in the previous revision, when listing */
+        ItemIDMapT prevEntries;
+
+        /** Start iterating the given directory */
+        void selectDirectory(const String & name)
+        {
+            currentDir = name;
+            const String dirPath = name.midString(0, name.getLength() - 1);
+            const uint32 notFound = processor.prevFileTree->notFound();
+            const uint32 * dirID = processor.prevDirs.getValue(dirPath);
+            // A directory that was created or moved in must be scanned, even if a directory with the same name existed
+            prevDir = dirID && !ChangeJournal::isInSubtree(paths, dirPath) ? *dirID : notFound;
+            listing = prevDir == notFound || (ChangeJournal::getFlags(paths, dirPath) & ChangeJournal::ListingChanged);
+            nextChild = prevDir == notFound ? 0 : processor.prevChildStart[prevDir];
+            prevEntries.clearTable();
+            if (listing && prevDir != notFound)
+            {
+                for (uint32 c = processor.prevChildStart[prevDir]; c < processor.prevChildStart[prevDir + 1]; c++)
+                    prevEntries.storeValue(processor.prevFileTree->getItem(processor.prevChildren[c])->getBaseName(), new uint32(processor.prevChildren[c]), true);
+            }
+        }
+        bool stop() { finished = true; return false; }
+
+    public:
+        virtual bool getNextFile(File::DirectoryIterator & dir, File::Info & file, const String & name)
+        {
+            if (finished) return false;
+            if (name != currentDir) selectDirectory(name);
+            while (listing ? dir.getNextFilePath(file) : nextChild < processor.prevChildStart[prevDir + 1])
+            {
+                String strippedPath;
+                if (listing)
+                {
+                    if (file.name == "." || file.name == "..") continue;
+                    strippedPath = name + file.name;
+                    const uint32 * prevID = ChangeJournal::getFlags(paths, strippedPath) ? 0 : prevEntries.getValue(file.name);
+                    if (prevID && !processor.hasHardLinks(*prevID))
+                    {
+                        if (!processor.replayItem(*prevID, strippedPath)) return stop();
+                        continue;
+                    }
+                }
+                else
+                {
+                    const uint32 prevID = processor.prevChildren[nextChild++];
+                    strippedPath = name + processor.prevFileTree->getItem(prevID)->getBaseName();
+                    // Since the directory's list did not change, a missing entry can only be a dangling link, so keep its previous version
+                    if ((!ChangeJournal::getFlags(paths, strippedPath) && !processor.hasHardLinks(prevID)) || !(file = File::Info(processor.folderToBackup + strippedPath.midString(1, strippedPath.getLength()))).doesExist())
+                    {
+                        if (!processor.replayItem(prevID, strippedPath)) return stop();
+                        continue;
+                    }
+                }
+                if (!processor.fileFound(file, strippedPath)) return stop();
+                // Let the scanner feed the directory in the stack of directory to scan
+                if (recursive && file.isDir() && !file.isLink() && !processor.isPruned(strippedPath)) return true;
+            }
+            return false;
+        }
+        JournalIterator(const bool recursive, BackupFile & processor, const ChangeJournal::PathFlagsT & paths)
+            : File::Scanner::EntryIterator(recursive), finished(false), processor(processor), paths(paths), currentDir("*"), prevDir(0), listing(true), nextChild(0) {}
     };
 
     // Backup the given folder
-    String backupFolder(const String & folderToBackup, const String & backupTo, const unsigned int revisionID, ProgressCallback & callback, const PurgeStrategy strategy)
+    String backupFolder(const String & folderToBackup, const String & backupTo, const unsigned int revisionID, ProgressCallback & callback, const PurgeStrategy strategy, const String & journalPath)
     {
         // The complete logic is here
 
@@ -2078,9 +4924,28 @@ namespace Frost
         // Step one, we'll make a stack of data to find out what to backup
         if (!callback.progressed(ProgressCallback::Backup, TRANS("...scanning..."), 0, 1, 0, 1, ProgressCallback::KeepLine))
             return TRANS("Error with output");
+        // Restart from the last checkpoint, if any, when asked to
+        if (Helpers::resumeBackup && Helpers::checkpointPath)
+        {
+            if (File::Info(Helpers::checkpointPath).doesExist())
+            {
+                const String & error = processor.resume();
+                if (error) return TRANS("Can't resume the backup: ") + error;
+                callback.progressed(ProgressCallback::Backup, String::Print(TRANS("Resuming the backup (%u entries already stored)"), (uint32)processor.resumedItems.getSize()), 0, 0, 0, 0, ProgressCallback::FlushLine);
+            }
+            else if (dumpLevel) callback.progressed(ProgressCallback::Backup, TRANS("No checkpoint to resume from, starting a complete backup"), 0, 0, 0, 0, ProgressCallback::FlushLine);
+        }
+        // If a watcher recorded the changes since the previous backup, only the changed entries are scanned
+        ChangeJournal::PathFlagsT changedPaths;
+        const bool useJournal = journalPath && ChangeJournal::consume(journalPath, folderToBackup, changedPaths) && processor.prepareReplay();
+        if (dumpLevel && journalPath)
+            callback.progressed(ProgressCallback::Backup, useJournal ? String::Print(TRANS("Using the change journal (%u changed paths)"), (uint32)changedPaths.getSize()) : TRANS("Change journal not usable, scanning everything"), 0, 0, 0, 0, ProgressCallback::FlushLine);
+
         File::Info rootFolder(folderToBackup, true);
         processor.fileFound(rootFolder, PathSeparator);
-        File::Scanner::EventIterator iterator(true, processor);
+        PruningEventIterator scanIterator(true, processor);
+        JournalIterator journalIterator(true, processor, changedPaths);
+        File::Scanner::EntryIterator & iterator = useJournal ? (File::Scanner::EntryIterator &)journalIterator : (File::Scanner::EntryIterator &)scanIterator;
 
         if (File::Scanner::scanFolderGeneric(folderToBackup, ".", items, iterator, false) && !exitRequired)
             return TRANS("Can't scan the backup folder");
@@ -2091,6 +4956,141 @@ namespace Frost
         return "";
     }
 
+#ifdef _LINUX
+    namespace ChangeJournal
+    {
+        /** The watched directories (from the watch descriptor to the directory path relative to the watched folder) */
+        typedef Container::HashTable<String, uint32> WatchMapT;
+        /** The events that are watched */
+        static const uint32 watchedEvents = IN_MODIFY | IN_ATTRIB | IN_CREATE | IN_DELETE | IN_MOVED_FROM | IN_MOVED_TO | IN_DONT_FOLLOW | IN_ONLYDIR | IN_EXCL_UNLINK;
+
+        /** Watch the given directory and all its subdirectories.
+            @return false if some directory could not be watched (likely the watch limit was reached) */
+        static bool addWatches(const int fd, const String & folder, const String & dirPath, WatchMapT & watches)
+        {
+            bool done = true;
+            Strings::StringArray pending;
+            pending.Append(dirPath);
+            for (size_t i = 0; i < pending.getSize(); i++)
+            {
+                const String path = pending[i];
+                int wd = inotify_add_watch(fd, folder + path, watchedEvents);
+                if (wd < 0) { if (errno != ENOENT && errno != ENOTDIR) done = false; continue; }
+                watches.storeValue((uint32)wd, new String(path), true);
+
+                File::DirectoryIterator dir = File::General::listFilesIn(folder + path);
+                File::Info file;
+                while (dir.getNextFilePath(file))
+                {
+                    if (file.name == "." || file.name == "..") continue;
+                    if (file.isDir() && !file.isLink()) pending.Append(path + PathSeparator + file.name);
+                }
+            }
+            return done;
+        }
+        /** Stop watching the given directory and all its subdirectories (it was moved away) */
+        static void removeWatches(const int fd, const String & dirPath, WatchMapT & watches)
+        {
+            IndexArray removed;
+            const String below = dirPath + PathSeparator;
+            for (WatchMapT::IterT iter = watches.getFirstIterator(); iter.isValid(); ++iter)
+            {
+                const String & path = **iter;
+                if (path == dirPath || path.midString(0, below.getLength()) == below) removed.Append(*iter.getKey());
+            }
+            for (size_t i = 0; i < removed.getSize(); i++)
+            {
+                inotify_rm_watch(fd, (int)removed[i]);
+                watches.removeValue(removed[i]);
+            }
+        }
+    }
+
+    // Watch the given folder and record its changes in the journal
+    String watchFolder(const String & folderToWatch, const String & journalPath, ProgressCallback & callback)
+    {
+        using namespace ChangeJournal;
+        const String realPath = File::Info(folderToWatch, true).getRealFullPath(), folder = realPath.normalizedPath(Platform::Separator, false);
+
+        // The lock tells the backup process that we are running, and for which folder
+        int lockFd = ::open(getLockPath(journalPath), O_RDWR | O_CREAT, 0600);
+        if (lockFd < 0) return TRANS("Can't open the journal lock file: ") + getLockPath(journalPath);
+        if (flock(lockFd, LOCK_EX | LOCK_NB) != 0) { ::close(lockFd); return TRANS("Another watcher is already running for this journal"); }
+        if (ftruncate(lockFd, 0) != 0 || ::write(lockFd, (const char*)realPath, realPath.getLength()) != (ssize_t)realPath.getLength())
+        { ::close(lockFd); return TRANS("Can't write the journal lock file"); }
+
+        // Any change that happened while we were not running is unknown, so the next backup will have to scan everything
+        if (!appendRecords(journalPath, "S \n")) { ::close(lockFd); return TRANS("Can't write to the journal: ") + journalPath; }
+
+        int fd = inotify_init1(IN_NONBLOCK);
+        if (fd < 0) { ::close(lockFd); return TRANS("Can't initialize inotify"); }
+
+        WatchMapT watches;
+        if (!callback.progressed(ProgressCallback::Backup, TRANS("Watching: ") + folder, 0, 1, 0, 1, ProgressCallback::KeepLine)) { ::close(fd); ::close(lockFd); return TRANS("Error with output"); }
+        bool ready = addWatches(fd, folder, "", watches);
+        if (!ready) WARN_CB(ProgressCallback::Backup, folder, TRANS("Can't watch all the directories (check /proc/sys/fs/inotify/max_user_watches), backups will scan the folder"));
+        if (!appendRecords(journalPath, ready ? "R \n" : "O \n")) { ::close(fd); ::close(lockFd); return TRANS("Can't write to the journal: ") + journalPath; }
+        callback.progressed(ProgressCallback::Backup, TRANS("Watching: ") + folder, 1, 1, 1, 1, ProgressCallback::FlushLine);
+
+        String error;
+        // Aligned as required for the inotify_event structure
+        uint32 buffer[16384];
+        while (!exitRequired && !error)
+        {
+            struct pollfd pfd = { fd, POLLIN, 0 };
+            if (poll(&pfd, 1, 1000) <= 0) continue; // Check for interruption every second
+
+            ssize_t len = ::read(fd, buffer, sizeof(buffer));
+            if (len <= 0) continue;
+
+            String records, lastRecord;
+            for (const char * ptr = (const char*)buffer; ptr < (const char*)buffer + len; )
+            {
+                const struct inotify_event * event = (const struct inotify_event *)ptr;
+                ptr += sizeof(*event) + event->len;
+
+                if (event->mask & IN_Q_OVERFLOW) { records += "O \n"; continue; }
+                if (event->mask & IN_IGNORED) { watches.removeValue((uint32)event->wd); continue; }
+                const String * dir = watches.getValue((uint32)event->wd);
+                if (!dir) continue;
+                const String dirPath = *dir, path = event->len ? dirPath + PathSeparator + event->name : dirPath;
+
+                String record;
+                if (event->mask & (IN_CREATE | IN_MOVED_TO))
+                {
+                    record = "L " + dirPath + "\nC " + path + "\n";
+                    if (event->mask & IN_ISDIR)
+                    {   // We don't know what's inside this directory, it'll have to be scanned
+                        if (!addWatches(fd, folder, path, watches)) record += "O \n";
+                        record += "T " + path + "\n";
+                    }
+                }
+                else if (event->mask & (IN_DELETE | IN_MOVED_FROM))
+                {
+                    record = "L " + dirPath + "\n";
+                    if ((event->mask & (IN_MOVED_FROM | IN_ISDIR)) == (IN_MOVED_FROM | IN_ISDIR)) removeWatches(fd, path, watches);
+                }
+                else record = "C " + path + "\n";
+
+                // A file being written is reporting many modifications, only record it once
+                if (record != lastRecord) records += record;
+                lastRecord = record;
+            }
+            if (!appendRecords(journalPath, records)) error = TRANS("Can't write to the journal: ") + journalPath;
+        }
+        ::close(fd);
+        ::close(lockFd);
+        callback.progressed(ProgressCallback::Backup, TRANS("Stopped watching: ") + folder, 0, 0, 0, 0, ProgressCallback::FlushLine);
+        return error;
+    }
+#else
+    // Watch the given folder and record its changes in the journal
+    String watchFolder(const String & folderToWatch, const String & journalPath, ProgressCallback & callback)
+    {
+        return TRANS("Watching a folder is not supported on this platform");
+    }
+#endif
+
 
 
     // List available backups
@@ -2170,20 +5170,19 @@ namespace Frost
     }
 
     // Purge old backups
-    String purgeBackup(const String & chunkFolder, ProgressCallback & callback, const PurgeStrategy strategy, const unsigned int upToRevision)
+    String purgeBackup(const String & remoteFolder, ProgressCallback & callback, const PurgeStrategy strategy, const unsigned int upToRevision)
     {
+        const String chunkFolder = remoteFolder.normalizedPath(Platform::Separator, true);
         // First, we need to figure out the chunks that are in the given revision but in no other revision (orphans)
         if (!callback.progressed(ProgressCallback::Purge, TRANS("...scanning..."), 0, 1, 0, 1, ProgressCallback::KeepLine))
             return TRANS("Error with output");
 
-        /* The basic algorithm here is to build 3 arrays of chunks successively
-           The first chunk array (All) contains the current status of the index file (that is including all revisions' chunks)
-           The second chunk array (B) is build by concatenating the chunk in revisions up to given one
-           The third chunk array (C) is build by concatenating the chunk in revision starting from the given one + 1 to the last version.
-           Finally a last chunk array is build so that it contains chunks in (B) that are not in (C)
-           While doing so, all multichunks infering this list is remembered.
+        /* The basic algorithm here is based on the chunks reference counts
+           The index keeps, for each chunk, the number of references to it in all revisions (they are rebuilt if they don't match the index).
+           The references of the revisions up to the given one are removed, and the chunks they were referring to are marked in a bitmap (B).
+           Then, a linear sweep over the marked chunks finds the ones without any reference left, and count them per multichunk.
 
-           For each remembered multichunk, we assert a "remove" value, that is equal to the number of chunks to remove in this
+           For each multichunk with such chunks, we assert a "remove" value, that is equal to the number of chunks to remove in this
            multichunk divided by the number of chunks in the multichunk.
            If this ratio is 1.0 then we can remove the multichunk.
            Else, we simple sort the list of multichunks by this ratio.
@@ -2191,92 +5190,86 @@ namespace Frost
            The multichunk with the biggest ratio will be repacked first until all multichunk are respecting the given strategy threshold.
 
            Finally, a new index file is rewritten with the remaining stuff from the initial file. */
-        typedef Container::PlainOldData<uint32>::Array UIDArray;
         typedef Container::PlainOldData<uint16>::Array MCUIDArray;
-        UIDArray chunksInPrev, chunksInNext;
-        UIDArray chunkListsToRemove;
-        unsigned int rev = 1;
-        while (rev <= upToRevision)
+        const String indexPath = chunkFolder + DEFAULT_INDEX;
+        // The reference counts are always next to the index that's used by the backups, whatever the purge mode
+        const String refCountsPath = FileFormat::IndexFile::getRefCountsPath(DatabaseModel::databaseURL + DEFAULT_INDEX);
+        if (!Helpers::indexFile.loadRefCounts(refCountsPath))
         {
-            Utils::OwnPtr<FileFormat::FileTree> ft(Helpers::indexFile.getFileTree(rev));
-            if (!ft) { ++rev; continue; } // The first revisions might be missing already in the archive already
-
-            for (uint32 file = 0; file < ft->notFound(); file++) // Not found is also the size of the items list
-            {
-                uint32 chunkListID = ft->getItem(file)->getChunkListID();
-                chunkListsToRemove.Append(chunkListID);
-                // Then query this list of chunks for all chunks ID to account for
-                FileFormat::ChunkList * cl = Helpers::indexFile.getChunkList(chunkListID);
-
-                if (cl)
-                {
-                    for (size_t i = 0; i < cl->chunksID.getSize(); i++)
-                        chunksInPrev.Append(cl->chunksID[i]);
-                }
-            }
-            ++rev;
+            if (!callback.progressed(ProgressCallback::Purge, TRANS("...counting chunks references..."), 0, 1, 0, 1, ProgressCallback::KeepLine))
+                return TRANS("Error with output");
+            Helpers::indexFile.rebuildRefCounts();
         }
-        if (!chunksInPrev.getSize())  // No chunks found ? We're done
-            return "";
 
-        while (rev <= Helpers::indexFile.getCurrentRevision())
+        const uint32 maxChunkID = Helpers::indexFile.allocateChunkID();
+        FileFormat::UIDBitmap chunksInPrev(maxChunkID), listsInPrev(Helpers::indexFile.allocateChunkListID());
+        for (unsigned int rev = 1; rev <= upToRevision; rev++)
         {
             Utils::OwnPtr<FileFormat::FileTree> ft(Helpers::indexFile.getFileTree(rev));
-            if (!ft)
-                return TRANS("Could not find the given revision: ") + rev;
-
-            for (uint32 file = 0; file < ft->notFound(); file++) // Not found is also the size of the items list
-            {
-                uint32 chunkListID = ft->getItem(file)->getChunkListID();
-                // Then query this list of chunks for all chunks ID to account for
-                FileFormat::ChunkList * cl = Helpers::indexFile.getChunkList(chunkListID);
-
-                if (cl)
-                {
-                    for (size_t i = 0; i < cl->chunksID.getSize(); i++)
-                        chunksInNext.Append(cl->chunksID[i]);
-                }
-            }
-            ++rev;
+            if (!ft) continue; // The first revisions might be missing already in the archive already
+            Helpers::indexFile.removeReferences(*ft, listsInPrev, chunksInPrev);
         }
 
-
         if (!callback.progressed(ProgressCallback::Purge, TRANS("...building list of chunks to remove..."), 0, 1, 0, 1, ProgressCallback::KeepLine))
             return TRANS("Error with output");
 
-        // Ok, now the compute the remaining chunk array (the chunks that need removing)
-        struct CompareUint32
-        {
-            static inline int compareData(const uint32 a, const uint32 b) { return a < b ? -1 : a==b ? 0 : 1; }
-        } comp;
-        Container::Algorithms<UIDArray>::sortContainer(chunksInPrev, comp);
-        Container::Algorithms<UIDArray>::sortContainer(chunksInNext, comp);
-
-        UIDArray removeChunks, keepChunks;
-        MCUIDArray multichunkToRework;
+        // Ok, now sweep the chunks to find the ones to remove (used before, but not after), and count them per multichunk
+        FileFormat::UIDBitmap removeChunks(maxChunkID);
+        // Multichunks UID are 16 bits, so the count of chunks to remove in each of them is a flat array
+        Utils::MemoryBlock removedCounts(65536 * sizeof(uint32));
+        memset(removedCounts.getBuffer(), 0, removedCounts.getSize());
+        uint32 * removedPerMultichunk = (uint32*)removedCounts.getBuffer();
+        uint32 removedCount = 0, referencedCount = 0;
 
         const uint32 allChunks = (uint32)Helpers::indexFile.getTotalChunks().chunks.getSize();
-        for (size_t i = 0; i < chunksInPrev.getSize(); i++)
+        const uint32 lastChunkID = (uint32)chunksInPrev.bits.getSize() * 8;
+        for (uint32 chunkUID = 0; chunkUID < lastChunkID; chunkUID++)
         {
-            const uint32 chunkUID = chunksInPrev.getElementAtUncheckedPosition(i);
-            if (chunksInNext.indexOfSorted(chunkUID) == chunksInNext.getSize())
-            { // This chunk was not found in the later revision, and can be removed
+            if (!chunksInPrev.isSet(chunkUID)) continue;
+            referencedCount++;
+            if (!Helpers::indexFile.getChunkReferences(chunkUID))
+            { // This chunk is not referenced by the later revision, and can be removed
                 const FileFormat::Chunk * chunk = Helpers::indexFile.findChunk(chunkUID);
                 if (!chunk)
                     return TRANS("Unexpected: Chunk not found with UID ") + chunkUID;
-                if (removeChunks.indexOfSorted(chunkUID) == removeChunks.getSize())
+                removeChunks.set(chunkUID);
+                removedPerMultichunk[chunk->multichunkID]++;
+                removedCount++;
+            }
+        }
+
+        if (!referencedCount && !Helpers::coalesceMultichunks)  // No chunks found ? We're done
+            return "";
+
+        // The undersized multichunks are merged too when coalescing, as long as there are at least 2 of the same kind to merge
+        FileFormat::UIDBitmap undersized(65535);
+        if (Helpers::coalesceMultichunks)
+        {
+            MCUIDArray candidates[2];
+            for (uint32 id = 1; id <= Helpers::indexFile.lastMultichunkID(); id++)
+            {
+                FileFormat::Multichunk * mc = Helpers::indexFile.getMultichunk((uint16)id);
+                FileFormat::ChunkList * cl = mc ? Helpers::indexFile.getChunkList(mc->listID) : 0;
+                if (!cl || removedPerMultichunk[id] == cl->chunksID.getSize()) continue;
+
+                // Only the chunks that are kept are accounted for
+                size_t liveSize = 0;
+                for (size_t c = 0; c < cl->chunksID.getSize(); c++)
                 {
-                    removeChunks.insertSorted(chunkUID);
-                    multichunkToRework.appendIfNotPresent(chunk->multichunkID);
+                    const uint32 chunkID = cl->chunksID.getElementAtUncheckedPosition(c);
+                    if (removeChunks.isSet(chunkID)) continue;
+                    const FileFormat::Chunk * chunk = Helpers::indexFile.findChunk(chunkID);
+                    if (chunk) liveSize += chunk->size + File::Chunk::HeaderSize;
                 }
-            } else if (keepChunks.indexOfSorted(chunkUID) == keepChunks.getSize())
-            {   // Remember the chunks we must keep
-                keepChunks.insertSorted(chunkUID);
+                if (liveSize < File::MultiChunk::MaximumSize / 2)
+                    candidates[Helpers::indexFile.getFilterArgumentForMultichunk((uint16)id).fromTo(":", ":") != "none"].Append((uint16)id);
             }
+            for (size_t k = 0; k < ArrSz(candidates); k++)
+                for (size_t i = 0; candidates[k].getSize() > 1 && i < candidates[k].getSize(); i++) undersized.set(candidates[k][i]);
         }
 
         // Ok, great, now we have the list of chunks to remove, let's find out the multichunks where to remove them
-        if (!callback.progressed(ProgressCallback::Purge, TRANS("... found orphans chunks ..."), 0, 0, (uint32)removeChunks.getSize(), allChunks, ProgressCallback::FlushLine))
+        if (!callback.progressed(ProgressCallback::Purge, TRANS("... found orphans chunks ..."), 0, 0, removedCount, allChunks, ProgressCallback::FlushLine))
             return TRANS("Error with output");
 
         // Then analyze and sort all multichunks for finding out which one to rework first
@@ -2287,38 +5280,49 @@ namespace Frost
             bool operator == (const MCSortRank & k) const { return memcmp(this, &k, sizeof(*this)) == 0; }
             bool operator <= (const MCSortRank & k) const { return (rank < k.rank) || (rank == k.rank && id <= k.id); }
 
+            static inline int compareData(const MCSortRank & a, const MCSortRank & b) { return a == b ? 0 : (a <= b ? -1 : 1); }
+
             MCSortRank(const float rank = 0, const uint16 id = 0) : rank(rank), id(id) {}
         };
         typedef Container::PlainOldData<MCSortRank>::Array MultichunkUsageT;
         MultichunkUsageT multichunksSorter;
-        for (size_t i = 0; i < multichunkToRework.getSize(); i++)
+        for (uint32 id = 0; id < 65536; id++)
         {
-            FileFormat::Multichunk * mc = Helpers::indexFile.getMultichunk(multichunkToRework[i]);
-            if (!mc) return TRANS("Unexpected: Multichunk not found with UID ") + (uint32)multichunkToRework[i];
+            const uint32 removedChunksCount = removedPerMultichunk[id];
+            if (!removedChunksCount && !undersized.isSet(id)) continue;
+            FileFormat::Multichunk * mc = Helpers::indexFile.getMultichunk((uint16)id);
+            if (!mc) return TRANS("Unexpected: Multichunk not found with UID ") + id;
 
             FileFormat::ChunkList * cl = Helpers::indexFile.getChunkList(mc->listID);
-            uint32 removedChunksCount = 0;
-            for (size_t c = 0; c < cl->chunksID.getSize(); c++)
-            {
-                if (removeChunks.indexOfSorted(cl->chunksID[c]) != removeChunks.getSize()) removedChunksCount++;
-            }
-
-            multichunksSorter.insertSorted(MCSortRank((float)removedChunksCount / cl->chunksID.getSize(), multichunkToRework[i]));
+            if (!cl) return TRANS("Errror: Could not find the list of chunks with ID: ") + mc->listID;
+            multichunksSorter.Append(MCSortRank((float)removedChunksCount / cl->chunksID.getSize(), (uint16)id));
         }
+        MCSortRank sortRank;
+        Container::Algorithms<MultichunkUsageT>::sortContainer(multichunksSorter, sortRank);
 
         if (!callback.progressed(ProgressCallback::Purge, TRANS("... found affected multichunks ..."), 0, 0, (uint32)multichunksSorter.getSize(), Helpers::indexFile.getMultichunkCount(), ProgressCallback::FlushLine))
             return TRANS("Error with output");
 
         // From now on, we'll start to build a new IndexFile starting from the next revision after purging.
+        // When purging in place, the repacked multichunks are collected here instead, and appended to the current index
+        const bool inPlace = Helpers::purgeInPlace;
         FileFormat::IndexFile newIndex;
-        String initialBackupPath = Helpers::indexFile.getFirstMetaData().getBackupPath();
+        FileFormat::ChunkLists repackedLists;
+        FileFormat::Multichunks repackedMultichunks;
         String tempIndexPath = chunkFolder+"/__purgeIndex.frost";
-        String error = newIndex.createNew(tempIndexPath, Helpers::indexFile.getCipheredMasterKey(), initialBackupPath);
-        if (error) return error;
+        String error;
+        if (!inPlace)
+        {
+            String initialBackupPath = Helpers::indexFile.getFirstMetaData().getBackupPath();
+            error = newIndex.createNew(tempIndexPath, Helpers::indexFile.getCipheredMasterKey(), initialBackupPath);
+            if (error) return error;
 
-        // We need to pre-copy all the filter arguments from the current index to the new index since they might get modified while purging
-        newIndex.getFilterArguments().arguments = Helpers::indexFile.getFilterArguments().arguments;
-        newIndex.getFilterArguments().modified = true;
+            // We need to pre-copy all the filter arguments from the current index to the new index since they might get modified while purging
+            newIndex.getFilterArguments().arguments = Helpers::indexFile.getFilterArguments().arguments;
+            newIndex.getFilterArguments().modified = true;
+        }
+        // The index whose filter arguments are used for the repacked multichunks
+        FileFormat::IndexFile * argumentsIndex = inPlace ? &Helpers::indexFile : &newIndex;
 
 
         // Ok, now we have a sorted list of multichunks (from 0 (no chunks to remove) to 1 (all chunks to remove))
@@ -2330,15 +5334,16 @@ namespace Frost
         // Hopefully, the new ID is always equal to a previous one, and there should be less (or exactly as many) multichunks after purging.
         // So, we simply use an index for the ID in the multichunkToRework array.
         MCUIDArray multichunksToRemove;
-        // 2 multichunks need to be stored in the cache
-        Helpers::MultiChunkCache cache(64*1024*1024);
+        // The multichunks being reworked and the ones decoded ahead need to be stored in the cache
+        Helpers::MultiChunkCache cache(max((size_t)64*1024*1024, 2 * Helpers::prefetchSize));
+        Helpers::MultiChunkCache::Pin pin(cache);
 
         // The multichunks we are working with
         Utils::ScopePtr<FileFormat::Multichunk>  compMultichunk(new FileFormat::Multichunk), encMultichunk(new FileFormat::Multichunk);
         Utils::ScopePtr<FileFormat::ChunkList>  compMultichunkList(new FileFormat::ChunkList(0, true)), encMultichunkList(new FileFormat::ChunkList(0, true));
-        File::MultiChunk compMC, encMC;
-        FileFormat::ChunkLists &  newChunkList = *newIndex.getChunkLists();
-        FileFormat::Multichunks & newMultichunks = *newIndex.getMultichunks();
+        Utils::ScopePtr<File::MultiChunk> compMC(new File::MultiChunk), encMC(new File::MultiChunk);
+        FileFormat::ChunkLists &  newChunkList = inPlace ? repackedLists : *newIndex.getChunkLists();
+        FileFormat::Multichunks & newMultichunks = inPlace ? repackedMultichunks : *newIndex.getMultichunks();
 
         // RAII for cleaning any multichunk we have created upon failing purging
         struct CleanMultichunksOnExit
@@ -2350,20 +5355,35 @@ namespace Frost
         } mcGuard;
 
         float purgeThreshold = (int)strategy / 100.0f;
+        // The multichunks to rework are known beforehand, so decode them in background threads, in the order they are processed below
+        Helpers::MultiChunkPrefetcher prefetcher(cache);
+        for (size_t i = multichunksSorter.getSize(); Helpers::prefetchSize && i; --i)
+        {
+            const MCSortRank & rank = multichunksSorter[i-1];
+            if (rank.rank == 1.0f) continue;
+            if (rank.rank <= purgeThreshold && !undersized.isSet(rank.id)) continue;
+            const FileFormat::Multichunk * currentMC = Helpers::indexFile.getMultichunk(rank.id);
+            if (currentMC) prefetcher.append(rank.id, chunkFolder + currentMC->getFileName(), Helpers::indexFile.getFilterArgumentForMultichunk(rank.id));
+        }
+        prefetcher.start(Helpers::prefetchSize);
+        // The full multichunks are sealed in background threads, while the next ones are filled.
+        // The chunks are still assigned to the multichunks here, in order, so the result is the same whatever the number of threads.
+        Helpers::MultiChunkSealer sealer(chunkFolder, mcGuard.createdMultichunks);
+
         for (size_t i = multichunksSorter.getSize(); i; --i)
         {
             MCSortRank & rank = multichunksSorter.getElementAtUncheckedPosition(i-1);
             // Special case: all chunks must be removed
             if (rank.rank == 1.0f)
             {
+                // The multichunks after this one were already processed, so the next one is still at i-2
                 multichunksToRemove.Append(rank.id);
                 multichunksSorter.Remove(i-1);
-                i = multichunksSorter.getSize();
                 continue;
             }
 
-            // If we've reached the expected strategy goal, we stop the (hard) work.
-            if (rank.rank <= purgeThreshold) break;
+            // If we've reached the expected strategy goal, we stop the (hard) work, except for the undersized multichunks to merge
+            if (rank.rank <= purgeThreshold && !undersized.isSet(rank.id)) continue;
             // Ok, we need to rework a multichunk here
             // We have opened 2 multichunks (one for compression + encryption, one for the encryption only) already
             // We'll be selecting the multichunk to store into depending on the filtering used for the current multichunk.
@@ -2374,7 +5394,7 @@ namespace Frost
             bool shouldCompress = filterMode.fromTo(":", ":") != "none";
             Utils::ScopePtr<FileFormat::Multichunk> & outMC = !shouldCompress ? encMultichunk : compMultichunk;
             Utils::ScopePtr<FileFormat::ChunkList> &  outCL = !shouldCompress ? encMultichunkList : compMultichunkList;
-            File::MultiChunk &      destMC = !shouldCompress ? encMC : compMC;
+            Utils::ScopePtr<File::MultiChunk> & destMC = !shouldCompress ? encMC : compMC;
 
             // If UID not assigned yet, let's assign it now, we are reusing an existing multichunk
             if (outCL->UID == 0) { outCL->UID = currentMC->listID; outMC->UID = currentMC->UID; outMC->listID = outCL->UID; }
@@ -2383,11 +5403,12 @@ namespace Frost
             // or not. If it's used, we'll extract the chunk and add to the current multichunk.
             FileFormat::ChunkList * cl = Helpers::indexFile.getChunkList(currentMC->listID);
             if (!cl)    return TRANS("Errror: Could not find the list of chunks with ID: ") + currentMC->listID;
+            prefetcher.use(rank.id);
 
             for (size_t c = 0; c < cl->chunksID.getSize(); c++)
             {
                 const uint32 chunkID = cl->chunksID.getElementAtUncheckedPosition(c);
-                if (removeChunks.indexOfSorted(chunkID) == removeChunks.getSize())
+                if (!removeChunks.isSet(chunkID))
                 {
                     // We should keep this chunk
                     const FileFormat::Chunk * chunk = Helpers::indexFile.findChunk(chunkID);
@@ -2395,21 +5416,14 @@ namespace Frost
 
                     // Copy data to the new multichunk
                     //=================================================
-                    File::Chunk * chunkData = Helpers::extractChunkBin(error, chunkFolder, currentMC->getFileName(), rank.id, cl->offsets.getElementAtUncheckedPosition(c), chunk->checksum, filterMode, cache, callback);
+                    File::Chunk * chunkData = Helpers::extractChunkBin(error, chunkFolder, currentMC->getFileName(), rank.id, cl->offsets.getElementAtUncheckedPosition(c), chunk->checksum, filterMode, pin, callback);
                     if (!chunkData) return TRANS("Error: Could not extract chunk data for ID: ") + chunkID;
 
                     // If the current multichunk is full, we have to close it, compress it and encrypt it, and open a new one.
-                    if (!destMC.canFit(chunkData->size))
+                    if (!destMC->canFit(chunkData->size))
                     {
-                        // Close this multichunk, and apply filters
-                        KeyFactory::KeyT chunkHash;
-                        String chunkFile = chunkFolder;
-                        if (!Helpers::closeMultiChunkBin(chunkFile, destMC, 0, callback, shouldCompress ? Helpers::Default : Helpers::None, chunkHash))
-                            return TRANS("Error: Closing multichunk failed");
-
-                        mcGuard.appendMC(chunkFile);
-                        outMC->filterArgIndex = Helpers::getFilterArgumentIndex(shouldCompress ? Helpers::Default : Helpers::None, &newIndex);
-                        memcpy(outMC->checksum, chunkHash, ArrSz(chunkHash));
+                        // Close this multichunk, the filters are applied in the background and the checksum is set in the record when done
+                        outMC->filterArgIndex = Helpers::getFilterArgumentIndex(shouldCompress ? Helpers::Default : Helpers::None, argumentsIndex);
 
                         uint16 mcID = outMC->UID;
                         if (mcID == currentMC->UID)
@@ -2417,17 +5431,19 @@ namespace Frost
                             // This should never happen, since we are removing chunks, we should be able to fit at least the same number of chunks in a multichunk
                             return TRANS("Error: We should be able to reassign ID for multichunks");
                         }
+                        error = sealer.seal(destMC.Forget(), shouldCompress ? Helpers::Default : Helpers::None, outMC);
+                        if (error) return error;
                         newChunkList.storeValue(outMC->listID, outCL.Forget());
                         newMultichunks.storeValue(mcID, outMC.Forget());
                         // Reset it now for next chunk
                         outCL = new FileFormat::ChunkList(0, true);
                         outMC = new FileFormat::Multichunk;
-                        destMC.Reset();
+                        destMC = new File::MultiChunk;
                         // Need to make sure the multichunk ID for this chunk is different from the one we started with
                         outCL->UID = currentMC->listID; outMC->UID = currentMC->UID; outMC->listID = outCL->UID;
                     }
-                    size_t offsetInMC = destMC.getSize();
-                    uint8 * chunkBuffer = destMC.getNextChunkData(chunkData->size, chunkData->checksum);
+                    size_t offsetInMC = destMC->getSize();
+                    uint8 * chunkBuffer = destMC->getNextChunkData(chunkData->size, chunkData->checksum);
                     if (!chunkBuffer) return TRANS("Error: Could not get a free buffer to store the chunk with ID: ") + chunkID;
 
                     memcpy(chunkBuffer, chunkData->data, chunkData->size);
@@ -2455,58 +5471,128 @@ namespace Frost
             return TRANS("Interrupted in output");
 
         // Finally, close all remaining multichunks
-        KeyFactory::KeyT chunkHash;
-        if (encMC.getSize())
+        if (encMC->getSize())
         {
-            String chunkFile = chunkFolder;
-            if (!Helpers::closeMultiChunkBin(chunkFile, encMC, 0, callback, Helpers::None, chunkHash))
-                return TRANS("Error: Closing multichunk failed");
-
-            mcGuard.appendMC(chunkFile);
-            encMultichunk->filterArgIndex = getFilterArgumentIndex(Helpers::None, &newIndex);
-            memcpy(encMultichunk->checksum, chunkHash, ArrSz(chunkHash));
+            encMultichunk->filterArgIndex = getFilterArgumentIndex(Helpers::None, argumentsIndex);
+            error = sealer.seal(encMC.Forget(), Helpers::None, encMultichunk);
+            if (error) return error;
 
             newChunkList.storeValue(encMultichunk->listID, encMultichunkList.Forget());
             uint16 encID = encMultichunk->UID;
             newMultichunks.storeValue(encID, encMultichunk.Forget());
         }
-        if (compMC.getSize())
+        if (compMC->getSize())
         {
-            String chunkFile = chunkFolder;
-            if (!Helpers::closeMultiChunkBin(chunkFile, compMC, 0, callback, Helpers::Default, chunkHash))
-                return TRANS("Error: Closing multichunk failed");
-
-            mcGuard.appendMC(chunkFile);
-            compMultichunk->filterArgIndex = getFilterArgumentIndex(Helpers::Default, &newIndex);
-            memcpy(compMultichunk->checksum, chunkHash, ArrSz(chunkHash));
+            compMultichunk->filterArgIndex = getFilterArgumentIndex(Helpers::Default, argumentsIndex);
+            error = sealer.seal(compMC.Forget(), Helpers::Default, compMultichunk);
+            if (error) return error;
 
             newChunkList.storeValue(compMultichunk->listID, compMultichunkList.Forget());
             uint16 compID = compMultichunk->UID;
             newMultichunks.storeValue(compID, compMultichunk.Forget());
         }
+        error = sealer.finish();
+        if (error) return error;
+
+        if (inPlace)
+        {   // Append the new base and the kept revisions to the current index, the removed multichunks are dropped with their chunk list
+            FileFormat::UIDBitmap removedMultichunks(65535);
+            for (size_t i = 0; i < multichunksToRemove.getSize(); i++) removedMultichunks.set(multichunksToRemove[i]);
+            if (dumpLevel < 2)
+            {
+                const String localIndexPath = DatabaseModel::databaseURL + DEFAULT_INDEX;
+                error = Helpers::indexFile.purgeInPlace(localIndexPath, upToRevision, removedMultichunks, newChunkList, newMultichunks);
+                if (error) return error;
+                // The purged revisions' references were removed, and the UIDs are kept, so the counts are valid for the purged index
+                Helpers::indexFile.saveRefCounts(refCountsPath, Helpers::indexFile.getCurrentRevision(), File::Info(localIndexPath, true).size);
+
+                for (size_t i = 0; i < multichunksToRemove.getSize(); i++)
+                {
+                    FileFormat::Multichunk * mc = Helpers::indexFile.getMultichunk(multichunksToRemove[i]);
+                    if (mc) File::Info(chunkFolder + mc->getFileName(), true).remove();
+                }
+                Helpers::indexFile.close();
+            }
+            if (!callback.progressed(ProgressCallback::Purge, TRANS("... purge finished and saved in place ..."), 0, 0, 1, 1, ProgressCallback::FlushLine))
+                return TRANS("Error with output");
+
+            mcGuard.success();
+            return "";
+        }
+
+        // The multichunks of the purged revisions that are kept (not removed nor repacked) must be saved in the new index too, with their chunk list
+        for (uint32 rev = 1; rev <= upToRevision; rev++)
+        {
+            const FileFormat::Catalog * catalog = Helpers::indexFile.getCatalogForRevision(rev);
+            if (!catalog) continue; // Already purged
+            FileFormat::Offset mcOff = catalog->multichunks;
+            for (uint32 i = 0; i < catalog->multichunksCount; i++)
+            {
+                Utils::ScopePtr<FileFormat::Multichunk> mc = new FileFormat::Multichunk();
+                if (!mc) return TRANS("Out of memory for multichunk");
+                if (!Helpers::indexFile.Load(*mc, mcOff)) return TRANS("Error: Could not load multichunk");
+                mcOff.fileOffset(mcOff.fileOffset() + mc->getSize());
+                if (multichunksToRemove.indexOf(mc->UID) != multichunksToRemove.getSize() || newMultichunks.getValue(mc->UID)) continue;
+                // A reopened multichunk has a more recent record (and chunk list) in a later revision
+                const FileFormat::Multichunk * current = Helpers::indexFile.getMultichunk(mc->UID);
+                if (current) *mc = *current;
+
+                FileFormat::ChunkList * cl = Helpers::indexFile.getChunkList(mc->listID);
+                if (!cl) return TRANS("Errror: Could not find the list of chunks with ID: ") + mc->listID;
+                if (!newChunkList.storeValue(cl->UID, new FileFormat::ChunkList(*cl))) return TRANS("Error: Could not store the chunk list in new list");
+                if (!newMultichunks.storeValue(mc->UID, mc)) return TRANS("Error: Could not store the multichunk in new table");
+                mc.Forget();
+            }
+        }
 
         // In the new index file, the first revision will be 1 (and not revisionID + 1)
         // So, first add the chunks for the next revisions. Because we want to be smart, we'll only pack a single chunk array in the file for the first
         // revision, it'll then be a mix of the chunks used in the next revisions plus the actual revisionID+1's chunks
-        for (size_t i = 0; i < keepChunks.getSize(); i++)
+        // The chunks stored in the purged revisions are kept if they are still referenced (a compacted index stores all its chunks in the first revision)
+        for (uint32 rev = 1; rev <= upToRevision; rev++)
+        {
+            FileFormat::Chunks chunks;
+            const FileFormat::Catalog * catalog = Helpers::indexFile.getCatalogForRevision(rev);
+            if (!catalog) continue; // Already purged
+            if (!Helpers::indexFile.LoadRO(chunks, catalog->chunks))
+                return TRANS("Error while fetching chunks for revision: ") + rev;
+            for (size_t c = 0; c < chunks.chunks.getSize(); c++)
+            {
+                const uint32 chunkUID = chunks.chunks[c].UID;
+                if (!Helpers::indexFile.getChunkReferences(chunkUID)) continue;
+                // The chunk's multichunk might have changed if it was repacked
+                const FileFormat::Chunk * chunk = Helpers::indexFile.findChunk(chunkUID);
+                newIndex.appendChunk(const_cast<FileFormat::Chunk &>(*chunk), chunkUID); // We force the UID as we don't want to mutate all chunklists later on
+            }
+        }
+        // The chunk lists of the removed multichunks must not be copied from the kept revisions (the repacked ones are already in the new index)
+        FileFormat::UIDBitmap removedLists(Helpers::indexFile.allocateChunkListID());
+        for (size_t i = 0; i < multichunksToRemove.getSize(); i++)
         {
-            const uint32 chunkUID = keepChunks.getElementAtUncheckedPosition(i);
-            const FileFormat::Chunk * chunk = Helpers::indexFile.findChunk(chunkUID);
-            newIndex.appendChunk(const_cast<FileFormat::Chunk &>(*chunk), chunkUID); // We force the UID as we don't want to mutate all chunklists later on
+            const FileFormat::Multichunk * mc = Helpers::indexFile.getMultichunk(multichunksToRemove[i]);
+            if (mc) removedLists.set(mc->listID);
         }
+
         // Ok, let's append all remaining chunk for this revision
-        uint32 maxRev = Helpers::indexFile.getCurrentRevision() - upToRevision;
+        // The revisions that were purged in place are missing, so the kept ones are renumbered from 1
+        uint32 maxRev = 0, newRev = 0;
+        for (uint32 rev = upToRevision+1; rev <= Helpers::indexFile.getCurrentRevision(); rev++)
+            if (Helpers::indexFile.getCatalogForRevision(rev)) maxRev++;
+        if (!maxRev) return TRANS("Can't purge all the revisions of a backup");
         for (uint32 rev = upToRevision+1; rev <= Helpers::indexFile.getCurrentRevision(); rev++)
         {
             FileFormat::Chunks chunks;
             const FileFormat::Catalog * catalog = Helpers::indexFile.getCatalogForRevision(rev);
-            if (!catalog)
-                return TRANS("Error while fetching catalog for revision: ") + rev;
+            if (!catalog) continue; // Already purged in place
             if (!Helpers::indexFile.LoadRO(chunks, catalog->chunks))
                 return TRANS("Error while fetching chunks for revision: ") + rev;
-            // Chunks to save for this revision
+            newRev++;
+            // Chunks to save for this revision, their multichunk might have changed if it was repacked
             for (size_t c = 0; c < chunks.chunks.getSize(); c++)
-                newIndex.appendChunk(const_cast<FileFormat::Chunk &>(chunks.chunks[c]), chunks.chunks[c].UID);
+            {
+                const FileFormat::Chunk * chunk = Helpers::indexFile.findChunk(chunks.chunks[c].UID);
+                newIndex.appendChunk(const_cast<FileFormat::Chunk &>(chunk ? *chunk : chunks.chunks[c]), chunks.chunks[c].UID);
+            }
 
             // We need to copy the ChunkLists, Multichunks, Metadata, FileTree, FilterArgument
             // So copy the chunklists for this revision too
@@ -2517,10 +5603,11 @@ namespace Frost
                 Utils::ScopePtr<FileFormat::ChunkList> cl = new FileFormat::ChunkList();
                 if (!cl) return TRANS("Out of memory for chunklist");
                 if (!Helpers::indexFile.Load(*cl, clOff)) return TRANS("Error: Could not load chunk list");
+                clOff.fileOffset(clOff.fileOffset() + cl->getSize());
+                if (removedLists.isSet(cl->UID) || newIndex.getChunkList(cl->UID)) continue;
 
                 // Then save them in the new file
                 if (!newIndex.getChunkLists()->storeValue(cl->UID, cl)) return TRANS("Error: Could not store the chunk list in new list");
-                clOff.fileOffset(clOff.fileOffset() + cl->getSize());
                 cl.Forget();
             }
 
@@ -2530,7 +5617,7 @@ namespace Frost
             for (size_t i = 0; i < ft.items.getSize(); i++)
             {
                 uint32 clID = ft.items[i].getChunkListID();
-                if (!clID) continue;
+                if (!clID || newIndex.getChunkList(clID)) continue;
                 FileFormat::ChunkList * cl = Helpers::indexFile.getChunkList(clID);
                 if (!cl) return TRANS("Error: Could not find the chunk list for file: ") + ft.items[i].getBaseName();
 
@@ -2546,10 +5633,15 @@ namespace Frost
                 Utils::ScopePtr<FileFormat::Multichunk> mc = new FileFormat::Multichunk();
                 if (!mc) return TRANS("Out of memory for multichunk");
                 if (!Helpers::indexFile.Load(*mc, mcOff)) return TRANS("Error: Could not load multichunk");
+                mcOff.fileOffset(mcOff.fileOffset() + mc->getSize());
+                // The removed multichunks are dropped, and the repacked ones are already in the new index
+                if (multichunksToRemove.indexOf(mc->UID) != multichunksToRemove.getSize() || newIndex.getMultichunk(mc->UID)) continue;
+                // A reopened multichunk has a more recent record (and chunk list) in a later revision
+                const FileFormat::Multichunk * current = Helpers::indexFile.getMultichunk(mc->UID);
+                if (current) *mc = *current;
 
                 // Then save them in the new file
                 if (!newIndex.getMultichunks()->storeValue(mc->UID, mc)) return TRANS("Error: Could not store the multichunk in new table");
-                mcOff.fileOffset(mcOff.fileOffset() + mc->getSize());
                 mc.Forget();
             }
 
@@ -2562,12 +5654,12 @@ namespace Frost
             // Filter arguments should already be copied to the last index value
             
             // Finally save the file tree
-            Utils::OwnPtr<FileFormat::FileTree> newFT = newIndex.getFileTree(rev - upToRevision);
+            Utils::OwnPtr<FileFormat::FileTree> newFT = newIndex.getFileTree(newRev);
             if (!Helpers::indexFile.Load(*newFT, catalog->fileTree)) TRANS("Error: Could not load the file tree for revision: ") + rev;
             // Fix the file tree revision too
-            newFT->revision = rev - upToRevision; // We are shifting the revision number here, so we must account for it
+            newFT->revision = newRev; // We are shifting the revision number here, so we must account for it
 
-            if (!callback.progressed(ProgressCallback::Purge, TRANS("... done saving of revision ..."), 0, 0, (uint32)rev - upToRevision, maxRev, ProgressCallback::FlushLine))
+            if (!callback.progressed(ProgressCallback::Purge, TRANS("... done saving of revision ..."), 0, 0, newRev, maxRev, ProgressCallback::FlushLine))
                 return TRANS("Error with output");
 
             // Ok, let's save this revision back to the nex index file
@@ -2577,7 +5669,7 @@ namespace Frost
             error = newIndex.readFile(tempIndexPath, true);
             if (error) return error;
             // Start a new revision in this file
-            if (!newIndex.startNewRevision(rev - upToRevision + 1)) return TRANS("Could not start new revision :") + (rev - upToRevision + 1);
+            if (!newIndex.startNewRevision(newRev + 1)) return TRANS("Could not start new revision :") + (newRev + 1);
         }
 
         newIndex.backupWasEmpty();
@@ -2587,6 +5679,9 @@ namespace Frost
         // Great, it should be finished by now, let's remove the initial index file, and useless multichunks
         if (dumpLevel < 2)
         {
+            // The purged revisions' references were removed, and the chunks and chunk lists UID are kept, so the counts are valid for the new index
+            Helpers::indexFile.saveRefCounts(refCountsPath, maxRev, File::Info(tempIndexPath, true).size);
+
             for (size_t i = 0; i < multichunksToRemove.getSize(); i++)
             {
                 uint16 mcID = multichunksToRemove[i];
@@ -2594,7 +5689,7 @@ namespace Frost
                 if (mc) File::Info(chunkFolder + mc->getFileName(), true).remove();
             }
             Helpers::indexFile.close();
-            File::Info(tempIndexPath, true).moveTo(chunkFolder + DEFAULT_INDEX);
+            File::Info(tempIndexPath, true).moveTo(indexPath);
         }
 
         if (!callback.progressed(ProgressCallback::Purge, TRANS("... purge finished and saved ..."), 0, 0, maxRev, maxRev, ProgressCallback::FlushLine))
@@ -2604,9 +5699,69 @@ namespace Frost
         return "";
     }
 
+    // Compact the index file
+    String compactIndex(ProgressCallback & callback)
+    {
+        const String indexPath = DatabaseModel::databaseURL + DEFAULT_INDEX, tempIndexPath = DatabaseModel::databaseURL + "__compactIndex.frost";
+        const String refCountsPath = FileFormat::IndexFile::getRefCountsPath(indexPath);
+        const uint32 revision = Helpers::indexFile.getCurrentRevision();
+        if (!callback.progressed(ProgressCallback::Compact, TRANS("...compacting..."), 0, 1, 0, 1, ProgressCallback::KeepLine))
+            return TRANS("Error with output");
+
+        // A previous compaction might have been interrupted
+        File::Info(tempIndexPath, true).remove();
+        String error = Helpers::indexFile.compact(tempIndexPath);
+        if (error) { File::Info(tempIndexPath, true).remove(); return error; }
+
+        // The chunks and chunk lists UID are kept, so the reference counts are still valid for the compacted index
+        const uint64 initialSize = File::Info(indexPath, true).size, finalSize = File::Info(tempIndexPath, true).size;
+        if (Helpers::indexFile.loadRefCounts(refCountsPath))
+            Helpers::indexFile.saveRefCounts(refCountsPath, revision, finalSize);
+        Helpers::indexFile.close();
+        if (!File::Info(tempIndexPath, true).moveTo(indexPath)) return TRANS("Could not replace the index file with the compacted one: ") + indexPath;
+
+        if (!callback.progressed(ProgressCallback::Compact, String::Print(TRANS("... index compacted from %llu to %llu bytes ..."), initialSize, finalSize), 0, 0, 1, 1, ProgressCallback::FlushLine))
+            return TRANS("Error with output");
+        return "";
+    }
+
 
 
     // Restore a backup to the given folder
+    /** Scan the restore folder in a background thread, while the backup is restored */
+    struct RestoreFolderScanner : public Threading::Thread
+    {
+        const String &          folder;
+        /** The path to scan in the folder */
+        const String            path;
+        /** The files found in the restore folder */
+        File::FileItemArray     files;
+
+        /** List all the entries, including the hidden ones (unlike the default iterators), so stale dotfiles are found too */
+        struct AllEntriesIterator : public File::Scanner::EntryIterator
+        {
+            bool getNextFile(File::DirectoryIterator & dir, File::Info & file, const String & name)
+            {
+                while (dir.getNextFilePath(file))
+                    if (file.name != "." && file.name != "..") return true;
+                return false;
+            }
+            AllEntriesIterator() : File::Scanner::EntryIterator(true) {}
+        };
+
+        uint32 runThread() { scan(); return 0; }
+        void scan()
+        {
+            AllEntriesIterator iterator;
+            File::Scanner::scanFolderGeneric(folder, path, files, iterator, true); // If it fails, we don't care
+        }
+        /** Wait for the scan to complete */
+        void wait() { destroyThread(); }
+
+        RestoreFolderScanner(const String & folder, const String & path) : folder(folder), path(path ? path : String(PathSeparator)) {}
+        ~RestoreFolderScanner() { destroyThread(); }
+    };
+
     String restoreBackup(const String & folderToRestore, const String & restoreFrom, const unsigned int revisionID, ProgressCallback & callback, const size_t maxCacheSize)
     {
         // The complete logic is here
@@ -2618,6 +5773,7 @@ namespace Frost
         String * overwrite = optionsMap["overwrite"];
         if (overwrite && *overwrite == "yes") overwritePolicy = Yes;
         if (overwrite && *overwrite == "update") overwritePolicy = Update;
+        if (overwrite && *overwrite == "delta") overwritePolicy = Delta;
 
 
         // We start by creating the directories
@@ -2625,9 +5781,27 @@ namespace Frost
                                    .getFullPath().normalizedPath(Platform::Separator, false);
 
         // We have to count the directories and file to restore, in order to display meaningful statistics
-        PathIDMapT fileList;
-        if (!createFileListInRev(fileList, revisionID))
+        Utils::OwnPtr<FileFormat::FileTree> fileTree = Helpers::indexFile.getFileTree(revisionID);
+        if (!fileTree)
             return TRANS("Can not get any file or directory from this revision");
+        // Only the requested subtree is listed
+        IndexArray items;
+        if (!collectSubtreeItems(*fileTree, Helpers::restoreSubtree, items))
+            return TRANS("Path not found in this revision (use --filelist to get a list of available files): ") + Helpers::restoreSubtree;
+
+        PathIDMapT fileList;
+        Strings::StringArray dirs;
+        for (size_t i = 0; i < items.getSize(); i++)
+        {
+            const String & path = fileTree->getItemFullPath(items[i]);
+            const String & metadata = fileTree->items[items[i]].getMetaData();
+            fileList.storeValue(path, new FileMDEntry(items[i], metadata), true);
+            File::Info a;
+            if (a.analyzeMetaData(metadata) && a.isDir()) dirs.Append(path);
+        }
+        // Parent directories must be created first
+        Strings::CompareString cmp;
+        Container::Algorithms<Strings::StringArray>::sortContainer(dirs, cmp);
 
         uint32 total = (uint32)fileList.getSize(), current = 0;
         String lastPath = "*";
@@ -2636,12 +5810,11 @@ namespace Frost
         // Compute a list of files in the restoring folder, as we might need to remove them later on
         if (!callback.progressed(ProgressCallback::Restore, TRANS("...analysing restore folder..."), 0, 1, 0, 1, ProgressCallback::KeepLine))
             return TRANS("Error in output");
+        // This is done while restoring. The files created meanwhile are in the backup, so they are never removed
+        RestoreFolderScanner scanner(folderTrimmed, Helpers::restoreSubtree);
+        if (!scanner.createThread()) scanner.scan();
 
         // Need to create all required directories first
-        Strings::StringArray dirs;
-        if (!createDirListInRev(dirs, revisionID))
-            return TRANS("Can not get the directory list from this revision");
-
         String errorMessage;
 
         for (size_t i = 0; i < dirs.getSize(); i++)
@@ -2654,25 +5827,16 @@ namespace Frost
                 return errorMessage;
             ++current;
         }
-
-        File::FileItemArray files;
-        File::Scanner::FileFilters filters;
-        File::Scanner::scanFolderFilename(folderTrimmed, "/", files, filters, true); // If it fails, we don't care
-
+#ifdef _POSIX
+        // Plan the files content while walking the file list, so each multichunk is only decoded once
+        restore.enablePlanning();
+#endif
 
         PathIDMapT::IterT iter = fileList.getFirstIterator();
         while (iter.isValid())
         {
             lastPath = *iter.getKey();
             File::Info dir(folderTrimmed + lastPath);
-
-            // Remove the file from the current file list if found (this is O(N) search here, could be faster if sorting the array)
-            for (size_t i = 0; i < files.getSize(); i++)
-                if (files[i].name == lastPath)
-                {
-                    files.Remove(i); break;
-                }
-
             if (dir.isDir()) { ++iter; continue; }
 
             // Show the list of directories to restore
@@ -2685,11 +5849,19 @@ namespace Frost
             ++current;
             ++iter;
         };
+#ifdef _POSIX
+        errorMessage = restore.runPlan();
+        if (errorMessage) return errorMessage;
+#endif
 
-        // All files that remains in the file array should be deleted now as they are not in backup
+        // All files in the restore folder that are not in the backup should be deleted now
+        scanner.wait();
+        const File::FileItemArray & files = scanner.files;
+        // The scan only lists the files (not the directories), so the stale directories themselves are kept
         for (size_t i = 0; i < files.getSize(); i++)
         {
-            lastPath = folderTrimmed + files[i].name;
+            if (fileList.getValue(files[i].name)) continue;
+            lastPath = files[i].name;
             if (restore.removeFile(lastPath, errorMessage, current, total) < 0)
                 return errorMessage;
         }
@@ -2704,22 +5876,22 @@ namespace Frost
         if (!callback.progressed(ProgressCallback::Restore, TRANS("...analysing backup..."), 0, 1, 0, 1, ProgressCallback::KeepLine))
             return TRANS("Error in output");
 
-        // We have to count the directories and file to restore, in order to display meaningful statistics
-        PathIDMapT fileList;
-        if (!createFileListInRev(fileList, revisionID))
+        // Only search the file in the tree, there's no need to list the whole revision
+        Utils::OwnPtr<FileFormat::FileTree> fileTree = Helpers::indexFile.getFileTree(revisionID);
+        if (!fileTree)
             return TRANS("Can not get any file or directory from this revision");
 
-        FileMDEntry * entry = fileList.getValue(fileToRestore);
-        if (!entry) return TRANS("File path not found to restore (use --filelist to get a list of available files)");
+        const uint32 index = fileToRestore ? fileTree->findItem(fileToRestore) : fileTree->notFound();
+        if (index == fileTree->notFound()) return TRANS("File path not found to restore (use --filelist to get a list of available files)");
+        FileFormat::FileTree::Item * item = fileTree->getItem(index);
         // Check if it's a regular file (we can only extract regular files with this command)
         File::Info entryMD;
-        entryMD.analyzeMetaData(entry->getMetaData());
+        entryMD.analyzeMetaData(item->getMetaData());
         if (!entryMD.isFile()) return TRANS("This file path does not refer to a file. Only files could be extracted this way");
 
         String baseFolder = "";
         RestoreFile restore(callback, baseFolder, restoreFrom, No, maxCacheSize, revisionID);
         String errorMsg;
-        FileFormat::FileTree::Item * item = Helpers::indexFile.getFileTree(revisionID)->getItem((unsigned int)*entry); // Call uint operator
         int ret = restore.restoreSingleFile(Stream::StdOutStream::getInstance(), errorMsg, item->getChunkListID(), fileToRestore, entryMD.size);
         if (ret < 0) return errorMsg;
 
@@ -2751,6 +5923,7 @@ int showHelpMessage(const Frost::String & error = "")
            "  Actions:\n"
            "\t--restore dir [rev]\tRestore the revision (default: last) to the given directory (either backup or restore mode is supported)\n"
            "\t--backup dir\t\tBackup the given directory (either backup or restore mode is supported)\n"
+           "\t--watch dir\t\tWatch the given directory and record its changes in a journal next to the index, so the next backups of this directory only check the changed entries (Linux only, stop with Ctrl+C)\n"
            "\t--purge [rev]\t\tPurge the given remote backup directory up to the given revision number (use --list to find out)\n"
            "\t--list [range]\t\tList the current backup in the specified index (required) and time range in UTC (in the form 'YYYYMMDDHHmmSS YYYYMMDDHHmmSS')\n"
            "\t--filelist [range]\tList the current backup in the specified index (required) and time range in UTC, including the file list in this revision\n"
@@ -2758,6 +5931,8 @@ int showHelpMessage(const Frost::String & error = "")
            "\t--test [name]\t\tRun the test with the given name -developer only- use -v for more verbose mode, 'help' to get a list of available tests\n"
            "\t--password pw\t\tSet the password so it's not queried on the terminal. Avoid this if launched from prompt as it'll end in your bash's history\n"
            "\t--dump\t\t\tDump the object content for the specified index (required). This is a kind of index file check done manually ;-)\n"
+           "\t--compact\t\tRewrite the specified index (required) so all revisions share a single chunk array, chunk list and multichunk table. Opening a\n"
+           "\t         \t\tcompacted index is fast whatever the number of revisions, and the space left unused by in place purges is reclaimed\n"
            "\t--decryptindex\t\tDecrypt the specified ciphered index (required). This is required if your local copy is missing\n"
            "\t--help [security]\tGet help on the security features and advices of Frost\n"
            "  Required parameters for backup, purge and restore:\n"
@@ -2766,19 +5941,31 @@ int showHelpMessage(const Frost::String & error = "")
            "\t--keyvault file\t\tPath to a file containing the private key used to decrypt/encrypt the backup data. Default to '" DEFAULT_KEYVAULT "'. If the key does not exist, it'll be created\n"
            "\t--keyid id\t\tThe key identifier if storing multiple keys in the key vault.\n"
            "  Optional parameters for backup and restore:\n"
+           "\t--resume\t\tResume an interrupted backup from its last checkpoint, the files that were already stored are not read again (backup only)\n"
+           "\t--checkpoint [secs]\tThe interval in seconds between the checkpoints of the backup in progress, saved next to the index (default is 600, 0 to disable) - backup only\n"
            "\t--safeindex\t\tEnable ciphering the index file and store it in the remote folder too (backup only), --index is required for the clear index file path\n"
            "\t--verbose\t\tEnable verbosity (use -vv for VERY verbose mode)\n"
            "\t--cache [size]\t\tThe cache size (possible suffix: K,M,G) holding the decoded multichunks (default is 64M) - restore only\n"
-           "\t--overwrite [policy]\tThe policy for overwriting/deleting files on the restore folder if they exists (either 'yes', 'no', 'update')\n"
+           "\t--prefetch [size]\tThe memory budget (possible suffix: K,M,G) for the multichunks decoded ahead of time while restoring, on top of the cache (default is 32M, 0 to disable) - restore only\n"
+           "\t--overwrite [policy]\tThe policy for overwriting/deleting files on the restore folder if they exists (either 'yes', 'no', 'update', 'delta')\n"
+           "\t                     \tWith 'delta', files are overwritten in place and only the chunks that differ from the backup are decoded and written\n"
+           "\t--subtree path      \tOnly restore the given file or directory (with its content) from the backup, its parent directories are created too - restore only\n"
            "\t--multichunk [size]\tWhile backing up, files are cut in variable sized chunk, and these chunks are concat in multichunk files saved on the target (default is 250K, possible suffix: K,M,G)\n"
            "\t                     \tIf you have a large amount of data to backup, a bigger number will create less files in the backup directory, the downside being that purging will take more time\n"
            "\t                     \tIf you backup often, and purge at regular interval, the default should allow fast restoring and purging\n"
            "\t--compression [bsc]\tYou can change the compression library to use (default is zlib). Using 'bsc' is faster than LZMA and gives better compression ratio.\n"
            "\t                     \tHowever, 'bsc' also changes the multichunk size to 25MB.\n"
+           "\t--framed             \tCompress the multichunks in independently decodable frames (of 256KB) with an encrypted frame table, so restoring or mounting\n"
+           "\t                     \tonly needs to decode the frame containing a chunk instead of the whole multichunk. This is most useful with large multichunks - backup only\n"
            "\t--strategy [mode]    \tThe purging strategy. By default 'fast', when purging from previous revision, a new index file is created that's built from the cleaned index.\n"
            "\t                     \tHowever, multichunks are not rebuild to remove lost chunks. When using 'slow', multichunks are rebuilt too to remove lost chunks. This incurs reading\n"
            "\t                     \tand writing many multichunk (which might not be desirable if storage is remote). If you enter a value x between 0 (slow) and 100 (fast), the multichunk will be\n"
            "\t                     \tscanned and only get processed/cleaned if the number of chunks to remove is higher than x%% from the number of chunks in the multichunks.\n"
+           "\t--inplace            \tPurge without rewriting the index file: the kept revisions are appended again to the index on top of what's still used from the purged\n"
+           "\t                     \trevisions, so purging a few revisions of a large backup is fast. The revisions keep their number, and the purged ones are left unused\n"
+           "\t                     \tin the index file - purge only\n"
+           "\t--coalesce           \tAlso merge the multichunks that are less than half full (like the ones saved by frequent small backups) into full size multichunks.\n"
+           "\t                     \tThe revision to purge can be omitted to only merge them - purge only\n"
            "\t--exclude list.exc \tYou can specify a file containing the exclusion list for backup. This file is read line-by-line (one rule per line)\n"
            "\t                     \tIf a line starts by 'r/' the exclusion rule is considered as a regular expression otherwise the rule is matched if the analyzed file path contains the rule.\n"
            "\t                     \tThis also means that if you need to exclude a file whose name starts by 'r/', you need to write 'r/r/'.\n"
@@ -2901,6 +6088,46 @@ int showRegExMessage()
     return EXIT_SUCCESS;
 }
 
+// Check the saved reference counts match the ones rebuilt from all the revisions
+static Frost::String checkRefCounts()
+{
+    Frost::FileFormat::IndexFile & index = Frost::Helpers::indexFile;
+    if (!index.loadRefCounts(Frost::FileFormat::IndexFile::getRefCountsPath(Frost::DatabaseModel::databaseURL + DEFAULT_INDEX)))
+        return "The reference counts file is missing or does not match the index";
+
+    Container::PlainOldData<uint32>::Array lists, chunks;
+    for (uint32 uid = 0; uid < index.allocateChunkListID(); uid++) lists.Append(index.getChunkListReferences(uid));
+    for (uint32 uid = 0; uid < index.allocateChunkID(); uid++) chunks.Append(index.getChunkReferences(uid));
+    index.rebuildRefCounts();
+    for (uint32 uid = 0; uid < index.allocateChunkListID(); uid++)
+        if (lists[uid] != index.getChunkListReferences(uid))
+            return Frost::String::Print("Chunk list %u is referenced %u times, but %u times in the saved counts", uid, index.getChunkListReferences(uid), lists[uid]);
+    for (uint32 uid = 0; uid < index.allocateChunkID(); uid++)
+        if (chunks[uid] != index.getChunkReferences(uid))
+            return Frost::String::Print("Chunk %u is referenced %u times, but %u times in the saved counts", uid, index.getChunkReferences(uid), chunks[uid]);
+    return "";
+}
+
+// Count the multichunks used by the current index
+static unsigned int countMultichunks()
+{
+    unsigned int count = 0;
+    for (uint32 id = 1; id <= Frost::Helpers::indexFile.lastMultichunkID(); id++)
+        if (Frost::Helpers::indexFile.getMultichunk((uint16)id)) count++;
+    return count;
+}
+
+// Restore the given revision in an empty folder and compare it with the given source folder
+static Frost::String checkRestoredRevision(const unsigned int revision, const char * sourceFolder, Frost::ProgressCallback & callback)
+{
+    File::Info("./testRestore/").remove();
+    if (!File::Info("./testRestore/").makeDir()) return "Failed creating the restoring folder ./testRestore/";
+    Frost::String result = Frost::restoreBackup("./testRestore/", "./testBackup/", revision, callback);
+    if (result) return result;
+    system(Frost::String("diff -ur ") + sourceFolder + " testRestore > diffOutput.txt 2>&1");
+    return File::Info("diffOutput.txt").getContent();
+}
+
 int checkTests(Strings::StringArray & options)
 {
     // Check for test mode
@@ -2920,7 +6147,7 @@ int checkTests(Strings::StringArray & options)
             printf(TRANS("Current version: %d. \n\nTest mode help:\n"
                    "\tkey\t\tTest cryptographic system, by creating a new vault, and master key, and reading it back\n"
                    "\troundtrip\tTest a complete roundtrip backup and restore, of fake created file, with specific attributes\n"
-                   "\tpurge\t\tTest an update to a previous roundtrip test, and purging the initial revision\n"
+                   "\tpurge\t\tTest two updates to a previous roundtrip test, purging the initial revision in place, compacting, coalescing, then purging the second one\n"
                    "\tfs\t\tTest some simple filesystem operations (independant from any other tests)\n"
                    "\tcomp\t\tTest compression and decompression engine for pseudo random input (independant from any other tests) (use compf if it fails, to reproduce same condition)\n"
                    "\tentropy file\tCompute the entropy for the given file and display it (reported chunk entropy is only data based, multichunk entropy includes chunk headers)\n"),
@@ -2981,6 +6208,31 @@ int checkTests(Strings::StringArray & options)
                     ERR("Can't create a subdirectory\n");
                 if (!File::Info("./test/subDir/hardLink.txt").createAsLinkTo("./test/fileWithPerms.txt", true))
                     ERR("Can't create a hard link to the permission file\n");
+                // Hard linked pairs with the same content as another (unlinked) file, the links must still be restored as links
+                // whatever is restored first (the restore order depends on the paths hash, so there are a few pairs)
+                for (int i = 0; i < 8; i++)
+                {
+                    const Frost::String sameContent = Frost::String::Print("This file content is shared by the hard linked pair %d and an independent copy", i);
+                    const Frost::String copyName = Frost::String::Print("copy%d.txt", i), linkName = Frost::String::Print("linked%d.txt", i);
+                    if (!File::Info("./test/" + copyName).setContent(sameContent) || !File::Info("./test/" + linkName).setContent(sameContent))
+                        ERR("Can't create the files with the same content in the test directory\n");
+                    if (!File::Info("./test/subDir/" + linkName).createAsLinkTo("./test/" + linkName, true))
+                        ERR("Can't create a hard link to the linked file\n");
+                }
+#ifdef _POSIX
+                // A sparse file starting with a hole, with a hole in the middle and a trailing hole
+                {
+                    int fd = ::open("./test/sparseFile.bin", O_WRONLY | O_CREAT | O_TRUNC, 0644);
+                    if (fd < 0) ERR("Can't create the sparse file in the test directory\n");
+                    uint8 randomData[64 * 1024];
+                    Random::fillBlock(randomData, ArrSz(randomData));
+                    bool written = pwrite(fd, randomData, sizeof(randomData), 1024 * 1024) == (ssize_t)sizeof(randomData)
+                                && pwrite(fd, randomData, 16 * 1024, 3 * 1024 * 1024) == 16 * 1024
+                                && ftruncate(fd, 5 * 1024 * 1024) == 0;
+                    ::close(fd);
+                    if (!written) ERR("Can't fill the sparse file in the test directory\n");
+                }
+#endif
 
                 // Test a big file (32MB) with some redundancy to check for deduplication
                 Stream::OutputFileStream stream("./test/bigFile.bin");
@@ -3056,9 +6308,129 @@ int checkTests(Strings::StringArray & options)
             Frost::String output = File::Info("diffOutput.txt").getContent();
             if (output.getLength())
                 ERR("Comparing failed: %s\n", (const char*)output);
+#ifdef _POSIX
+            // Check the hard links were restored as links, and the identical files as independent files
+            for (int i = 0; i < 8; i++)
+            {
+                const Frost::String copyName = Frost::String::Print("copy%d.txt", i), linkName = Frost::String::Print("linked%d.txt", i);
+                struct stat linked, otherLink, copy;
+                if (::stat("./testRestore/" + linkName, &linked) || ::stat("./testRestore/subDir/" + linkName, &otherLink) || ::stat("./testRestore/" + copyName, &copy))
+                    ERR("Can't find the restored linked files\n");
+                if (linked.st_ino != otherLink.st_ino || linked.st_nlink != 2)
+                    ERR("The hard links were not restored as links: %s\n", (const char*)linkName);
+                if (copy.st_ino == linked.st_ino || copy.st_nlink != 1)
+                    ERR("The file with the same content as the hard links was restored as a link: %s\n", (const char*)copyName);
+            }
+            // Check the holes of the sparse file were restored as holes
+            struct stat sparse;
+            if (::stat("./testRestore/sparseFile.bin", &sparse) || sparse.st_size != 5 * 1024 * 1024)
+                ERR("Can't find the restored sparse file\n");
+            if ((uint64)sparse.st_blocks * 512 >= (uint64)sparse.st_size / 2)
+                ERR("The sparse file was not restored with holes (%u bytes allocated)\n", (unsigned)(sparse.st_blocks * 512));
+
+            // Partially modify the restored tree, and restore again over it, only rewriting what differs
+            {
+                int fd = ::open("./testRestore/bigFile.bin", O_WRONLY);
+                uint8 randomData[4096];
+                Random::fillBlock(randomData, ArrSz(randomData));
+                if (fd < 0 || pwrite(fd, randomData, sizeof(randomData), 5 * 1024 * 1024 + 123) != (ssize_t)sizeof(randomData))
+                    ERR("Can't modify the restored big file\n");
+                ::close(fd);
+                if (truncate("./testRestore/smallFile.txt", 100) != 0)
+                    ERR("Can't truncate the restored small file\n");
+                fd = ::open("./testRestore/RomeoAndJulietS2.txt", O_WRONLY | O_APPEND);
+                if (fd < 0 || ::write(fd, randomData, 100) != 100)
+                    ERR("Can't append to a restored file\n");
+                ::close(fd);
+            }
+            if (!File::Info("./testRestore/basicFile.txt").remove() || !File::Info("./testRestore/staleFile.txt").setContent("This file is not in the backup"))
+                ERR("Can't modify the restored tree\n");
+            optionsMap.storeValue("overwrite", new Frost::String("delta"), true);
+            result = Frost::restoreBackup("./testRestore/", "./testBackup/", revisionID, console);
+            optionsMap.removeValue("overwrite");
+            if (result) ERR("Can't restore the backup over the modified tree: %s\n", (const char*)result);
+            system("diff -ur test testRestore > diffOutput.txt 2>&1");
+            output = File::Info("diffOutput.txt").getContent();
+            if (output.getLength())
+                ERR("Comparing the tree restored over a modified tree failed: %s\n", (const char*)output);
+#endif
 
             // Finalize the database
             Frost::finalizeDatabase();
+#ifdef _POSIX
+            {
+                // Check a backup replayed from the change journal, when only one link of a hard linked pair was written (in its own backup set)
+                File::Info("./testJournal/").remove();
+                File::Info("./testJournalBackup/").remove();
+                File::Info("./testJournalRestore/").remove();
+                if (!File::Info("./testJournal/subDir/").makeDir(true) || !File::Info("./testJournalBackup/").makeDir() || !File::Info("./testJournalRestore/").makeDir())
+                    ERR("Failed creating the journal test folders\n");
+                // The restore order depends on the paths hash, and the first restored link gives the content of the other, so there are a few pairs
+                for (int i = 0; i < 8; i++)
+                {
+                    const Frost::String linkName = Frost::String::Print("linked%d.txt", i);
+                    if (!File::Info("./testJournal/" + linkName).setContent(Frost::String::Print("This is the content of the hard linked pair %d before the change", i))
+                        || !File::Info("./testJournal/subDir/" + linkName).createAsLinkTo("./testJournal/" + linkName, true))
+                        ERR("Can't create the linked files in the journal test directory\n");
+                }
+                if (!File::Info("./testJournal/other.txt").setContent("This file is not modified"))
+                    ERR("Can't create the files in the journal test directory\n");
+
+                File::Info("./testJournalBackup/keyVault").remove();
+                result = Frost::getKeyFactory().createMasterKeyForFileVault(cipheredMasterKey, "./testJournalBackup/keyVault", "password");
+                if (result) ERR("Creating the master key failed: %s\n", (const char*)result);
+                Frost::DatabaseModel::databaseURL = "./testJournalBackup/";
+                revisionID = 0;
+                result = Frost::initializeDatabase("testJournal/", revisionID, cipheredMasterKey);
+                if (result) ERR("Creating the database failed: %s\n", (const char*)result);
+                result = Frost::backupFolder("testJournal/", "./testJournalBackup/", revisionID, console);
+                if (result) ERR("Can't backup the journal test folder: %s\n", (const char*)result);
+                Frost::finalizeDatabase();
+
+                // Pretend a watcher is running, and it recorded a change for the written links only
+                const Frost::String journalPath = "./testJournalBackup/journal.frost", folderPath = File::Info("testJournal/", true).getRealFullPath();
+                int lockFd = ::open(Frost::ChangeJournal::getLockPath(journalPath), O_RDWR | O_CREAT, 0600);
+                if (lockFd < 0 || flock(lockFd, LOCK_EX) != 0 || ::write(lockFd, (const char*)folderPath, folderPath.getLength()) != (ssize_t)folderPath.getLength())
+                    ERR("Can't create the journal lock file\n");
+                Frost::String records = "R \n";
+                for (int i = 0; i < 8; i++)
+                {   // The files are modified in place, so both links see the change, but it's written through one link only
+                    const Frost::String writtenPath = Frost::String::Print(i & 1 ? "/subDir/linked%d.txt" : "/linked%d.txt", i);
+                    const Frost::String newContent = Frost::String::Print("This is the content of the hard linked pair %d after the change, it is a bit longer", i);
+                    int fd = ::open("./testJournal" + writtenPath, O_WRONLY | O_TRUNC);
+                    if (fd < 0 || ::write(fd, (const char*)newContent, newContent.getLength()) != (ssize_t)newContent.getLength())
+                        ERR("Can't modify the hard linked file\n");
+                    ::close(fd);
+                    records += "C " + writtenPath + "\n";
+                }
+                if (!File::Info(journalPath).setContent(records))
+                    ERR("Can't write the journal\n");
+
+                result = Frost::initializeDatabase("testJournal/", revisionID, cipheredMasterKey);
+                if (result) ERR("Can't open the database: %s\n", (const char*)result);
+                result = Frost::getKeyFactory().loadPrivateKey("./testJournalBackup/keyVault", cipheredMasterKey, "password");
+                if (result) ERR("Reading back the master key failed: %s\n", (const char*)result);
+                result = Frost::backupFolder("testJournal/", "./testJournalBackup/", revisionID, console, Frost::Fast, journalPath);
+                if (result) ERR("Can't backup the journal test folder with the journal: %s\n", (const char*)result);
+                Frost::ChangeJournal::commit(journalPath);
+                Frost::finalizeDatabase();
+                ::close(lockFd);
+
+                result = Frost::initializeDatabase("", revisionID, cipheredMasterKey);
+                if (result) ERR("Can't re-open the database: %s\n", (const char*)result);
+                if (revisionID != 2) ERR("Unexpected revision for the journal test: %u\n", revisionID);
+                result = Frost::getKeyFactory().loadPrivateKey("./testJournalBackup/keyVault", cipheredMasterKey, "password");
+                if (result) ERR("Reading back the master key failed: %s\n", (const char*)result);
+                result = Frost::restoreBackup("./testJournalRestore/", "./testJournalBackup/", revisionID, console);
+                if (result) ERR("Can't restore the journal test backup: %s\n", (const char*)result);
+
+                system("diff -ur testJournal testJournalRestore > diffOutput.txt 2>&1");
+                output = File::Info("diffOutput.txt").getContent();
+                if (output.getLength())
+                    ERR("Comparing the backup replayed from the journal failed: %s\n", (const char*)output);
+                Frost::finalizeDatabase();
+            }
+#endif
             fprintf(stderr, "Success\n");
             return EXIT_SUCCESS;
         }
@@ -3066,6 +6438,7 @@ int checkTests(Strings::StringArray & options)
         {
             // Delete a big file to figure out what happens to the final directory
             File::Info("./test/bigFile.bin").remove();
+            File::Info("./test/smallNewFile.txt").setContent("This file is saved in a small multichunk, that's reopened by the next backup");
             // Then backup, and purge the remaning
             unsigned int revisionID = 0;
             Frost::ConsoleProgressCallback console;
@@ -3097,14 +6470,106 @@ int checkTests(Strings::StringArray & options)
             Frost::finalizeDatabase();
             result = Frost::initializeDatabase("", revisionID, cipheredMasterKey);
             if (Frost::listBackups() != 2) ERR("This test needs to be run after a roundtrip test\n");
+            result = checkRefCounts();
+            if (result) ERR("Invalid reference counts after the backup: %s\n", (const char*)result);
+            Frost::finalizeDatabase();
 
-            // Then purge the database from the last revision
+            // Keep a copy of this revision's source, and modify it again for a third revision
+            File::Info("./testPurgeRev2/").remove();
+            system("cp -a test testPurgeRev2");
+            if (!File::Info("./test/RomeoAndJulietS2.txt").remove() || !File::Info("./test/purgeFile.txt").setContent("This file was added after the second revision"))
+                ERR("Can't modify the test folder\n");
+            result = Frost::initializeDatabase("test/", revisionID, cipheredMasterKey);
+            if (result) ERR("Reopening the database failed: %s\n", (const char*)result);
+            // The slow strategy reopens the small multichunk of the previous revision, so its record is replaced by this revision
+            result = Frost::backupFolder("test/", "./testBackup/", revisionID, console, Frost::Slow);
+            if (result) ERR("Can't backup the modified test folder: %s\n", (const char*)result);
             Frost::finalizeDatabase();
+
+            // Purge the initial revision in place, and check the kept revisions are still restored as they were
             result = Frost::initializeDatabase("", revisionID, cipheredMasterKey);
+            if (result) ERR("Reopening the database failed: %s\n", (const char*)result);
+            Frost::Helpers::purgeInPlace = true;
             result = Frost::purgeBackup("./testBackup/", console, Frost::Slow, 1);
-            if (result) ERR("Can't purge the last backup: %s\n", (const char*)result);
+            Frost::Helpers::purgeInPlace = false;
+            if (result) ERR("Can't purge the initial revision in place: %s\n", (const char*)result);
+
+            Frost::finalizeDatabase();
+            result = Frost::initializeDatabase("", revisionID, cipheredMasterKey);
+            if (result) ERR("Reopening the purged database failed: %s\n", (const char*)result);
+            if (Frost::listBackups() != 2) ERR("The purged database does not have the 2 kept revisions\n");
+            result = checkRefCounts();
+            if (result) ERR("Invalid reference counts after the in place purge: %s\n", (const char*)result);
+            result = checkRestoredRevision(2, "testPurgeRev2", console);
+            if (result) ERR("Restoring the second revision after the in place purge failed: %s\n", (const char*)result);
+            result = checkRestoredRevision(3, "test", console);
+            if (result) ERR("Restoring the last revision after the in place purge failed: %s\n", (const char*)result);
+
+            // Compact the index, reclaiming the space left unused by the in place purge, and check again
+            const uint64 purgedSize = File::Info("./testBackup/" DEFAULT_INDEX).size;
+            result = Frost::compactIndex(console);
+            if (result) ERR("Can't compact the index: %s\n", (const char*)result);
+            Frost::finalizeDatabase();
+            if (File::Info("./testBackup/" DEFAULT_INDEX).size >= purgedSize) ERR("The compacted index is not smaller than the purged index\n");
+            result = Frost::initializeDatabase("", revisionID, cipheredMasterKey);
+            if (result) ERR("Reopening the compacted database failed: %s\n", (const char*)result);
+            if (Frost::listBackups() != 2) ERR("The compacted database does not have the 2 kept revisions\n");
+            result = checkRefCounts();
+            if (result) ERR("Invalid reference counts after compacting: %s\n", (const char*)result);
+            result = checkRestoredRevision(2, "testPurgeRev2", console);
+            if (result) ERR("Restoring the second revision after compacting failed: %s\n", (const char*)result);
+            result = checkRestoredRevision(3, "test", console);
+            if (result) ERR("Restoring the last revision after compacting failed: %s\n", (const char*)result);
+            {
+                // The compacted index is what's decrypted from its ciphered copy
+                Frost::KeyFactory::KeyT key;
+                Frost::derivePassword(key, "password");
+                result = Frost::Helpers::encryptIndexFile("./testBackup/" DEFAULT_INDEX ".aes", "./testBackup/" DEFAULT_INDEX, key, console);
+                if (!result) result = Frost::Helpers::ensureValidIndexFile("./testBackup/" DEFAULT_INDEX ".aes", "./testRestore/" DEFAULT_INDEX, key, console, true);
+                memset(key, 0, ArrSz(key));
+                File::Info("./testBackup/" DEFAULT_INDEX ".aes").remove();
+                if (result) ERR("Can't cipher the compacted index: %s\n", (const char*)result);
+                if (File::Info("./testRestore/" DEFAULT_INDEX).getContent() != File::Info("./testBackup/" DEFAULT_INDEX).getContent())
+                    ERR("The deciphered index does not match the compacted index\n");
+            }
+
+            // Coalesce the undersized multichunks (without purging any revision), and check again
+            const unsigned int multichunksCount = countMultichunks();
+            Frost::finalizeDatabase();
+            result = Frost::initializeDatabase("", revisionID, cipheredMasterKey);
+            if (result) ERR("Reopening the database failed: %s\n", (const char*)result);
+            Frost::Helpers::purgeInPlace = Frost::Helpers::coalesceMultichunks = true;
+            result = Frost::purgeBackup("./testBackup/", console, Frost::Slow, 0);
+            Frost::Helpers::purgeInPlace = Frost::Helpers::coalesceMultichunks = false;
+            if (result) ERR("Can't coalesce the multichunks: %s\n", (const char*)result);
+
+            Frost::finalizeDatabase();
+            result = Frost::initializeDatabase("", revisionID, cipheredMasterKey);
+            if (result) ERR("Reopening the coalesced database failed: %s\n", (const char*)result);
+            if (countMultichunks() >= multichunksCount) ERR("No multichunk was coalesced (%u multichunks)\n", multichunksCount);
+            result = checkRefCounts();
+            if (result) ERR("Invalid reference counts after coalescing: %s\n", (const char*)result);
+            result = checkRestoredRevision(2, "testPurgeRev2", console);
+            if (result) ERR("Restoring the second revision after coalescing failed: %s\n", (const char*)result);
+            result = checkRestoredRevision(3, "test", console);
+            if (result) ERR("Restoring the last revision after coalescing failed: %s\n", (const char*)result);
+
+            // Then purge the second revision by rewriting the index
+            result = Frost::purgeBackup("./testBackup/", console, Frost::Slow, 2);
+            if (result) ERR("Can't purge the second revision: %s\n", (const char*)result);
+
+            Frost::finalizeDatabase();
+            revisionID = 0;
+            result = Frost::initializeDatabase("", revisionID, cipheredMasterKey);
+            if (result) ERR("Reopening the purged database failed: %s\n", (const char*)result);
+            result = checkRefCounts();
+            if (result) ERR("Invalid reference counts after the purge: %s\n", (const char*)result);
+            // The rewritten index renumbers the kept revisions
+            result = checkRestoredRevision(revisionID, "test", console);
+            if (result) ERR("Restoring the last revision after the purge failed: %s\n", (const char*)result);
 
             Frost::finalizeDatabase();
+            File::Info("./testPurgeRev2/").remove();
             fprintf(stderr, "Success\n");
             return EXIT_SUCCESS;
         }
@@ -3494,6 +6959,13 @@ int64 parseNumericSuffixed(const Strings::FastString & option)
     return parsed;
 }
 
+// The change journal is stored next to the index
+Frost::String getJournalPath()
+{
+    if (File::Info(Frost::DatabaseModel::databaseURL).isDir()) return Frost::DatabaseModel::databaseURL + DEFAULT_JOURNAL;
+    return Frost::DatabaseModel::databaseURL.normalizedPath(Platform::Separator, false) + "." DEFAULT_JOURNAL;
+}
+
 int handleAction(Strings::StringArray & options, const Strings::FastString & action)
 {
     Strings::StringArray params;
@@ -3563,6 +7035,27 @@ int handleAction(Strings::StringArray & options, const Strings::FastString & act
         Frost::finalizeDatabase();
         return EXIT_SUCCESS;
     }
+    // With a safe index, compacting requires the password to encrypt the compacted index again
+    if (action == "compact" && !Frost::safeIndex)
+    {
+        Frost::String result = Frost::initializeDatabase("", revisionID, cipheredMasterKey);
+        if (result) ERR("Can't re-open the index (do you need to decrypt it ?): %s\n", (const char*)result);
+        result = Frost::compactIndex(console);
+        if (result) ERR("Can't compact the index: %s\n", (const char*)result);
+        Frost::finalizeDatabase();
+        return EXIT_SUCCESS;
+    }
+    if (action == "watch")
+    {
+        Frost::String folder = params[0].normalizedPath(Platform::Separator, true);
+        File::Info folderPath(folder, true);
+        if (!folderPath.doesExist() || !folderPath.isDir())
+            return showHelpMessage("Bad argument for watch, the --watch parameter is not a folder");
+
+        Frost::String result = Frost::watchFolder(folder, getJournalPath(), console);
+        if (result) ERR("Can't watch the folder: %s\n", (const char*)result);
+        return EXIT_SUCCESS;
+    }
 
 
     // From now, all other actions require a password
@@ -3598,6 +7091,22 @@ int handleAction(Strings::StringArray & options, const Strings::FastString & act
     }
 
 
+    if (action == "compact")
+    {
+        Frost::KeyFactory::KeyT key;
+        Frost::derivePassword(key, pass);
+        pass = ""; // Password is not required anymore, let's wipe it
+        result = Frost::Helpers::ensureValidIndexFile( remote + DEFAULT_INDEX ".aes", Frost::DatabaseModel::databaseURL + DEFAULT_INDEX, key, console, false);
+        if (!result) result = Frost::initializeDatabase("", revisionID, cipheredMasterKey);
+        if (result) { memset(key, 0, ArrSz(key)); ERR("Can't re-open the index (bad password ?): %s\n", (const char*)result); }
+        result = Frost::compactIndex(console);
+        Frost::finalizeDatabase();
+        // Else the ciphered index, that's not compacted, would be decrypted over the compacted index on next run
+        if (!result) result = Frost::Helpers::encryptIndexFile(remote + DEFAULT_INDEX ".aes", Frost::DatabaseModel::databaseURL + DEFAULT_INDEX, key, console);
+        memset(key, 0, ArrSz(key));
+        if (result) ERR("Can't compact the index: %s\n", (const char*)result);
+        return EXIT_SUCCESS;
+    }
     if (action == "purge")
     {
         // Purge the directory now for useless chunks
@@ -3619,6 +7128,7 @@ int handleAction(Strings::StringArray & options, const Strings::FastString & act
 
         // Purge the backup up to the given revision
         if (params[0] && (int)params[0]) revisionID = params[0];
+        else if (Frost::Helpers::coalesceMultichunks) revisionID = 0; // Only merge the undersized multichunks
         else ERR("No revision ID given. I won't purge the complete backup set implicitely, purge aborted\n");
 
         Frost::String strategyTxt = optionsMap["strategy"] ? *optionsMap["strategy"] : "100";
@@ -3673,9 +7183,15 @@ int handleAction(Strings::StringArray & options, const Strings::FastString & act
         pass = ""; // Password is not required anymore, let's wipe it
         if (result) ERR("Can't read or initialize the database: %s\n%s", (const char*)(Frost::DatabaseModel::databaseURL + "/" DEFAULT_INDEX), (const char*) result);
 
+        // The backup in progress is regularly saved next to the index, so it can be resumed if interrupted
+        Frost::Helpers::checkpointPath = indexFile + ".checkpoint";
+        if (!Frost::Helpers::resumeBackup && File::Info(Frost::Helpers::checkpointPath).doesExist())
+            console.warn(Frost::ProgressCallback::Backup, Frost::Helpers::checkpointPath, Frost::__trans__("A previous backup was interrupted, its checkpoint is ignored (use --resume to restart from it)"));
+
         // Then backup the folder
         Frost::PurgeStrategy strategy = optionsMap["strategy"] ? (*optionsMap["strategy"] == "slow" ? Frost::Slow : Frost::Fast) : Frost::Fast; // Strategy set to 0 should reopen the previous backup set
-        result = Frost::backupFolder(backup, remote, revisionID, console, strategy);
+        const Frost::String journalPath = getJournalPath();
+        result = Frost::backupFolder(backup, remote, revisionID, console, strategy, journalPath);
         if (result) ERR("Can't backup the test folder: %s\n", (const char*)result);
 
         // Display some statistics
@@ -3686,32 +7202,18 @@ int handleAction(Strings::StringArray & options, const Strings::FastString & act
 
         // Need to be called anyway
         Frost::finalizeDatabase();
+        // The revision is in the index now
+        File::Info(Frost::Helpers::checkpointPath).remove();
+        // The index is saved, so the journal's records are not required anymore (unless interrupted, since the scan was not complete)
+        if (!Frost::exitRequired) Frost::ChangeJournal::commit(journalPath);
         // Check if we need to encrypt the index file
         if (Frost::safeIndex)
         {
-        
-            Stream::OutputFileStream output(remote + DEFAULT_INDEX ".aes");
-            Stream::InputFileStream input(indexFile);
-            
-            Frost::FileFormat::CipheredIndexHeader indexHeader;
-            Random::fillBlock(indexHeader.nonce, ArrSz(indexHeader.nonce), true);
-
-            if (output.write(&indexHeader, sizeof(indexHeader)) != sizeof(indexHeader)) ERR("Could not write the output header to: %s\n", (const char*)(remote + DEFAULT_INDEX ".aes"));
-            
-            Frost::KeyFactory::KeyT nonce, hash;
-            memcpy(nonce, indexHeader.nonce, ArrSz(indexHeader.nonce));
-            
-            if (!Frost::Helpers::AESCounterProcess(key, nonce, input, output, console, indexHeader.hash, 0)) ERR("Error while encrypting the index\n");
-            if (!output.setPosition(0)) ERR("Could not seek back to the start of the ciphered index file\n");
-
-            // Update the header now we know about the hash of the input file
-            if (output.write(&indexHeader, sizeof(indexHeader)) != sizeof(indexHeader)) ERR("Could not write the output header to: %s\n", (const char*)(remote + DEFAULT_INDEX ".aes"));
+            result = Frost::Helpers::encryptIndexFile(remote + DEFAULT_INDEX ".aes", indexFile, key, console);
+            memset(key, 0, ArrSz(key));
+            if (result) ERR("Can't encrypt the index: %s\n", (const char*)result);
         }
-        
-        if (Frost::safeIndex)
-            // Need to set the ciphered file's modification time now it's done writing and closed
-            File::Info(remote + DEFAULT_INDEX ".aes", true).setModifiedTime(File::Info(indexFile, true).modification);
-        
+
         if (warningLog.getSize()) { fputs("\nReceived warnings:\n", stderr); fputs((const char*)(warningLog.Join("\n")+"\n"), stderr); }
         return EXIT_SUCCESS;
     }
@@ -3782,10 +7284,13 @@ struct FrostFSOptions
     char *  index;
     char *  keyVault;
     char *  password;
+    char *  cacheSize;
+    char *  readAheadSize;
+    char *  treeCacheSize;
     int     showVersion;
     int     showHelp;
     int     showDebug;
-    FrostFSOptions() : remote(0), index(0), keyVault(0), password(0), showVersion(0), showHelp(0), showDebug(0) {}
+    FrostFSOptions() : remote(0), index(0), keyVault(0), password(0), cacheSize(0), readAheadSize(0), treeCacheSize(0), showVersion(0), showHelp(0), showDebug(0) {}
 };
 
 
@@ -3795,6 +7300,9 @@ static struct fuse_opt frost_opts[] =
     {"--index=%s",      offsetof(struct FrostFSOptions, index), 0},
     {"--keyvault=%s",   offsetof(struct FrostFSOptions, keyVault), 0},
     {"--password=%s",   offsetof(struct FrostFSOptions, password), 0},
+    {"--cache=%s",      offsetof(struct FrostFSOptions, cacheSize), 0},
+    {"--readahead=%s",  offsetof(struct FrostFSOptions, readAheadSize), 0},
+    {"--treecache=%s",  offsetof(struct FrostFSOptions, treeCacheSize), 0},
     {"--verbose",       offsetof(struct FrostFSOptions, showDebug), 1},
     {"-h",              offsetof(struct FrostFSOptions, showHelp), 1},
     {"-V",              offsetof(struct FrostFSOptions, showVersion),1},
@@ -3822,11 +7330,125 @@ struct FrostFSOps
 {
     typedef Frost::String String;
     typedef Frost::FileFormat::FileTree   FileTree;
-    typedef Container::HashTable<FileTree, uint32> FileTreeMap;
-    /* We intend to have as many TLSIndex instances as there are threads.
-       So we use TLS to store the instances.
-       There is only a single IndexFile, but we cache the file tree based on revision in the TLS.
-       So we have a map of FileTree based on the revision. */
+    /* There is only a single IndexFile, and a single multichunk cache shared by all threads (it's thread safe and
+       only decodes a multichunk once even if multiple threads ask for it at the same time).
+       The file trees are loaded on the first access to their revision, and cached based on the revision. */
+
+    /** The file trees cache.
+        A revision's file tree is loaded on first access (only once, even if multiple threads ask for it at the same time), and the least
+        recently used file trees are evicted when the cache is over its memory budget. The file trees are pinned while used, so they are
+        not evicted from under another thread */
+    struct FileTreeCache
+    {
+        /** A cached file tree */
+        struct Entry
+        {
+            /** The file tree, or 0 while loading (or if loading failed) */
+            FileTree *          tree;
+            /** The memory used by the file tree, in bytes */
+            size_t              size;
+            /** The number of users of this file tree, it can't be evicted while used */
+            uint32              pins;
+            /** The last time this file tree was used (from the cache's use counter) */
+            uint64              lastUse;
+            /** Set when the file tree is loaded (or failed loading) */
+            Threading::Event    loaded;
+
+            Entry() : tree(0), size(0), pins(1), lastUse(0), loaded(NULL, Threading::Event::ManualReset) {}
+            ~Entry() { delete0(tree); }
+        };
+        typedef Container::HashTable<Entry, uint32> EntryMap;
+
+        /** Pin a file tree from the cache while it's used, and release it when destructed */
+        struct Pin
+        {
+            FileTreeCache & cache;
+            uint32          revision;
+            Entry *         entry;
+
+            FileTree * operator ->() const { return entry->tree; }
+            Pin(FileTreeCache & cache) : cache(cache), revision(0), entry(0) {}
+            ~Pin() { if (entry) cache.release(revision, entry); }
+        };
+
+        /** The lock protecting the members below */
+        Threading::FastLock lock;
+        EntryMap            entries;
+        size_t              maxCacheSize, totalCacheSize;
+        uint64              useCounter;
+
+        /** Evict the least recently used file trees that are not pinned until the cache fits its budget (the lock must be taken) */
+        void trim()
+        {
+            while (totalCacheSize > maxCacheSize)
+            {
+                Entry * oldest = 0; uint32 oldestRevision = 0;
+                for (EntryMap::IterT iter = entries.getFirstIterator(); iter.isValid(); ++iter)
+                {
+                    Entry * entry = *iter;
+                    if (entry->pins || !entry->tree || (oldest && oldest->lastUse <= entry->lastUse)) continue;
+                    oldest = entry; oldestRevision = *iter.getKey();
+                }
+                if (!oldest) return;
+                totalCacheSize -= oldest->size;
+                entries.removeValue(oldestRevision);
+            }
+        }
+        /** Release a pinned file tree */
+        void release(const uint32 revision, Entry * entry)
+        {
+            Threading::ScopedLock scope(lock);
+            if (--entry->pins) return;
+            // Failed entries are forgotten once no one is waiting on them anymore
+            if (!entry->tree) { entries.removeValue(revision); return; }
+            trim();
+        }
+
+        /** Get the file tree for the given revision and pin it, loading it from the index if it's not in the cache
+            @return true on success, or false if the revision does not exist */
+        bool acquire(Pin & pin, const uint32 revision)
+        {
+            Entry * entry = 0;
+            bool mustLoad = false;
+            {
+                Threading::ScopedLock scope(lock);
+                entry = entries.getValue(revision);
+                if (entry) entry->pins++;
+                else
+                {
+                    entry = new Entry;
+                    entries.storeValue(revision, entry);
+                    mustLoad = true;
+                }
+                entry->lastUse = ++useCounter;
+            }
+            pin.revision = revision; pin.entry = entry;
+
+            if (!mustLoad)
+            {   // Wait for the loading thread, if any
+                entry->loaded.Wait();
+                return entry->tree != 0;
+            }
+
+            // The revision might have been purged
+            const Frost::FileFormat::Catalog * c = Frost::Helpers::indexFile.getCatalogForRevision(revision);
+            FileTree * tree = c ? new FileTree(revision, true) : 0;
+            if (tree && !Frost::Helpers::indexFile.Load(*tree, c->fileTree)) delete0(tree);
+            {
+                Threading::ScopedLock scope(lock);
+                entry->tree = tree;
+                if (tree)
+                {   // The items are mapped from the index file, so only count their descriptors
+                    entry->size = sizeof(*tree) + tree->items.getSize() * (sizeof(FileTree::Item) + sizeof(FileTree::Item *));
+                    totalCacheSize += entry->size;
+                }
+            }
+            entry->loaded.Set();
+            return tree != 0;
+        }
+
+        FileTreeCache() : maxCacheSize(0), totalCacheSize(0), useCounter(0) {}
+    };
 
 
 
@@ -3838,69 +7460,198 @@ public:
     static Frost::String                            remoteFolder; // Complete remote folder
     static uint32                                   maxMultichunkSize;
     static uint32                                   maxRevisionID;
-    static Threading::Thread::LocalVariable::Key    tls;
-    static FileTreeMap                              fileTrees;
+    static Frost::Helpers::MultiChunkCache *        cache;
+    static uint64                                   readAheadSize;
+    static FileTreeCache                            fileTrees;
     static NullProgressCallback                     nullCB;
 
-    // Static interface (used by all threads)
-public:
-    struct TLSIndex
+    /** Decode the multichunks a sequential reader will need soon in background threads, into the shared cache.
+        The decoded multichunks are not pinned, so the read ahead is bounded by the cache size */
+    class ReadAhead
     {
-        Frost::Helpers::MultiChunkCache cache;
-
-        static TLSIndex * constructTLSIndex(Threading::Thread::LocalVariable::Key, TLSIndex *) { return new TLSIndex; }
-        static void destructTLSIndex(TLSIndex * obj) { delete obj; }
+        /** The thread decoding the multichunks */
+        struct Worker : public Threading::Thread
+        {
+            ReadAhead & readAhead;
+            uint32 runThread() { readAhead.decode(); return 0; }
 
-    private:
-        TLSIndex() : cache(maxMultichunkSize * 2)
+            Worker(ReadAhead & readAhead) : readAhead(readAhead) {}
+            ~Worker() { destroyThread(); }
+        };
+        typedef Container::NotConstructible<Worker>::IndexList Workers;
+        /** The maximum number of pending multichunks, the older requests are more likely to be useless when it's reached */
+        enum { MaxPending = 64 };
+
+        /** The lock protecting the pending multichunks */
+        Threading::FastLock  lock;
+        /** Signaled when a multichunk is appended */
+        Threading::Event     appended;
+        /** The multichunks to decode, with their path and filter arguments */
+        Container::PlainOldData<uint64>::Array ids;
+        Strings::StringArray paths, filters;
+        bool                 stop;
+        Workers              workers;
+
+        /** Decode the pending multichunks */
+        void decode()
         {
-//            Threading::ScopedLock scope(FrostFSOps::lock);
-//            Frost::String error = indexFile.readFile(FrostFSOps::indexFilePath);
-//            if (error) fprintf(stderr, "Could not read the index file %s\n", (const char*)FrostFSOps::indexFilePath);
+            Frost::Helpers::SilentProgressCallback silent;
+            while (true)
+            {
+                uint64 id = 0; String path, filter;
+                {
+                    Threading::ScopedLock scope(lock);
+                    if (stop) return;
+                    if (ids.getSize())
+                    {
+                        id = ids[0]; path = paths[0]; filter = filters[0];
+                        ids.Remove(0); paths.Remove(0); filters.Remove(0);
+                    }
+                }
+                if (!id) { appended.Wait((uint32)100); continue; }
 
+                // Errors are ignored here, they are reported when the multichunk is actually read
+                Frost::Helpers::MultiChunkCache::Pin pin(*cache);
+                Frost::Helpers::MultiChunkFileLoader loader(path, filter, silent);
+                String error;
+                if (!cache->contains(id)) cache->acquire(pin, id, loader, error);
+            }
+        }
+
+    public:
+        /** Append a multichunk to decode, if it's not in the cache already */
+        void append(const Frost::FileFormat::Multichunk & mchunk)
+        {
+            if (!workers.getSize() || cache->contains(mchunk.UID)) return;
+            {
+                Threading::ScopedLock scope(lock);
+                if (ids.indexOf(mchunk.UID) != ids.getSize()) return;
+                if (ids.getSize() >= MaxPending) { ids.Remove(0); paths.Remove(0); filters.Remove(0); }
+                ids.Append(mchunk.UID);
+                paths.Append(remoteFolder + mchunk.getFileName());
+                filters.Append(Frost::Helpers::indexFile.getFilterArguments().getArgument(mchunk.filterArgIndex));
+            }
+            appended.Set();
+        }
+        /** Start the given number of decoding threads.
+            This must be called after FUSE daemonized the process (from the init callback), since the threads don't survive forking */
+        void start(const uint32 threads)
+        {
+            for (uint32 i = 0; i < threads; i++)
+            {
+                Worker * worker = new Worker(*this);
+                if (!worker->createThread()) { delete worker; break; }
+                workers.Append(worker);
+            }
+        }
+        /** Stop the decoding threads, and forget the pending multichunks */
+        void finish()
+        {
+            {
+                Threading::ScopedLock scope(lock);
+                stop = true;
+            }
+            appended.Set();
+            // Wait for the workers to finish
+            workers.Clear();
+            ids.Clear(); paths.Clear(); filters.Clear();
         }
 
+        ReadAhead() : appended(NULL, Threading::Event::AutoReset), stop(false) {}
+        ~ReadAhead() { finish(); }
     };
-    friend struct TLSIndex;
+    static ReadAhead *                              readAhead;
 
+    // Static interface (used by all threads)
+public:
     struct ReadCache
     {
-        TLSIndex  *     index;
+        /** The number of contiguous reads after which the file is considered read sequentially */
+        enum { SequentialReads = 2 };
+
         uint32          chunkListID;
-        ReadCache(TLSIndex * index, uint32 id) : index(index), chunkListID(id) {}
-    };
+        /** The offset of each chunk in the file, followed by the file size, so the chunk to start reading from is found by a binary search */
+        Container::PlainOldData<uint64>::Array offsets;
 
+        /** Build the chunks offsets from the file's chunk list
+            @return false if a chunk was not found in the index */
+        bool buildOffsets(const Frost::FileFormat::ChunkList & cl)
+        {
+            uint64 offset = 0;
+            offsets.Clear();
+            for (size_t i = 0; i < cl.chunksID.getSize(); i++)
+            {
+                offsets.Append(offset);
+                const uint32 chunkID = cl.chunksID[i];
+                if (Frost::FileFormat::ChunkList::isZeroExtent(chunkID))
+                    offset += Frost::FileFormat::ChunkList::getZeroExtentSize(chunkID);
+                else
+                {
+                    const Frost::FileFormat::ChunkLocation * location = Frost::Helpers::indexFile.getChunkLocation(chunkID);
+                    if (!location) return false;
+                    offset += location->size;
+                }
+            }
+            offsets.Append(offset);
+            return true;
+        }
+        /** Find the chunk containing the given offset in the file
+            @return the chunk index, or the chunks count if the offset is past the end of file */
+        size_t findChunk(const uint64 offset) const
+        {
+            if (!offsets.getSize()) return 0;
+            const size_t count = offsets.getSize() - 1;
+            if (offset >= offsets[count]) return count;
+            // Find the last chunk starting before the offset
+            size_t low = 0, high = count;
+            while (high - low > 1)
+            {
+                const size_t mid = (low + high) / 2;
+                if (offsets[mid] <= offset) low = mid; else high = mid;
+            }
+            return low;
+        }
+        /** The lock protecting the sequential access detection, since the same file can be read from multiple threads */
+        Threading::FastLock lock;
+        /** The offset following the last read, and the number of contiguous reads */
+        uint64          nextOffset;
+        uint32          contiguousReads;
+        /** The chunks before this one were already read ahead */
+        size_t          readAheadEnd;
+
+        /** Account a read and find the chunks to read ahead if the file is read sequentially
+            @param begin    On output, set to the first chunk to read ahead
+            @param end      On output, set to the chunk following the last one to read ahead
+            @return true if some chunks should be read ahead */
+        bool sequentialRead(const uint64 offset, const size_t size, size_t & begin, size_t & end)
+        {
+            Threading::ScopedLock scope(lock);
+            contiguousReads = offset == nextOffset ? contiguousReads + 1 : 0;
+            // After a seek, the read ahead starts again from the new position
+            if (!contiguousReads) readAheadEnd = 0;
+            nextOffset = offset + size;
+            if (contiguousReads < SequentialReads || !readAheadSize) return false;
+            begin = max(findChunk(nextOffset), readAheadEnd);
+            end = findChunk(nextOffset + readAheadSize) + 1;
+            end = min(end, offsets.getSize() - 1);
+            if (begin >= end) return false;
+            readAheadEnd = end;
+            return true;
+        }
+        ReadCache(uint32 id) : chunkListID(id), nextOffset(0), contiguousReads(0), readAheadEnd(0) {}
+    };
 
 
-    static TLSIndex * getTLS()
-    {
-        Threading::Thread::LocalVariable * var = Threading::Thread::getLocalVariable(tls);
-        if (!var)
-        {   // No locking here since this should be done on the main thread
-            TLSIndex * index = TLSIndex::constructTLSIndex(0, 0);
-            tls = Threading::Thread::appendLocalVariable(index, TLSIndex::constructTLSIndex, TLSIndex::destructTLSIndex);
-            var = Threading::Thread::getLocalVariable(tls);
-        }
-        GetLocalVariable(TLSIndex, index, tls);
-        return index;
-    }
-    static void cleanTLS()
-    {
-        Threading::Thread::removeLocalVariable(tls);
-    }
 
-    static int checkPath(const char * pathStr, String & filePath, FileTree *& ft, TLSIndex *& index)
+    static int checkPath(const char * pathStr, String & filePath, FileTreeCache::Pin & ft)
     {
-        index = getTLS();
-        if (!index) return -EIO;
         if (pathStr[0] != '/') return -ENOENT;
 
         String path(pathStr+1);
         uint32 rev = path;
         if (!rev) return -ENOENT;
         filePath = "/" + path.fromFirst("/");
-        ft = FrostFSOps::fileTrees.getValue(rev);
-        if (!ft) return -ENOENT;
+        if (!FrostFSOps::fileTrees.acquire(ft, rev)) return -ENOENT;
         if (Frost::dumpLevel) fprintf(stdout, "checkPath: rev%u, path: %s\n", rev, (const char*)filePath);
         return 0;
     }
@@ -3931,8 +7682,8 @@ public:
             return 0;
         }
 
-        TLSIndex * index; String path; FileTree * ft = 0;
-        int ret = checkPath(pathStr, path, ft, index);
+        String path; FileTreeCache::Pin ft(fileTrees);
+        int ret = checkPath(pathStr, path, ft);
         if (ret) return ret;
 
 
@@ -3953,14 +7704,15 @@ public:
             // Need to save the revisions here
             for (uint32 i = 1; i <= maxRevisionID; i++)
             {
+                if (!Frost::Helpers::indexFile.getCatalogForRevision(i)) continue; // Purged
                 if (filler(buf, (const char*)String::Print("%u", i), 0, 0))
                     return 0;
             }
             return 0;
         }
 
-        TLSIndex * index; String path; FileTree * ft = 0;
-        int ret = checkPath(pathStr, path, ft, index);
+        String path; FileTreeCache::Pin ft(fileTrees);
+        int ret = checkPath(pathStr, path, ft);
         if (ret) return ret;
 
         uint32 itemID = ft->findItem(path);
@@ -3983,8 +7735,8 @@ public:
 
     static int open(const char *pathStr, struct fuse_file_info * fi)
     {
-        TLSIndex * index; String path; FileTree * ft = 0;
-        int ret = checkPath(pathStr, path, ft, index);
+        String path; FileTreeCache::Pin ft(fileTrees);
+        int ret = checkPath(pathStr, path, ft);
         if (ret) return ret;
 
         uint32 itemID = ft->findItem(path);
@@ -4014,7 +7766,10 @@ public:
             if (!info.isFile()) return -EACCES;
 
 
-            fi->fh = (uint64)new ReadCache(index, item->getChunkListID());
+            ReadCache * rc = new ReadCache(item->getChunkListID());
+            const Frost::FileFormat::ChunkList * cl = Frost::Helpers::indexFile.getChunkList(rc->chunkListID);
+            if (cl && !rc->buildOffsets(*cl)) { delete rc; return -EIO; }
+            fi->fh = (uint64)rc;
             if (Frost::dumpLevel) fprintf(stdout, "open path: %s [%u]\n", (const char*)path, item->getChunkListID());
             return 0;
         }
@@ -4042,36 +7797,55 @@ public:
 
         // Now we have the chunk list, let's find the chunks required for this operation
         const Frost::FileFormat::ChunkList * cl = Frost::Helpers::indexFile.getChunkList(rc->chunkListID);
-        // Skip the offset to find out which chunk to read from
-        size_t startIndex = 0;
-        for(; startIndex < cl->chunksID.getSize(); startIndex++)
+        if (!cl) return 0; // Empty file
+        // Find out which chunk to read from, and the offset in this chunk
+        size_t startIndex = rc->findChunk((uint64)offset);
+        if (startIndex == cl->chunksID.getSize()) return 0;
+
+        // When reading sequentially, decode the multichunks of the next chunks in the background
+        size_t aheadBegin = 0, aheadEnd = 0;
+        if (readAhead && rc->sequentialRead((uint64)offset, size, aheadBegin, aheadEnd))
         {
-            const Frost::FileFormat::Chunk * chunk = Frost::Helpers::indexFile.findChunk(cl->chunksID[startIndex]);
-            if (!chunk) return -EIO;
-            if (offset < chunk->size) break;
-            offset -= chunk->size;
+            uint32 lastID = 0;
+            for (size_t i = aheadBegin; i < aheadEnd; i++)
+            {
+                const uint32 chunkID = cl->chunksID[i];
+                if (Frost::FileFormat::ChunkList::isZeroExtent(chunkID)) continue;
+                const Frost::FileFormat::ChunkLocation * location = Frost::Helpers::indexFile.getChunkLocation(chunkID);
+                if (!location || location->multichunkID == lastID) continue;
+                lastID = location->multichunkID;
+                const Frost::FileFormat::Multichunk * mchunk = Frost::Helpers::indexFile.getMultichunk(location->multichunkID);
+                if (mchunk) readAhead->append(*mchunk);
+            }
         }
+        offset -= (off_t)rc->offsets[startIndex];
 
         // Ok, now we have the first chunk to read, let's read it
         int ret = 0;
         String errorMessage;
+        Frost::Helpers::MultiChunkCache::Pin pin(*FrostFSOps::cache);
         while (size && startIndex < cl->chunksID.getSize())
         {
             uint32 chunkID = cl->chunksID[startIndex];
-            const Frost::FileFormat::Chunk * chunk = Frost::Helpers::indexFile.findChunk(chunkID);
-            if (!chunk) return -EIO;
+            if (Frost::FileFormat::ChunkList::isZeroExtent(chunkID))
+            {   // Holes are read as zeros
+                int minSize = (int)min((uint64)(Frost::FileFormat::ChunkList::getZeroExtentSize(chunkID) - offset), (uint64)size);
+                memset(&buf[ret], 0, minSize);
+                offset = 0;
+                size -= minSize;
+                ret += minSize;
+                startIndex++;
+                continue;
+            }
+            const Frost::FileFormat::ChunkLocation * location = Frost::Helpers::indexFile.getChunkLocation(chunkID);
+            if (!location) return -EIO;
 
             // Get the multichunk where this chunk is stored
-            const Frost::FileFormat::Multichunk * mchunk = Frost::Helpers::indexFile.getMultichunk(chunk->multichunkID);
+            const Frost::FileFormat::Multichunk * mchunk = Frost::Helpers::indexFile.getMultichunk(location->multichunkID);
             if (!mchunk) return -EIO;
 
-            // We need the offset in the multichunk's chunklist so it's faster to restore
-            Frost::FileFormat::ChunkList * mcChunkList = Frost::Helpers::indexFile.getChunkList(mchunk->listID);
-            size_t chunkOffset = (size_t)-1;
-            if (mcChunkList) chunkOffset = mcChunkList->getChunkOffset(chunkID);
-
             errorMessage = "";
-            File::Chunk * chunkF = Frost::Helpers::extractChunkBin(errorMessage, FrostFSOps::remoteFolder, mchunk->getFileName(), mchunk->UID, chunkOffset, chunk->checksum, Frost::Helpers::indexFile.getFilterArguments().getArgument(mchunk->filterArgIndex), rc->index->cache, FrostFSOps::nullCB);
+            File::Chunk * chunkF = Frost::Helpers::extractChunkBin(errorMessage, FrostFSOps::remoteFolder, mchunk->getFileName(), mchunk->UID, location->getOffset(), Frost::Helpers::indexFile.getChunk(*location).checksum, Frost::Helpers::indexFile.getFilterArguments().getArgument(mchunk->filterArgIndex), pin, FrostFSOps::nullCB);
             if (!chunkF || errorMessage) return -EIO;
 
             // Ok, if we got a chunk, let's save it
@@ -4090,8 +7864,8 @@ public:
 
     static int readlink(const char *pathStr, char* buf, size_t size)
     {
-        TLSIndex * index; String path; FileTree * ft = 0;
-        int ret = checkPath(pathStr, path, ft, index);
+        String path; FileTreeCache::Pin ft(fileTrees);
+        int ret = checkPath(pathStr, path, ft);
         if (ret) return ret;
 
         uint32 itemID = ft->findItem(path);
@@ -4135,6 +7909,19 @@ public:
         return 0;
     }
 
+    // Called once the file system is mounted (and the process daemonized)
+    static void * init(struct fuse_conn_info * conn)
+    {
+        if (readAhead) readAhead->start((uint32)max(1, Threading::Thread::getCurrentCoreCount() / 2));
+        return 0;
+    }
+
+    // Called when the file system is unmounted
+    static void destroy(void * data)
+    {
+        if (readAhead) readAhead->finish();
+    }
+
     static int chmod(const char* pathStr, mode_t mode)
     {
         // a noop since mtp doesn't support permissions. But we need to pretend
@@ -4149,8 +7936,10 @@ Frost::String                            FrostFSOps::indexFilePath; // Complete
 Frost::String                            FrostFSOps::remoteFolder; // Complete remote folder
 uint32                                   FrostFSOps::maxMultichunkSize = 0;
 uint32                                   FrostFSOps::maxRevisionID = 0;
-Threading::Thread::LocalVariable::Key    FrostFSOps::tls;
-FrostFSOps::FileTreeMap                  FrostFSOps::fileTrees;
+Frost::Helpers::MultiChunkCache *        FrostFSOps::cache = 0;
+uint64                                   FrostFSOps::readAheadSize = 0;
+FrostFSOps::ReadAhead *                  FrostFSOps::readAhead = 0;
+FrostFSOps::FileTreeCache                FrostFSOps::fileTrees;
 NullProgressCallback                     FrostFSOps::nullCB;
 
 
@@ -4169,6 +7958,8 @@ int main(int argc, char ** argv)
     frost_oper.statfs   = FrostFSOps::statfs;
     frost_oper.chmod    = FrostFSOps::chmod;
     frost_oper.readlink = FrostFSOps::readlink;
+    frost_oper.init     = FrostFSOps::init;
+    frost_oper.destroy  = FrostFSOps::destroy;
 
     FrostFSOptions options;
 
@@ -4197,7 +7988,11 @@ int main(int argc, char ** argv)
                "\t--password=<password>             The password to use to decypher the master key [BEWARE OF YOUR BASH HISTORY], this is optional\n"
                "\t--remote=/path/to/remote          The path where the remote is stored\n"
                "\t--index=/path/to/index            The path where the index file is stored (if empty, using remote path)\n"
-               "\t--keyvault=/path/to/keyvaultFile  The path where to the key vault file (if empty, using " DEFAULT_KEYVAULT ")\n");
+               "\t--keyvault=/path/to/keyvaultFile  The path where to the key vault file (if empty, using " DEFAULT_KEYVAULT ")\n"
+               "\t--cache=size                      The size (possible suffix: K,M,G) of the cache holding the decoded multichunks, shared by all threads (default is 64M)\n"
+               "\t--readahead=size                  The size (possible suffix: K,M,G) of the file data to decode ahead when a file is read sequentially\n"
+               "\t                                  (default is twice the largest multichunk size, 0 to disable)\n"
+               "\t--treecache=size                  The size (possible suffix: K,M,G) of the cache holding the revisions' file trees (default is 256M)\n");
     }
 
     if (!options.remote)
@@ -4238,32 +8033,36 @@ int main(int argc, char ** argv)
     result = Frost::getKeyFactory().loadPrivateKey(keyVaultPath, cipheredMasterKey, pass, "");
     if (result) { fprintf(stderr, "Can't read the private key from the given keyvault %s: %s\n", (const char*)keyVaultPath, (const char*)result); return 1; }
 
-    // Read all filter argument to find out the maximum size for the multichunks (this is used for setting up the cache per thread)
+    // Read all filter argument to find out the maximum size for the multichunks (the cache must be able to hold a few of them)
     const Frost::FileFormat::FilterArguments & fa = Frost::Helpers::indexFile.getFilterArguments();
     for (size_t i = 0; i < fa.arguments.getSize(); i++)
     {
         uint32 maxSize = fa.arguments[i];
         if (FrostFSOps::maxMultichunkSize < maxSize) FrostFSOps::maxMultichunkSize = maxSize;
     }
-    // Then read and store all file trees for all revisions (cache mode)
-    const Frost::FileFormat::Catalog * c = 0;
-    for (uint32 rev = 1; rev <= FrostFSOps::maxRevisionID; rev++)
-    {
-        c = Frost::Helpers::indexFile.getCatalogForRevision(rev);
-        if (!c) { fprintf(stderr, "No catalog found for revision %u\n", rev); return 1; }
-        Frost::FileFormat::FileTree * ft = new Frost::FileFormat::FileTree(rev, true);
-        if (!ft) { fprintf(stderr, "Not enough memory\n"); return 1; }
-        if (!Frost::Helpers::indexFile.Load(*ft, c->fileTree)) { fprintf(stderr, "No file tree found for revision %u\n", rev); return 1; }
-        FrostFSOps::fileTrees.storeValue(rev, ft);
-    }
+    // The file trees are loaded when their revision is accessed
+    FrostFSOps::fileTrees.maxCacheSize = options.treeCacheSize ? (size_t)parseNumericSuffixed(options.treeCacheSize) : (size_t)256*1024*1024;
+
+    // The decoded multichunks cache is shared by all threads
+    const size_t cacheSize = options.cacheSize ? (size_t)parseNumericSuffixed(options.cacheSize) : (size_t)64*1024*1024;
+    Frost::Helpers::MultiChunkCache cache(max(cacheSize, (size_t)FrostFSOps::maxMultichunkSize * 2));
+    FrostFSOps::cache = &cache;
+    // The multichunks needed by the sequential readers are decoded ahead in background threads (started once mounted)
+    FrostFSOps::readAheadSize = options.readAheadSize ? (uint64)parseNumericSuffixed(options.readAheadSize) : (uint64)FrostFSOps::maxMultichunkSize * 2;
+    FrostFSOps::ReadAhead readAhead;
+    if (FrostFSOps::readAheadSize) FrostFSOps::readAhead = &readAhead;
 
     // Ok, we are ready to run
     fprintf(stdout, "Let's go!\n");
-    (void)FrostFSOps::getTLS();
 
     int ret = fuse_main(args.argc, args.argv, &frost_oper, 0);
-    // Clean TLS stuff now
-    FrostFSOps::cleanTLS();
+    FrostFSOps::readAhead = 0;
+    if (Frost::dumpLevel)
+    {
+        Frost::Helpers::MultiChunkCache::Statistics stats = cache.getStatistics();
+        fprintf(stdout, "Multichunk cache: %llu hits, %llu misses, %.3fs spent decoding\n", (unsigned long long)stats.hits, (unsigned long long)stats.misses, stats.loadTime / 1000.0);
+    }
+    FrostFSOps::cache = 0;
     return ret;
 }
 #else
@@ -4289,6 +8088,8 @@ int main(int argc, char ** argv)
 
     // Check if we need to encrypt the index file once the backup is done
     Frost::safeIndex = options.indexOf("--safeindex") != options.getSize();
+    // Check if the multichunks should be stored in frames
+    Frost::Helpers::framedMultichunks = options.indexOf("--framed") != options.getSize();
 
     // This also works for tests, so test it before entering any tests
     if (checkOption(options, "compression") == EXIT_SUCCESS) return EXIT_SUCCESS;
@@ -4325,12 +8126,15 @@ int main(int argc, char ** argv)
     // Optional first
     if (checkOption(options, "cache", true) == EXIT_SUCCESS) return EXIT_SUCCESS;
     if (checkOption(options, "overwrite") == EXIT_SUCCESS) return EXIT_SUCCESS;
+    if (checkOption(options, "subtree") == EXIT_SUCCESS) return EXIT_SUCCESS;
     if (checkOption(options, "strategy") == EXIT_SUCCESS) return EXIT_SUCCESS;
     if (checkOption(options, "keyid") == EXIT_SUCCESS) return EXIT_SUCCESS;
     if (checkOption(options, "exclude") == EXIT_SUCCESS) return EXIT_SUCCESS;
     if (checkOption(options, "include") == EXIT_SUCCESS) return EXIT_SUCCESS;
     if (checkOption(options, "multichunk", true) == EXIT_SUCCESS) return EXIT_SUCCESS;
     if (checkOption(options, "password") == EXIT_SUCCESS) return EXIT_SUCCESS;
+    if (checkOption(options, "checkpoint", true) == EXIT_SUCCESS) return EXIT_SUCCESS;
+    if (checkOption(options, "prefetch", true) == EXIT_SUCCESS) return EXIT_SUCCESS;
 
     if (optionsMap["exclude"])
         Frost::Helpers::excludedFilePath = *optionsMap["exclude"];
@@ -4340,6 +8144,16 @@ int main(int argc, char ** argv)
         Frost::Helpers::includedFilePath = *optionsMap["include"];
     }
 
+    if (optionsMap["checkpoint"])
+        Frost::Helpers::checkpointInterval = (uint32)parseNumericSuffixed(*optionsMap["checkpoint"]);
+    Frost::Helpers::resumeBackup = options.indexOf("--resume") != options.getSize();
+    Frost::Helpers::purgeInPlace = options.indexOf("--inplace") != options.getSize();
+    Frost::Helpers::coalesceMultichunks = options.indexOf("--coalesce") != options.getSize();
+    if (optionsMap["prefetch"])
+        Frost::Helpers::prefetchSize = (size_t)parseNumericSuffixed(*optionsMap["prefetch"]);
+    if (optionsMap["subtree"])
+        Frost::Helpers::restoreSubtree = optionsMap["subtree"]->normalizedPath(PathSeparator[0], false);
+
     if (optionsMap["multichunk"])
         File::MultiChunk::setMaximumSize((uint32)parseNumericSuffixed(*optionsMap["multichunk"]));
 
@@ -4347,8 +8161,9 @@ int main(int argc, char ** argv)
     if (optionsMap["overwrite"]
         && *optionsMap["overwrite"] != "yes"
         && *optionsMap["overwrite"] != "no"
-        && *optionsMap["overwrite"] != "update")
-        return showHelpMessage("Bad argument for overwrite (none of: yes, no, update)");
+        && *optionsMap["overwrite"] != "update"
+        && *optionsMap["overwrite"] != "delta")
+        return showHelpMessage("Bad argument for overwrite (none of: yes, no, update, delta)");
 
     if (optionsMap["strategy"]
         && *optionsMap["strategy"] != "slow"
@@ -4376,9 +8191,11 @@ int main(int argc, char ** argv)
     if ((ret = handleAction(options, "cat")) != BailOut) return ret;
     if ((ret = handleAction(options, "purge")) != BailOut) return ret;
     if ((ret = handleAction(options, "backup")) != BailOut) return ret;
+    if ((ret = handleAction(options, "watch")) != BailOut) return ret;
     if ((ret = handleAction(options, "restore")) != BailOut) return ret;
     if ((ret = handleAction(options, "decryptindex"))   != BailOut) return ret;
     if ((ret = handleAction(options, "dump"))       != BailOut) return ret;
+    if ((ret = handleAction(options, "compact"))    != BailOut) return ret;
 
     return showHelpMessage("Either backup, purge or restore mode required");
 }
@@ -12,6 +12,7 @@
 
 
   #define DEFAULT_INDEX	  "index.frost"
+  #define DEFAULT_JOURNAL  "journal.frost"
   #define PROTOCOL_VERSION  "2.0"
 
 // Forward declare some class we'll be using to avoid including a lot of stuff in the header
@@ -92,13 +93,48 @@ namespace Frost
         /** The current salt */
         KeyT         salt;
 
-        /** The current counter */
-        uint32       counter;
-        /** The current opaque nonce */
-        KeyT         hashChunkNonce;
-
         // Interface
     public:
+        /** The nonce and its counter for a single ciphertext.
+            It's kept out of the factory so the factory is only read while ciphering, and can be shared by many threads */
+        struct CounterNonce
+        {
+            /** The current counter */
+            uint32       counter;
+            /** The current opaque nonce */
+            KeyT         hashChunkNonce;
+
+            /** Increment the counter and get the current key.
+                This must be called before any 'AES_CTR()' call in the algorithm described above */
+            void incrementNonce(KeyT & keyOut)
+            {
+                counter++;
+                // Check if all parameters are aligned, and if so, process 4 by 4
+                if (((uint64)(&keyOut[0]) & 0x3) == 0)
+                {
+                    for (uint32 i = 0; i < ArrSz(hashChunkNonce); i+= sizeof(counter))
+                        *(uint32*)&keyOut[i] = *(uint32*)&hashChunkNonce[i] ^ counter;
+                    return;
+                }
+                // Avoid unaligned memory access per loop turn
+                uint8 cnt[4] = { (uint8)(counter >> 24), (uint8)((counter >> 16) & 0xFF), (uint8)((counter >> 8) & 0xFF), (uint8)(counter & 0xFF) };
+                for (uint32 i = 0; i < ArrSz(hashChunkNonce); i+= sizeof(counter))
+                {
+                    keyOut[i+0] = hashChunkNonce[i+0] ^ cnt[0];
+                    keyOut[i+1] = hashChunkNonce[i+1] ^ cnt[1];
+                    keyOut[i+2] = hashChunkNonce[i+2] ^ cnt[2];
+                    keyOut[i+3] = hashChunkNonce[i+3] ^ cnt[3];
+                }
+            }
+            /** Set the counter, so the next nonce is the one for the given block.
+                This is used to decrypt a part of the ciphertext without decrypting what's before it */
+            void setCounter(const uint32 blockIndex) { counter = blockIndex; }
+
+            /** Create a new nonce and reset the counter.
+                This creates the 'nonce' in the algorithm described above */
+            CounterNonce(const KeyT & hash) : counter(0) { memcpy(hashChunkNonce, hash, sizeof(hashChunkNonce)); }
+        };
+
         /** Load the session key out of the given key vault
             @param fileVault       A path to the file vault to open.
             @param cipherMasterKey The ciphered master key that's read from the index database.
@@ -121,41 +157,20 @@ namespace Frost
                     (complete directory hierarchy will be created for this file) */
         String createMasterKeyForFileVault(MemoryBlock & cipherMasterKey, const String & fileVault, const String & password = "", const String & ID = "");
 
-        /** Increment the counter and get the current key.
-            This must be called before any 'AES_CTR()' call in the algorithm described above */
-        void incrementNonce(KeyT & keyOut)
-        {
-            counter++;
-            // Check if all parameters are aligned, and if so, process 4 by 4
-            if (((uint64)(&keyOut[0]) & 0x3) == 0)
-            {
-                for (uint32 i = 0; i < ArrSz(salt); i+= sizeof(counter))
-                    *(uint32*)&keyOut[i] = *(uint32*)&hashChunkNonce[i] ^ counter;
-                return;
-            }
-            // Avoid unaligned memory access per loop turn
-            uint8 cnt[4] = { (uint8)(counter >> 24), (uint8)((counter >> 16) & 0xFF), (uint8)((counter >> 8) & 0xFF), (uint8)(counter & 0xFF) };
-            for (uint32 i = 0; i < ArrSz(salt); i+= sizeof(counter))
-            {
-                keyOut[i+0] = hashChunkNonce[i+0] ^ cnt[0];
-                keyOut[i+1] = hashChunkNonce[i+1] ^ cnt[1];
-                keyOut[i+2] = hashChunkNonce[i+2] ^ cnt[2];
-                keyOut[i+3] = hashChunkNonce[i+3] ^ cnt[3];
-            }
-        }
-        /** Create a new nonce and reset the counter.
-            This creates the 'nonce' in the algorithm described above */
-        void createNewNonce(const KeyT & hash) { counter = 0; memcpy(hashChunkNonce, hash, sizeof(hash)); }
-
         /** Create a new key (and a salt).
             This creates the 'key' in the algorithm described above */
         void createNewKey(KeyT & keyOut)
         {
-            Random::fillBlock(salt, ArrSz(salt));
-            // Hash the random block to prevent state guessing attacks so no data in output comes from the random output directly.
-            BigHashT hash; hash.Start(); hash.Hash(salt, ArrSz(salt)); hash.Finalize(salt);
+            createNewSalt(salt);
             deriveNewKey(keyOut);
         }
+        /** Create a new random salt, to derive a new key from (see deriveKey) */
+        static void createNewSalt(KeyT & outSalt)
+        {
+            Random::fillBlock(outSalt, ArrSz(outSalt));
+            // Hash the random block to prevent state guessing attacks so no data in output comes from the random output directly.
+            BigHashT hash; hash.Start(); hash.Hash(outSalt, ArrSz(outSalt)); hash.Finalize(outSalt);
+        }
 
         /** Get the salt */
         void getCurrentSalt(KeyT & outSalt) const { memcpy(outSalt, salt, ArrSz(salt)); }
@@ -164,11 +179,13 @@ namespace Frost
         /** Set the current salt (extracted from the ciphertext) */
         void setCurrentSalt(const KeyT & inSalt) { memcpy(salt, inSalt, ArrSz(salt)); }
         /** Derive the key out of the current salt */
-        void deriveNewKey(KeyT & keyOut) const
+        void deriveNewKey(KeyT & keyOut) const { deriveKey(salt, keyOut); }
+        /** Derive the key out of the given salt. This does not modify the factory */
+        void deriveKey(const KeyT & inSalt, KeyT & keyOut) const
         {
             KeyDerivFuncT kdf;
             kdf.Hash(masterKey, ArrSz(masterKey));
-            kdf.finalizeWithExtraInfo(keyOut, salt, (uint32)ArrSz(salt));
+            kdf.finalizeWithExtraInfo(keyOut, inSalt, (uint32)ArrSz(inSalt));
         }
     };
 
@@ -178,9 +195,9 @@ namespace Frost
     /** The progress callback that's called regularly by the backup / restoring process */
     struct ProgressCallback
     {
-        enum Action { Backup = 0, Restore, Purge };
+        enum Action { Backup = 0, Restore, Purge, Compact };
         enum FlushMode  { FlushLine = 0, KeepLine, EraseLine };
-        String getActionName(const Action action) { const char * actions[] = {"Backup", "Restore", "Purge"}; return actions[action]; }
+        String getActionName(const Action action) { const char * actions[] = {"Backup", "Restore", "Purge", "Compact"}; return actions[action]; }
 
         /** This method is called while an operation is running.
             The protocol for the sizeDone, totalSize, index and count is as follow:
@@ -218,6 +235,7 @@ namespace Frost
         No          = 0, //!< No overwrite, nor deletion allowed
         Yes         = 1, //!< Overwrite and deletion allowed
         Update      = 2, //!< Overwrite allowed if the new item is newer than the one on the filesystem
+        Delta       = 3, //!< Overwrite and deletion allowed, but only the parts of the existing files that differ from the backup are written
     };
 
     /** Some useful methods to convert between internal checksum to hexdecimal */
@@ -256,6 +274,9 @@ namespace Frost
         /** Ensure the index file is available or recreate if not 
             @return empty string on success, or the error message */
         String ensureValidIndexFile(const String & encryptedIndexPath, const String & localIndexPath, const KeyFactory::KeyT & key, ProgressCallback & callback, const bool forceDecryption = false);
+        /** Encrypt the index file, so the ciphered copy matches the local one
+            @return empty string on success, or the error message */
+        String encryptIndexFile(const String & encryptedIndexPath, const String & localIndexPath, const KeyFactory::KeyT & key, ProgressCallback & callback);
 
         /** Close a currently filled multichunk and save in database and filesystem */
 //        bool closeMultiChunk(const String & basePath, File::MultiChunk & multiChunk, uint64 multichunkListID, uint64 * totalOutSize, ProgressCallback & callback, uint64 & previousMultichunkID, CompressorToUse actualComp = Default);
@@ -593,6 +614,26 @@ namespace Frost
             static int compareData(const Chunk & a, const Chunk & b) { return a.UID < b.UID ? -1 : (a.UID == b.UID ? 0 : 1); }
         };
 
+        /** Where a chunk is stored, so a chunk is found with a single array access (indexed by chunk UID) when restoring */
+        struct ChunkLocation
+        {
+            /** The chunk's position in the consolidated chunk array (or -1 if the chunk does not exist) */
+            uint32 index;
+            /** The chunk's offset in its multichunk (or -1 if unknown) */
+            uint32 offset;
+            /** The multichunk holding the chunk */
+            uint16 multichunkID;
+            /** The chunk's size */
+            uint16 size;
+
+            /** Get the offset in the multichunk, as expected by the multichunk's findChunk method */
+            size_t getOffset() const { return offset == (uint32)-1 ? (size_t)-1 : (size_t)offset; }
+
+            ChunkLocation(const uint32 index = (uint32)-1) : index(index), offset((uint32)-1), multichunkID(0), size(0) {}
+        };
+        /** The chunk locations, indexed by chunk UID */
+        typedef Container::PlainOldData<ChunkLocation>::Array ChunkLocations;
+
         /** Make the checksum type a real type, else it fails to compile with the automatic conversion */
         struct ChecksumType
         {
@@ -787,12 +828,44 @@ namespace Frost
                 if (offset) offsets.Grow(elemCount, (uint32*)(ptr + sizeof(header) + sizeof(_h) + elemCount * sizeof(uint32)));
                 return true;
             }
+            /** In a file's chunk list, an entry with this bit set is a zero extent (a hole or a zero filled area), not a chunk UID.
+                The remaining bits are the extent size in bytes */
+            enum { ZeroExtentFlag = 0x80000000, MaxZeroExtent = 0x7FFFFFFF };
+            /** Check if the given entry is a zero extent */
+            static inline bool isZeroExtent(const uint32 ID) { return (ID & ZeroExtentFlag) != 0; }
+            /** Get the size in bytes of the given zero extent entry */
+            static inline uint32 getZeroExtentSize(const uint32 ID) { return ID & MaxZeroExtent; }
+            /** Check if this list contains any zero extent (the index format version must then be bumped) */
+            bool hasZeroExtent() const
+            {
+                if (offset) return false;
+                for (size_t i = 0; i < chunksID.getSize(); i++) if (isZeroExtent(chunksID[i])) return true;
+                return false;
+            }
+
             /** Append a chunk ID and optional offset to the list */
             void appendChunk(const uint32 ID, const uint32 off = 0)
             {
                 chunksID.Append(ID);
                 if (offset) offsets.Append(off);
             }
+            /** Append a zero extent of the given size to the list (it's merged with the previous one if possible).
+                This is only valid for a file's chunk list (without offsets) */
+            void appendZeroExtent(uint64 size)
+            {
+                if (chunksID.getSize() && isZeroExtent(chunksID[chunksID.getSize() - 1]))
+                {
+                    uint32 & last = chunksID.getElementAtUncheckedPosition(chunksID.getSize() - 1);
+                    uint32 merge = (uint32)min((uint64)(MaxZeroExtent - getZeroExtentSize(last)), size);
+                    last += merge; size -= merge;
+                }
+                while (size)
+                {
+                    uint32 part = (uint32)min((uint64)MaxZeroExtent, size);
+                    chunksID.Append(ZeroExtentFlag | part);
+                    size -= part;
+                }
+            }
             /** Write the structure to the given memory pointer */
             void write(uint8 * ptr)
             {
@@ -862,9 +935,52 @@ namespace Frost
 
         /** The multichunks (it's a hash table of Multichunks which follow each other in the file). The size of this array is stored in the catalog */
         typedef Container::HashTable<Multichunk, uint16> Multichunks;
+
         /** The multichunks from the previous revisions */
         typedef Container::HashTable<Multichunk, uint16, Container::NoHashKey<uint16>, Container::NoDeletion<Multichunk> > MultichunksRO;
 
+        /** A frame in a framed multichunk */
+        struct FrameEntry
+        {
+            /** The frame's offset in the multichunk's chunk array */
+            uint32      dataOffset;
+            /** The frame's size in the multichunk's chunk array */
+            uint32      dataSize;
+            /** The compressed frame's offset, from the end of the frame table */
+            uint32      offset;
+            /** The compressed frame's size */
+            uint32      compressedSize;
+            /** The frame's data checksum (SHA-256) */
+            uint8       checksum[32];
+
+            /** Check if the given offset in the chunk array is in this frame */
+            bool contains(const size_t chunkOffset) const { return chunkOffset >= dataOffset && chunkOffset - dataOffset < dataSize; }
+
+            FrameEntry(const uint32 dataOffset = 0) : dataOffset(dataOffset), dataSize(0), offset(0), compressedSize(0) { memset(checksum, 0, ArrSz(checksum)); }
+        };
+        /** The frames of a framed multichunk */
+        typedef Container::PlainOldData<FrameEntry>::Array FrameEntries;
+        /** A framed multichunk is compressed in independently decodable frames, so a chunk can be read without decoding the whole multichunk.
+            Once decrypted, it starts with the frame table:
+            @verbatim
+                [FrameTable][FrameEntry x frameCount][SHA-256 of the table and entries][Compressed frames]
+            @endverbatim
+            The frames are cut on the chunks boundaries, and each frame contains a part of the multichunk's chunk array (chunk's checksum, size and data). */
+        struct FrameTable
+        {
+            /** The magic number */
+            char        magic[4];
+            /** The number of frames */
+            uint32      frameCount;
+
+            /** Check if the table is correct */
+            bool isCorrect() const { return memcmp(magic, "FrFr", 4) == 0; }
+            /** Get the size of the table, including the entries and the checksum */
+            uint64 getSize() const { return sizeof(FrameTable) + frameCount * sizeof(FrameEntry) + 32; }
+
+            FrameTable(const uint32 frameCount = 0) : frameCount(frameCount) { memcpy(magic, "FrFr", 4); }
+        };
+
         /** The filter arguments. Usually, there's only one of them in the index file */
         struct FilterArguments
         {
@@ -1219,6 +1335,9 @@ namespace Frost
         {
 	    /** The ciphered master key size */
 	    enum { CipheredMasterKeySize = 108 };
+            /** The format versions. The chunk lists can contain zero extents since version 4, so an index is only
+                bumped to it when they do, and the older versions of Frost refuse it instead of failing on the missing chunks */
+            enum { InitialVersion = 3, ZeroExtentsVersion = 4 };
             /** The magic number */
             union { uint32 number; char text[4]; } magic;
             /** The file version and state */
@@ -1229,7 +1348,7 @@ namespace Frost
             uint8 cipheredMasterKey[CipheredMasterKeySize];
 
             /** Assert the file is valid */
-            bool isSupportedFormat() const { return memcmp(magic.text, "Frst", 4) == 0 && version == 3; }
+            bool isSupportedFormat() const { return memcmp(magic.text, "Frst", 4) == 0 && (version == InitialVersion || version == ZeroExtentsVersion); }
             /** Check correctness of this information for testing purpose */
             bool isCorrect(const uint64 fileSize, const uint64 fileOffset = 0) const { return isSupportedFormat() && catalogOffset.fileOffset() <= (fileSize - sizeof(Catalog)) && !isZero(cipheredMasterKey); }
             /** Get the structure size (as some have optional fields) */
@@ -1246,11 +1365,89 @@ namespace Frost
 
 
             /** Default construction */
-            MainHeader() : version(3) { memcpy(magic.text, "Frst", 4); memset(cipheredMasterKey, 0, ArrSz(cipheredMasterKey)); }
+            MainHeader() : version(InitialVersion) { memcpy(magic.text, "Frst", 4); memset(cipheredMasterKey, 0, ArrSz(cipheredMasterKey)); }
+        };
+
+        /** The checkpoint file header.
+            A checkpoint saves the revision being built so an interrupted backup can be resumed. It's stored in its own file, and this header is followed by
+            the revision's chunks, chunk lists, multichunks, filter arguments and file tree (in this order) */
+        struct CheckpointHeader
+        {
+            /** The magic number */
+            union { uint32 number; char text[4]; } magic;
+            /** The revision being built */
+            uint32 revision;
+            /** The index's last revision when the checkpoint was saved (a checkpoint is only valid for the index it was made from) */
+            uint32 baseRevision;
+            /** The index file size when the checkpoint was saved */
+            uint64 indexSize;
+            /** The maximum chunk, chunk list and multichunk identifiers allocated */
+            uint32 maxChunkID, maxChunkListID, maxMultichunkID;
+            /** The number of chunk lists and multichunks saved */
+            uint32 chunkListsCount, multichunksCount;
+            /** The size of the multichunks stored so far (this is filled by the backup process) */
+            uint64 backupSize;
+
+            /** Check if the magic number is correct */
+            bool isCorrect() const { return memcmp(magic.text, "FrCp", 4) == 0; }
+            /** Get the structure size */
+            static uint64 getSize() { return sizeof(CheckpointHeader); }
+
+            CheckpointHeader() { memset(this, 0, sizeof(*this)); memcpy(magic.text, "FrCp", 4); }
+        };
+
+        /** The reference counts file header.
+            The reference counts are stored in their own file next to the index, so purging only needs to walk the revisions being removed.
+            This header is followed by the chunk lists' counts then the chunks' counts (one uint32 per UID) */
+        struct RefCountsHeader
+        {
+            /** The magic number */
+            union { uint32 number; char text[4]; } magic;
+            /** The index's last revision when the counts were saved (the counts are only valid for the index they were made from) */
+            uint32 revision;
+            /** The index file size when the counts were saved */
+            uint64 indexSize;
+            /** The number of chunk lists' and chunks' counts that follow */
+            uint32 listsCount, chunksCount;
+
+            /** Check if the magic number is correct */
+            bool isCorrect() const { return memcmp(magic.text, "FrRc", 4) == 0; }
+            /** Get the structure size */
+            static uint64 getSize() { return sizeof(RefCountsHeader); }
+
+            RefCountsHeader() { memset(this, 0, sizeof(*this)); memcpy(magic.text, "FrRc", 4); }
         };
 
 #pragma pack(pop)
 
+        /** A dense bitmap indexed by UID, to mark the chunks or chunk lists in use without sorting or searching them */
+        struct UIDBitmap
+        {
+            Utils::MemoryBlock bits;
+
+            /** Check if the given UID is marked */
+            inline bool isSet(const uint32 uid) const { return (uid >> 3) < bits.getSize() && (bits.getConstBuffer()[uid >> 3] & (1 << (uid & 7))); }
+            /** Mark the given UID
+                @return false if it was already marked */
+            inline bool set(const uint32 uid)
+            {
+                if ((uid >> 3) >= bits.getSize())
+                {   // Unexpected UID, so grow to fit it
+                    const uint32 previous = bits.getSize(), size = max((uid >> 3) + 1, previous * 2);
+                    if (!bits.ensureSize(size, true)) return false;
+                    memset(bits.getBuffer() + previous, 0, size - previous);
+                }
+                uint8 & byte = bits.getBuffer()[uid >> 3];
+                const uint8 mask = (uint8)(1 << (uid & 7));
+                if (byte & mask) return false;
+                byte |= mask;
+                return true;
+            }
+
+            /** Build a bitmap for the given maximum UID */
+            UIDBitmap(const uint32 maxUID) : bits((maxUID >> 3) + 1) { memset(bits.getBuffer(), 0, bits.getSize()); }
+        };
+
         /** The index file helper class.
             This class provided everything method required to deal with the file format being used */
         class IndexFile
@@ -1265,6 +1462,8 @@ namespace Frost
             Chunks          consolidated;
             /** The chunk map table */
             Utils::ScopePtr<ChunkIndexMap> chunkIndices;
+            /** The chunk locations (only built for read only index) */
+            ChunkLocations  chunkLocations;
             /** The previous revision maximum chunk ID */
             uint32          prevRevisionMaxChunkID;
             /** The maximum chunk id found */
@@ -1282,6 +1481,8 @@ namespace Frost
             Multichunks     multichunks;
             /** The multichunks list for previous sessions */
             MultichunksRO   multichunksRO;
+            /** The multichunks of previous sessions that were reopened in this session, their record is replaced when saving */
+            Multichunks     replacedMultichunks;
             /** The maximum multichunk UID */
             uint16          maxMultichunkID;
             /** The filters arguments */
@@ -1297,6 +1498,13 @@ namespace Frost
             /** The memory mapped file */
             Utils::ScopePtr<Stream::MemoryMappedFileStream>      file;
 
+            /** The number of file tree items referring to each chunk list UID, in all revisions */
+            Container::PlainOldData<uint32>::Array listRefs;
+            /** The number of occurrences of each chunk UID in the referenced chunk lists */
+            Container::PlainOldData<uint32>::Array chunkRefs;
+            /** If set, the reference counts file that's updated when a revision is saved */
+            String          refCountsPath;
+
             // Interface
         public:
             // Read-only first
@@ -1328,6 +1536,16 @@ namespace Frost
             uint32 findChunk(Chunk & chunk) const;
             /** Search the chunks by UID */
             const Chunk * findChunk(const uint32 uid) const;
+            /** Get the location of a chunk by UID in O(1) (only for read only index)
+                @return 0 if the chunk does not exist */
+            const ChunkLocation * getChunkLocation(const uint32 uid) const
+            {
+                if (uid >= chunkLocations.getSize()) return 0;
+                const ChunkLocation & location = chunkLocations.getElementAtPosition(uid);
+                return location.index != (uint32)-1 ? &location : 0;
+            }
+            /** Get the chunk at the given location */
+            const Chunk & getChunk(const ChunkLocation & location) const { return consolidated.chunks.getElementAtPosition(location.index); }
 
             /** Get the current catalog */
             const Catalog * getCatalog() const { return catalog; }
@@ -1336,12 +1554,15 @@ namespace Frost
             {
                 if (rev > catalog->revision) return 0;
                 const Catalog * c = catalog;
-                while (c && c->revision != rev) { if (!Map(c, c->previous)) return 0; }
+                // The first revisions might be missing if they were purged in place
+                while (c && c->revision != rev) { if (!c->previous.fileOffset() || !Map(c, c->previous)) return 0; }
                 return c;
             }
 
             /** Allocate a multichunk ID */
             uint16 nextMultichunkID() const { return maxMultichunkID + 1; }
+            /** Get the largest multichunk ID used so far (0 if none) */
+            uint16 lastMultichunkID() const { return maxMultichunkID; }
             /** Allocate a multichunk ID */
             uint16 allocateMultichunkID() { return ++maxMultichunkID; }
             /** Allocate a chunklist ID */
@@ -1364,6 +1585,8 @@ namespace Frost
             bool shouldResizeChunkIndexMap() const { return chunkIndices ? chunkIndices->shouldResize() : false; }
             /** Resize the chunk index map */
             bool resizeChunkIndexMap();
+            /** Build the chunk locations table from the consolidated chunks and the multichunks' chunk lists */
+            void buildChunkLocations();
 
             /** Map a structure at the given position */
             template <typename T>
@@ -1376,13 +1599,21 @@ namespace Frost
             bool LoadRO(T & s, const Offset & offset) const { return s.loadReadOnly(file->getBuffer() + offset.fileOffset(), file->fullSize() - offset.fileOffset()); }
 
             // Write operations
-            /** Append a chunk to the internal chunk array (common and private version) */
+            /** Append a chunk to the internal chunk array (common and private version)
+                @return false if the chunk can't be stored (including when the UIDs reached ChunkList::ZeroExtentFlag) */
             bool appendChunk(Chunk & chunk, const uint32 forceUID = 0);
             /** Append a multichunk to this file (and its chunk list)
                 @param mchunk   A pointer to a new allocated multichunk that is owned
                 @param list     A pointer to a new allocated list that is owned
                 @return true on success */
             bool appendMultichunk(Multichunk * mchunk, ChunkList * list);
+            /** Replace a multichunk of a previous session that was reopened and stored again with more chunks.
+                The new chunk list and record are saved with this revision. The record replaces the previous ones when the index is read,
+                so the multichunk keeps its UID and its previous chunks don't need to be remapped.
+                @param mchunk   A pointer to a new allocated multichunk that is owned, with the UID of the reopened multichunk
+                @param list     A pointer to a new allocated list that is owned, with all the chunks of the multichunk
+                @return true on success */
+            bool replaceMultichunk(Multichunk * mchunk, ChunkList * list);
             /** Append a file item
                 @param item     A pointer to a new allocated file item
                 @param list     A pointer to a new allocated list that's owned
@@ -1403,6 +1634,72 @@ namespace Frost
             String close();
             /** Tell the backup was empty, so don't save anything and avoid growing the file with useless filetree and catalogs */
             inline void backupWasEmpty() { readOnly = true; }
+
+            // Checkpoints
+            /** Save a checkpoint of the revision being built, so an interrupted backup can be resumed.
+                Only what's actually stored in the remote is saved: the closed multichunks, their chunks and the chunk lists that only refer to stored chunks.
+                @param path     The checkpoint file path (it's replaced atomically)
+                @param stats    The checkpoint header with the backup size filled, the other fields are set by this method
+                @return A empty string on success, or a translated error message on error */
+            String saveCheckpoint(const String & path, CheckpointHeader & stats);
+            /** Load a checkpoint in the revision being built.
+                The checkpoint's chunks, chunk lists, multichunks and filter arguments are appended to this revision, but its file tree is not (the backup process rebuilds it)
+                @param path     The checkpoint file path
+                @param tree     On output, the file tree that was saved (an item whose chunk list does not exist was not completely stored)
+                @param stats    On output, the checkpoint header with the backup size
+                @return A empty string on success, or a translated error message on error */
+            String loadCheckpoint(const String & path, FileTree & tree, CheckpointHeader & stats);
+
+            // Reference counts
+            /** Get the reference counts file path for the given index file */
+            static String getRefCountsPath(const String & indexPath) { return indexPath + ".refs"; }
+            /** Keep the given reference counts file up to date when a revision is saved.
+                The counts are only updated if the file matches the index (or if the index is new), else they are rebuilt when purging */
+            void maintainRefCounts(const String & path) { refCountsPath = path; }
+            /** Load the reference counts saved for this index
+                @return false if the file does not exist or was not saved for this index's state */
+            bool loadRefCounts(const String & path);
+            /** Save the reference counts
+                @param path         The reference counts file path (it's replaced atomically)
+                @param revision     The index's last revision
+                @param indexSize    The index file size
+                @return A empty string on success, or a translated error message on error */
+            String saveRefCounts(const String & path, const uint32 revision, const uint64 indexSize) const;
+            /** Rebuild the reference counts by walking all the revisions */
+            void rebuildRefCounts();
+            /** Count the references of the given file tree */
+            void addReferences(const FileTree & tree);
+            /** Remove the references of the given file tree.
+                @param visitedLists The chunk lists already visited, they are marked on output
+                @param referenced   On output, the chunks referenced by the file tree are marked */
+            void removeReferences(const FileTree & tree, UIDBitmap & visitedLists, UIDBitmap & referenced);
+            /** Get the number of references to the given chunk */
+            uint32 getChunkReferences(const uint32 uid) const { return uid < chunkRefs.getSize() ? chunkRefs.getElementAtPosition(uid) : 0; }
+            /** Get the number of file tree items referring to the given chunk list */
+            uint32 getChunkListReferences(const uint32 uid) const { return uid < listRefs.getSize() ? listRefs.getElementAtPosition(uid) : 0; }
+
+            // Purging
+            /** Purge the revisions up to the given one, without rewriting the whole index.
+                The kept revisions' catalogs are appended again, on top of a new base holding what's still used from the purged revisions
+                (chunks, chunk lists and multichunks) and the repacked multichunks. A kept revision's block is only written again if it refers
+                to a removed or repacked multichunk. The purged revisions' blocks are left unreachable in the file until it's compacted.
+                The index must be opened read only, the reference counts must not count the purged revisions anymore, and the repacked chunks
+                must have their multichunk updated in the consolidated array.
+                @param filePath             The index file path (it's opened again for writing)
+                @param upToRevision         The last revision to purge (inclusive)
+                @param removedMultichunks   The multichunks that are removed or repacked (their chunk list is removed too)
+                @param lists                The repacked multichunks' chunk lists
+                @param mchunks              The repacked multichunks
+                @return A empty string on success, or a translated error message on error */
+            String purgeInPlace(const String & filePath, const uint32 upToRevision, const UIDBitmap & removedMultichunks, ChunkLists & lists, Multichunks & mchunks);
+            /** Write a compacted copy of this index to the given path.
+                The first revision's catalog holds all the chunks (sorted by UID), chunk lists and multichunks, and the other revisions' catalogs
+                only hold their file tree and metadata, so opening the copy does not depend on the number of revisions anymore.
+                The revisions keep their number, and the unreachable blocks left by purging in place are dropped.
+                The index must be opened read only.
+                @param filePath             The path of the compacted index (it must not exist)
+                @return A empty string on success, or a translated error message on error */
+            String compact(const String & filePath);
         };
     }
 
@@ -1413,8 +1710,16 @@ namespace Frost
         @param revisionID       The current backup revision identifier
         @param callback         The progress callback that's called at regular interval
         @param strategy         The backing up strategy ('Slow' means reopening last multichunk to append to it thus creating less files in backup folder, 'Fast' is default)
+        @param journalPath      If not empty, the path to the change journal written by watchFolder. When valid, only the changed entries are scanned
         @return A string describing the error, or an empty string on success */
-    String backupFolder(const String & folderToBackup, const String & backupTo, const unsigned int revisionID, ProgressCallback & callback, const PurgeStrategy strategy = Fast);
+    String backupFolder(const String & folderToBackup, const String & backupTo, const unsigned int revisionID, ProgressCallback & callback, const PurgeStrategy strategy = Fast, const String & journalPath = "");
+    /** Watch the given folder for changes and record them in the change journal, until interrupted.
+        The next backup of this folder then only scans the changed entries.
+        @param folderToWatch    The folder to watch (the one that's backed up)
+        @param journalPath      The path to the change journal
+        @param callback         The progress callback
+        @return A string describing the error, or an empty string on success */
+    String watchFolder(const String & folderToWatch, const String & journalPath, ProgressCallback & callback);
     /** List available backups.
         @param folderToBackup   This the root of the folder to backup. All files will be saved in the backup relative to this root folder
         @param backupTo         The folder to store the multichunk into.
@@ -1428,6 +1733,10 @@ namespace Frost
         @param upToRevision     The last revision to clean up (inclusive)
         @return A string describing the error, or an empty string on success */
     String purgeBackup(const String & chunkFolder, ProgressCallback & callback, const PurgeStrategy strategy = Fast, const unsigned int upToRevision = 0);
+    /** Compact the index file, so it's fast to open whatever the number of revisions.
+        @param callback         The progress callback
+        @return A string describing the error, or an empty string on success */
+    String compactIndex(ProgressCallback & callback);
     /* Restore a backup to the given folder.
         @param folderToRestore  This the root of the folder to restore the files into. All files will be restored from their relative position in the backup to this root folder
         @param restoreFrom      The folder to load the multichunk from.